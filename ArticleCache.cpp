@@ -0,0 +1,300 @@
+/*
+ *  ArticleCache.cpp
+ *  Wiki2Touch/wikisrvd
+ *
+ *  Copyright (c) 2008 by Tom Haukap.
+ *
+ *  This file is part of Wiki2Touch.
+ *
+ *  Wiki2Touch is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Wiki2Touch is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Wiki2Touch. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "Settings.h"
+#include "ArticleCache.h"
+
+#define ARTICLEFILE_MAGIC "W2TV"
+
+typedef struct tagCACHEDARTICLE
+{
+	long long dataFileSize;
+	long long dataFileTime;
+
+	char*	html;
+	size_t	length;
+} CACHEDARTICLE;
+
+// the files in <lang>/cache/html/ start with this header followed by the title and the html
+typedef struct tagARTICLEFILEHEADER
+{
+	char	magic[4];
+	char	variant[8];
+	long long dataFileSize;
+	long long dataFileTime;
+	int		titleLength;
+	int		htmlLength;
+} ARTICLEFILEHEADER;
+
+ArticleCache::ArticleCache(size_t maxSize, bool useDisk) : LruCache(maxSize, ARTICLECACHE_BUCKETS)
+{
+	_useDisk = useDisk;
+	_diskHits = 0;
+}
+
+ArticleCache::~ArticleCache()
+{
+	Clear();
+}
+
+char* ArticleCache::Get(const string& languageCode, const string& title, size_t* length)
+{
+	*length = 0;
+
+	if ( !_maxSize && !_useDisk )
+		return NULL;
+
+	long long dataFileSize, dataFileTime;
+	if ( !DataFileIdentity(languageCode, &dataFileSize, &dataFileTime) )
+		return NULL;
+
+	string variant = __settings->RenderVariant();
+	string key = languageCode + ":" + title + variant;
+	unsigned int hash = Hash(key);
+
+	pthread_mutex_lock(&_mutex);
+
+	CACHEDARTICLE* item = (CACHEDARTICLE*) Use(key, hash);
+	if ( item && (item->dataFileSize!=dataFileSize || item->dataFileTime!=dataFileTime) )
+	{
+		// rendered from another data file
+		Remove(key, hash);
+		item = NULL;
+	}
+
+	if ( item )
+	{
+		_hits++;
+
+		char* html = (char*) malloc(item->length);
+		memcpy(html, item->html, item->length);
+		*length = item->length;
+
+		pthread_mutex_unlock(&_mutex);
+
+		return html;
+	}
+
+	pthread_mutex_unlock(&_mutex);
+
+	char* html = NULL;
+	if ( _useDisk )
+		html = ReadFromDisk(languageCode, title, variant, hash, dataFileSize, dataFileTime, length);
+
+	pthread_mutex_lock(&_mutex);
+	if ( html )
+		_diskHits++;
+	else
+		_misses++;
+	pthread_mutex_unlock(&_mutex);
+
+	if ( html && _maxSize )
+	{
+		char* copy = (char*) malloc(*length);
+		memcpy(copy, html, *length);
+
+		AddToMemory(key, hash, dataFileSize, dataFileTime, copy, *length);
+	}
+
+	return html;
+}
+
+void ArticleCache::Add(const string& languageCode, const string& title, char* html, size_t length)
+{
+	long long dataFileSize, dataFileTime;
+	if ( !html || !DataFileIdentity(languageCode, &dataFileSize, &dataFileTime) )
+	{
+		if ( html )
+			free(html);
+		return;
+	}
+
+	string variant = __settings->RenderVariant();
+	string key = languageCode + ":" + title + variant;
+	unsigned int hash = Hash(key);
+
+	if ( _useDisk )
+		WriteToDisk(languageCode, title, variant, hash, dataFileSize, dataFileTime, html, length);
+
+	AddToMemory(key, hash, dataFileSize, dataFileTime, html, length);
+}
+
+int ArticleCache::NumberOfArticles()
+{
+	return _numberOfItems;
+}
+
+unsigned int ArticleCache::DiskHits()
+{
+	return _diskHits;
+}
+
+bool ArticleCache::DataFileIdentity(const string& languageCode, long long* size, long long* time)
+{
+	TitleIndex* titleIndex = __settings->GetTitleIndex(languageCode);
+	if ( !titleIndex || titleIndex->DataFileName().empty() )
+		return false;
+
+	struct stat statbuf;
+	if ( stat(titleIndex->DataFileName().c_str(), &statbuf) )
+		return false;
+
+	*size = statbuf.st_size;
+	*time = statbuf.st_mtime;
+
+	return true;
+}
+
+string ArticleCache::DiskFileName(const string& languageCode, unsigned int hash)
+{
+	char name[16];
+	snprintf(name, sizeof(name), "%08x.html", hash);
+
+	return __settings->Path() + languageCode + "/cache/html/" + name;
+}
+
+char* ArticleCache::ReadFromDisk(const string& languageCode, const string& title, const string& variant, unsigned int hash, long long dataFileSize, long long dataFileTime, size_t* length)
+{
+	string filename = DiskFileName(languageCode, hash);
+
+	FILE* f = fopen(filename.c_str(), "rb");
+	if ( !f )
+		return NULL;
+
+	ARTICLEFILEHEADER header;
+	char* html = NULL;
+
+	// a page rendered with other settings isn't used
+	char fileVariant[sizeof(header.variant)];
+	memset(fileVariant, 0, sizeof(fileVariant));
+	strncpy(fileVariant, variant.c_str(), sizeof(fileVariant) - 1);
+
+	if ( fread(&header, sizeof(header), 1, f)==1 && !memcmp(header.magic, ARTICLEFILE_MAGIC, 4) &&
+		 !memcmp(header.variant, fileVariant, sizeof(fileVariant)) &&
+		 header.dataFileSize==dataFileSize && header.dataFileTime==dataFileTime &&
+		 header.titleLength==(int) title.length() && header.htmlLength>0 )
+	{
+		// different titles may share a file name
+		char fileTitle[header.titleLength+1];
+		if ( fread(fileTitle, 1, header.titleLength, f)==(size_t) header.titleLength && !memcmp(fileTitle, title.c_str(), header.titleLength) )
+		{
+			html = (char*) malloc(header.htmlLength);
+			if ( fread(html, 1, header.htmlLength, f)==(size_t) header.htmlLength )
+				*length = header.htmlLength;
+			else
+			{
+				free(html);
+				html = NULL;
+			}
+		}
+	}
+
+	fclose(f);
+
+	return html;
+}
+
+void ArticleCache::WriteToDisk(const string& languageCode, const string& title, const string& variant, unsigned int hash, long long dataFileSize, long long dataFileTime, const char* html, size_t length)
+{
+	string path = __settings->Path() + languageCode + "/cache";
+	mkdir(path.c_str(), 0755);
+
+	path += "/html";
+	mkdir(path.c_str(), 0755);
+
+	string filename = DiskFileName(languageCode, hash);
+
+	// write it to a temporary file first so concurrent requests never read a partially written page
+	string tempFilename = filename + ".XXXXXX";
+	char tempName[tempFilename.length()+1];
+	strcpy(tempName, tempFilename.c_str());
+
+	int fd = mkstemp(tempName);
+	if ( fd<0 )
+		return;
+
+	FILE* f = fdopen(fd, "wb");
+	if ( !f )
+	{
+		close(fd);
+		unlink(tempName);
+		return;
+	}
+
+	ARTICLEFILEHEADER header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, ARTICLEFILE_MAGIC, 4);
+	strncpy(header.variant, variant.c_str(), sizeof(header.variant) - 1);
+	header.dataFileSize = dataFileSize;
+	header.dataFileTime = dataFileTime;
+	header.titleLength = title.length();
+	header.htmlLength = length;
+
+	bool error = fwrite(&header, sizeof(header), 1, f)!=1 ||
+		fwrite(title.c_str(), 1, title.length(), f)!=title.length() ||
+		fwrite(html, 1, length, f)!=length;
+
+	if ( fclose(f)==0 && !error )
+		rename(tempName, filename.c_str());
+	else
+		unlink(tempName);
+}
+
+void ArticleCache::AddToMemory(const string& key, unsigned int hash, long long dataFileSize, long long dataFileTime, char* html, size_t length)
+{
+	CACHEDARTICLE* item = new CACHEDARTICLE;
+	item->dataFileSize = dataFileSize;
+	item->dataFileTime = dataFileTime;
+	item->html = html;
+	item->length = length;
+
+	pthread_mutex_lock(&_mutex);
+
+	CACHEDARTICLE* cached = (CACHEDARTICLE*) Find(key, hash);
+	if ( cached && (cached->dataFileSize!=dataFileSize || cached->dataFileTime!=dataFileTime) )
+	{
+		Remove(key, hash);
+		cached = NULL;
+	}
+
+	// another thread may have been faster
+	bool added = !cached && Insert(key, hash, item, length);
+
+	pthread_mutex_unlock(&_mutex);
+
+	if ( !added )
+		FreeValue(item);
+}
+
+void ArticleCache::FreeValue(void* value)
+{
+	CACHEDARTICLE* item = (CACHEDARTICLE*) value;
+
+	free(item->html);
+	delete(item);
+}
@@ -0,0 +1,69 @@
+/*
+ *  ArticleCache.h
+ *  Wiki2Touch/wikisrvd
+ *
+ *  Copyright (c) 2008 by Tom Haukap.
+ *
+ *  This file is part of Wiki2Touch.
+ *
+ *  Wiki2Touch is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Wiki2Touch is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Wiki2Touch. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef ARTICLECACHE_H
+#define ARTICLECACHE_H
+
+#include "LruCache.h"
+
+#define ARTICLECACHE_BUCKETS 256
+
+/*
+ * Keeps the rendered (utf-8 encoded) html of the articles. The pages are kept 
+ * in memory (the least recently used are dropped if the size of all pages 
+ * exceeds the given limit) and optionally in <lang>/cache/html/. Every page
+ * remembers size and modification time of the data file it was rendered from,
+ * pages of a replaced data file are never returned; the settings changing the
+ * html (Settings::RenderVariant()) are a part of the key.
+ */
+class ArticleCache : public LruCache
+{
+public:
+	ArticleCache(size_t maxSize, bool useDisk);
+	~ArticleCache();
+
+	// returns the (malloc'ed) html of the article or NULL if it isn't cached,
+	// the size is stored in length
+	char* Get(const string& languageCode, const string& title, size_t* length);
+
+	// adds the html of an article, the cache takes the ownership of the (malloc'ed) html
+	void Add(const string& languageCode, const string& title, char* html, size_t length);
+
+	int NumberOfArticles();
+	unsigned int DiskHits();
+
+protected:
+	void FreeValue(void* value);
+
+private:
+	bool _useDisk;
+	unsigned int _diskHits;
+
+	bool DataFileIdentity(const string& languageCode, long long* size, long long* time);
+	string DiskFileName(const string& languageCode, unsigned int hash);
+	char* ReadFromDisk(const string& languageCode, const string& title, const string& variant, unsigned int hash, long long dataFileSize, long long dataFileTime, size_t* length);
+	void WriteToDisk(const string& languageCode, const string& title, const string& variant, unsigned int hash, long long dataFileSize, long long dataFileTime, const char* html, size_t length);
+
+	void AddToMemory(const string& key, unsigned int hash, long long dataFileSize, long long dataFileTime, char* html, size_t length);
+};
+
+#endif
@@ -0,0 +1,120 @@
+/*
+ *  BlockCache.cpp
+ *  Wiki2Touch/wikisrvd
+ *
+ *  Copyright (c) 2008 by Tom Haukap.
+ *
+ *  This file is part of Wiki2Touch.
+ *
+ *  Wiki2Touch is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Wiki2Touch is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Wiki2Touch. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "BlockCache.h"
+
+typedef struct tagCACHEDBLOCK
+{
+	char*	data;
+	size_t	size;
+} CACHEDBLOCK;
+
+BlockCache::BlockCache(size_t maxSize) : LruCache(maxSize, BLOCKCACHE_BUCKETS)
+{
+}
+
+BlockCache::~BlockCache()
+{
+	Clear();
+}
+
+int BlockCache::Read(string dataFileName, fpos_t blockPos, int pos, int length, char* buffer)
+{
+	if ( !_maxSize )
+		return -1;
+
+	string key = Key(dataFileName, blockPos);
+	unsigned int hash = Hash(key);
+
+	pthread_mutex_lock(&_mutex);
+
+	CACHEDBLOCK* block = (CACHEDBLOCK*) Use(key, hash);
+	if ( !block )
+	{
+		_misses++;
+		pthread_mutex_unlock(&_mutex);
+		return -1;
+	}
+
+	_hits++;
+
+	int read = 0;
+	if ( pos>=0 && (size_t) pos<block->size )
+	{
+		read = block->size - pos;
+		if ( read>length )
+			read = length;
+
+		memcpy(buffer, block->data + pos, read);
+	}
+
+	pthread_mutex_unlock(&_mutex);
+
+	return read;
+}
+
+void BlockCache::Add(string dataFileName, fpos_t blockPos, char* data, size_t size)
+{
+	if ( !data )
+		return;
+
+	string key = Key(dataFileName, blockPos);
+	unsigned int hash = Hash(key);
+
+	CACHEDBLOCK* block = new CACHEDBLOCK;
+	block->data = data;
+	block->size = size;
+
+	pthread_mutex_lock(&_mutex);
+
+	// another thread may have been faster
+	bool added = !Find(key, hash) && Insert(key, hash, block, size);
+
+	pthread_mutex_unlock(&_mutex);
+
+	if ( !added )
+		FreeValue(block);
+}
+
+int BlockCache::NumberOfBlocks()
+{
+	return _numberOfItems;
+}
+
+void BlockCache::FreeValue(void* value)
+{
+	CACHEDBLOCK* block = (CACHEDBLOCK*) value;
+
+	free(block->data);
+	delete(block);
+}
+
+string BlockCache::Key(const string& dataFileName, fpos_t blockPos)
+{
+	char pos[24];
+	snprintf(pos, sizeof(pos), ":%llx", (long long) blockPos);
+
+	return dataFileName + pos;
+}
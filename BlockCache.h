@@ -0,0 +1,58 @@
+/*
+ *  BlockCache.h
+ *  Wiki2Touch/wikisrvd
+ *
+ *  Copyright (c) 2008 by Tom Haukap.
+ *
+ *  This file is part of Wiki2Touch.
+ *
+ *  Wiki2Touch is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Wiki2Touch is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Wiki2Touch. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef BLOCKCACHE_H
+#define BLOCKCACHE_H
+
+#include <stdio.h>
+#include "LruCache.h"
+
+#define BLOCKCACHE_BUCKETS 256
+
+/*
+ * Keeps the decompressed bzip2 blocks of the data files, the least recently used
+ * blocks are dropped if the size of all blocks exceeds the given limit. The cache
+ * is shared by all languages and threads.
+ */
+class BlockCache : public LruCache
+{
+public:
+	BlockCache(size_t maxSize);
+	~BlockCache();
+
+	// copies up to length bytes starting at pos from a cached block into buffer,
+	// returns the number of bytes copied or -1 if the block isn't cached
+	int Read(string dataFileName, fpos_t blockPos, int pos, int length, char* buffer);
+
+	// adds a decompressed block, the cache takes the ownership of the (malloc'ed) data
+	void Add(string dataFileName, fpos_t blockPos, char* data, size_t size);
+
+	int NumberOfBlocks();
+
+protected:
+	void FreeValue(void* value);
+
+private:
+	static string Key(const string& dataFileName, fpos_t blockPos);
+};
+
+#endif
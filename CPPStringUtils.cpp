@@ -21,10 +21,37 @@
  */
 
 #include "CPPStringUtils.h"
+#include "StringUtils.h"
 
 inline char    _to_lower(const char c)     {if (((unsigned char)c)<0x80) return tolower(c); else if (((unsigned char)c)>=0xc0 && ((unsigned char) c)<0xdf) return (unsigned char)c+0x20; else return c;};
 inline wchar_t _to_wlower(const wchar_t c) {if (c<0x80) return towlower(c); else if (c>=0xc0 && c<0xdf) return c+0x20; else return c;};
 
+// writes the utf-8 sequence of c (up to 4 bytes), returns the position behind it
+inline unsigned char* _put_utf8(unsigned int c, unsigned char* dest)
+{
+	if ( c<0x00080 )
+		*dest++ = c;
+	else if ( c<0x00800 ) 
+	{
+		*dest++ = (0xc0 | (c>>6));
+		*dest++ = (0x80 | (c & 0x3f));
+	}
+	else if ( c<0x010000 )
+	{
+		*dest++ = (0xe0 | (c>>12));
+		*dest++ = (0x80 | (c>>6 & 0x3f));
+		*dest++ = (0x80 | (c & 0x3f));
+	}
+	else {
+		*dest++ = (0xf0 | (c>>18));
+		*dest++ = (0x80 | (c>>12 & 0x3f));
+		*dest++ = (0x80 | (c>>6 & 0x3f));
+		*dest++ = (0x80 | (c & 0x3f));
+	}
+	
+	return dest;
+}
+
 std::string CPPStringUtils::to_string(const std::wstring source)
 {
 	string dest = string();
@@ -113,31 +140,12 @@ std::string CPPStringUtils::to_utf8(const std::string source)
 std::string CPPStringUtils::to_utf8(const std::wstring source)
 {
 	string dest = string();
-	int length = source.length();
-
-	for(int i=0; i<length; i++)
-	{
-		unsigned int c = (unsigned int) source[i]; 
-		if ( c<0x00080 )
-			dest += c;
-		else if ( c<0x00800 ) 
-		{
-			dest += (0xc0 | (c>>6));
-			dest += (0x80 | (c & 0x3f));
-		}
-		else if ( c<0x010000 )
-		{
-			dest += (0xe0 | (c>>12));
-			dest += (0x80 | (c>>6 & 0x3f));
-			dest += (0x80 | (c & 0x3f));
-		}
-		else {
-			dest += (0xf0 | (c>>18));
-			dest += (0x80 | (c>>12 & 0x3f));
-			dest += (0x80 | (c>>6 & 0x3f));
-			dest += (0x80 | (c & 0x3f));
-		}
-	}
+	if ( source.empty() )
+		return dest;
+	
+	// encode directly into the string, the length is known in advance
+	dest.resize(utf8_length(source.data(), source.length()));
+	encode_utf8(source.data(), source.length(), &dest[0]);
 	
 	return dest;
 }
@@ -196,15 +204,35 @@ std::string CPPStringUtils::from_utf8(const std::string source)
 }
 
 std::wstring CPPStringUtils::from_utf8w(const std::string source)
+{
+	return from_utf8w(source.data(), source.length());
+}
+
+std::wstring CPPStringUtils::from_utf8w(const char* source, size_t length)
 {
 	wstring dest = wstring();
-	int length = source.length();
+	if ( !length )
+		return dest;
 	
-	for(int i=0; i<length; i++)
+	// decode directly into the string, there are never more chars than bytes
+	dest.resize(length+1);
+	dest.resize(decode_utf8(source, length, &dest[0]));
+	
+	return dest;
+}
+
+size_t CPPStringUtils::decode_utf8(const char* source, size_t length, wchar_t* dest)
+{
+	wchar_t* pDest = dest;
+	
+	for(size_t i=0; i<length; i++)
 	{
 		unsigned int c1 = (unsigned char) source[i];
 		if ( c1<0x80 ) {
-			dest += c1;
+			// take the whole run of ascii chars
+			size_t count = copy_ascii(source + i, length - i, pDest);
+			pDest += count;
+			i += count - 1;
 		}
 		else if ( (c1 & 0xe0)==0xc0 )
 		{
@@ -213,7 +241,7 @@ std::wstring CPPStringUtils::from_utf8w(const std::string source)
 				i++;
 				unsigned int c2 = (unsigned char) source[i];
 				
-				dest += (((c1 & 0x1f)<<6) | (c2 & 0x3f));
+				*pDest++ = (((c1 & 0x1f)<<6) | (c2 & 0x3f));
 			}
 			else
 				i = length-1;
@@ -228,7 +256,7 @@ std::wstring CPPStringUtils::from_utf8w(const std::string source)
 				i++;
 				unsigned int c3 = (unsigned char) source[i];
 
-				dest += (((c1 & 0x0f)<<12) | ((c2 & 0x3f)<<6) | (c3 & 0x3f));
+				*pDest++ = (((c1 & 0x0f)<<12) | ((c2 & 0x3f)<<6) | (c3 & 0x3f));
 			}
 			else
 				i = length-1;
@@ -246,20 +274,116 @@ std::wstring CPPStringUtils::from_utf8w(const std::string source)
 				i++;
 				unsigned int c4 = (unsigned char) source[i];
 
-				dest += (((c1 & 0x07)<<18) | ((c2 & 0x3f)<<12) | ((c3 & 0x3f)<<6) | (c4 & 0x3f));
+				*pDest++ = (((c1 & 0x07)<<18) | ((c2 & 0x3f)<<12) | ((c3 & 0x3f)<<6) | (c4 & 0x3f));
 			}
 			else
 				i = length-1;				
 		}
 		else {
 			// illegal coding, skip that char
-			dest += '?';
+			*pDest++ = '?';
 		}
 	}
 	
-	return dest;
+	*pDest = 0x0;
+	
+	return pDest - dest;
+}
+
+size_t CPPStringUtils::utf8_length(const wchar_t* source)
+{
+	return utf8_length(source, wcslen(source));
+}
+
+size_t CPPStringUtils::utf8_length(const wchar_t* source, size_t sourceLength)
+{
+	size_t length = 0;
+	
+	const wchar_t* end = source + sourceLength;
+	while ( source<end )
+	{
+		unsigned int c = (unsigned int) *source;
+		if ( c<0x00080 )
+		{
+			size_t count = ascii_length(source, end - source);
+			length += count;
+			source += count;
+			continue;
+		}
+		
+		source++;
+		if ( c<0x00800 )
+			length += 2;
+		else if ( c<0x010000 )
+			length += 3;
+		else
+			length += 4;
+	}
+	
+	return length;
+}
+
+bool CPPStringUtils::write_utf8(FILE* f, const wchar_t* source)
+{
+	return write_utf8(f, source, wcslen(source));
+}
+
+bool CPPStringUtils::write_utf8(FILE* f, const wchar_t* source, size_t sourceLength)
+{
+	// encoded in pieces, so large articles don't need a second copy
+	unsigned char buffer[4096];
+	unsigned char* end = buffer + sizeof(buffer) - 4;
+	
+	const wchar_t* sourceEnd = source + sourceLength;
+	while ( source<sourceEnd )
+	{
+		unsigned char* dest = buffer;
+		while ( source<sourceEnd && dest<end )
+		{
+			if ( (unsigned int) *source<0x80 )
+			{
+				// as much of the ascii run as fits
+				size_t length = sourceEnd - source;
+				if ( length>(size_t) (end - dest) )
+					length = end - dest;
+				
+				size_t count = copy_ascii(source, length, (char*) dest);
+				dest += count;
+				source += count;
+			}
+			else
+				dest = _put_utf8((unsigned int) *source++, dest);
+		}
+		
+		size_t length = dest - buffer;
+		if ( fwrite(buffer, 1, length, f)!=length )
+			return false;
+	}
+	
+	return true;
 }	
 
+size_t CPPStringUtils::encode_utf8(const wchar_t* source, size_t length, char* dest)
+{
+	unsigned char* start = (unsigned char*) dest;
+	unsigned char* pDest = start;
+	
+	const wchar_t* end = source + length;
+	while ( source<end )
+	{
+		if ( (unsigned int) *source<0x80 )
+		{
+			size_t count = copy_ascii(source, end - source, (char*) pDest);
+			pDest += count;
+			source += count;
+		}
+		else
+			pDest = _put_utf8((unsigned int) *source++, pDest);
+	}
+	
+	return pDest - start;
+}
+
 std::string CPPStringUtils::to_lower(std::string src)
 { 
 	string dest = string(src);
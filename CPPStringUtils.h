@@ -22,6 +22,7 @@
 
 using namespace std;
 
+#include <stdio.h>
 #include <string>
 
 class CPPStringUtils {
@@ -36,6 +37,19 @@ public:
 	static std::string to_utf8(const std::wstring source);
 	static std::string from_utf8(const std::string source);
 	static std::wstring from_utf8w(const std::string source);
+	static std::wstring from_utf8w(const char* source, size_t length);
+	
+	// decodes length bytes into dest (which has to hold length+1 chars), returns the number of chars
+	static size_t decode_utf8(const char* source, size_t length, wchar_t* dest);
+	
+	// the number of bytes of the utf-8 encoded source and writing it encoded without a temporary string
+	static size_t utf8_length(const wchar_t* source);
+	static size_t utf8_length(const wchar_t* source, size_t length);
+	static bool write_utf8(FILE* f, const wchar_t* source);
+	static bool write_utf8(FILE* f, const wchar_t* source, size_t length);
+	
+	// encodes length chars into dest (which has to hold utf8_length() bytes), returns the number of bytes
+	static size_t encode_utf8(const wchar_t* source, size_t length, char* dest);
 	
 	static std::string to_lower(std::string src);
 	static std::wstring to_lower(std::wstring src);
@@ -0,0 +1,645 @@
+/*
+ *  Expression.cpp
+ *  Wiki2Touch/wikisrvd
+ *
+ *  Copyright (c) 2008 by Tom Haukap.
+ *
+ *  This file is part of Wiki2Touch.
+ *
+ *  Wiki2Touch is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Wiki2Touch is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Wiki2Touch. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <wchar.h>
+#include <wctype.h>
+#include <math.h>
+
+#include "Expression.h"
+
+// expressions longer than this are evaluated every time
+#define EXPRESSION_CACHE_MAX_LENGTH 256
+
+enum
+{
+	EXPR_NONE = 0,
+	EXPR_NEGATIVE,
+	EXPR_POSITIVE,
+	EXPR_PLUS,
+	EXPR_MINUS,
+	EXPR_TIMES,
+	EXPR_DIVIDE,
+	EXPR_MOD,
+	EXPR_FMOD,
+	EXPR_POW,
+	EXPR_EXPONENT,
+	EXPR_ROUND,
+	EXPR_EQUALITY,
+	EXPR_LESS,
+	EXPR_GREATER,
+	EXPR_LESSEQ,
+	EXPR_GREATEREQ,
+	EXPR_NOTEQ,
+	EXPR_AND,
+	EXPR_OR,
+	EXPR_NOT,
+	EXPR_SINE,
+	EXPR_COSINE,
+	EXPR_TANGENT,
+	EXPR_ARCSINE,
+	EXPR_ARCCOS,
+	EXPR_ARCTAN,
+	EXPR_EXP,
+	EXPR_LN,
+	EXPR_ABS,
+	EXPR_FLOOR,
+	EXPR_TRUNC,
+	EXPR_CEIL,
+	EXPR_SQRT,
+	EXPR_PI,
+	EXPR_OPEN
+};
+
+// name (used in the error messages) and precedence of every operator, in the order above
+typedef struct tagOPERATORINFO
+{
+	const wchar_t* name;
+	int precedence;
+} OPERATORINFO;
+
+static const OPERATORINFO operatorInfos[] =
+{
+	{ L"", 0 },
+	{ L"-", 10 },
+	{ L"+", 10 },
+	{ L"+", 6 },
+	{ L"-", 6 },
+	{ L"*", 7 },
+	{ L"/", 7 },
+	{ L"mod", 7 },
+	{ L"fmod", 7 },
+	{ L"^", 8 },
+	{ L"e", 10 },
+	{ L"round", 5 },
+	{ L"=", 4 },
+	{ L"<", 4 },
+	{ L">", 4 },
+	{ L"<=", 4 },
+	{ L">=", 4 },
+	{ L"<>", 4 },
+	{ L"and", 3 },
+	{ L"or", 2 },
+	{ L"not", 9 },
+	{ L"sin", 9 },
+	{ L"cos", 9 },
+	{ L"tan", 9 },
+	{ L"asin", 9 },
+	{ L"acos", 9 },
+	{ L"atan", 9 },
+	{ L"exp", 9 },
+	{ L"ln", 9 },
+	{ L"abs", 9 },
+	{ L"floor", 9 },
+	{ L"trunc", 9 },
+	{ L"ceil", 9 },
+	{ L"sqrt", 9 },
+	{ L"pi", 0 },
+	{ L"(", -1 }
+};
+
+typedef struct tagWORD
+{
+	const wchar_t* word;
+	int op;
+} WORD;
+
+static const WORD words[] =
+{
+	{ L"mod", EXPR_MOD },
+	{ L"fmod", EXPR_FMOD },
+	{ L"and", EXPR_AND },
+	{ L"or", EXPR_OR },
+	{ L"not", EXPR_NOT },
+	{ L"round", EXPR_ROUND },
+	{ L"div", EXPR_DIVIDE },
+	{ L"e", EXPR_EXPONENT },
+	{ L"sin", EXPR_SINE },
+	{ L"cos", EXPR_COSINE },
+	{ L"tan", EXPR_TANGENT },
+	{ L"asin", EXPR_ARCSINE },
+	{ L"acos", EXPR_ARCCOS },
+	{ L"atan", EXPR_ARCTAN },
+	{ L"exp", EXPR_EXP },
+	{ L"ln", EXPR_LN },
+	{ L"abs", EXPR_ABS },
+	{ L"floor", EXPR_FLOOR },
+	{ L"trunc", EXPR_TRUNC },
+	{ L"ceil", EXPR_CEIL },
+	{ L"sqrt", EXPR_SQRT },
+	{ L"pi", EXPR_PI },
+	{ NULL, EXPR_NONE }
+};
+
+typedef struct tagCACHEDRESULT
+{
+	wstring text;
+	wstring result;
+	bool error;
+} CACHEDRESULT;
+
+pthread_mutex_t Expression::_cacheMutex = PTHREAD_MUTEX_INITIALIZER;
+void* Expression::_cache[EXPRESSION_CACHE_SLOTS];
+unsigned int Expression::_hits = 0;
+unsigned int Expression::_misses = 0;
+
+// php's (int) cast, out of range values become 0
+static long long to_int(double value)
+{
+	if ( !(value>-9.2e18 && value<9.2e18) )
+		return 0;
+
+	return (long long) value;
+}
+
+// php's round(), the value is rounded to 15 significant digits first so 1.955 becomes 1.96
+static double php_round(double value, int places)
+{
+	if ( isnan(value) || isinf(value) )
+		return value;
+
+	double f = pow(10.0, places<0 ? -places : places);
+	double tmp = places>=0 ? value*f : value/f;
+	if ( fabs(tmp)>=1e15 )
+		return value;
+
+	char buffer[64];
+	snprintf(buffer, sizeof(buffer), "%.15g", tmp);
+	tmp = strtod(buffer, NULL);
+
+	tmp = tmp>=0 ? floor(tmp + 0.5) : ceil(tmp - 0.5);
+
+	return places>=0 ? tmp/f : tmp*f;
+}
+
+Expression::Expression()
+{
+	_numberOfOperands = 0;
+	_numberOfOperators = 0;
+}
+
+wstring Expression::Evaluate(const wchar_t* text, bool* error)
+{
+	*error = false;
+	if ( !text )
+		return wstring();
+
+	bool cacheable = wcslen(text)<=EXPRESSION_CACHE_MAX_LENGTH;
+	int slot = Hash(text) % EXPRESSION_CACHE_SLOTS;
+
+	if ( cacheable )
+	{
+		pthread_mutex_lock(&_cacheMutex);
+
+		CACHEDRESULT* cached = (CACHEDRESULT*) _cache[slot];
+		if ( cached && cached->text==text )
+		{
+			_hits++;
+
+			wstring result = cached->result;
+			*error = cached->error;
+
+			pthread_mutex_unlock(&_cacheMutex);
+			return result;
+		}
+
+		_misses++;
+		pthread_mutex_unlock(&_cacheMutex);
+	}
+
+	Expression expression;
+
+	wstring result;
+	if ( expression.Parse(text) )
+	{
+		// exactly one value is left, unless the expression was empty
+		for (int i=0; i<expression._numberOfOperands; i++)
+		{
+			if ( i )
+				result += L"<br />\n";
+			result += FormatNumber(expression._operands[i]);
+		}
+	}
+	else
+	{
+		*error = true;
+		result = L"<strong class=\"error\">" + expression._error + L"</strong>";
+	}
+
+	if ( cacheable )
+	{
+		CACHEDRESULT* cached = new CACHEDRESULT;
+		cached->text = text;
+		cached->result = result;
+		cached->error = *error;
+
+		pthread_mutex_lock(&_cacheMutex);
+
+		if ( _cache[slot] )
+			delete((CACHEDRESULT*) _cache[slot]);
+		_cache[slot] = cached;
+
+		pthread_mutex_unlock(&_cacheMutex);
+	}
+
+	return result;
+}
+
+wstring Expression::FormatNumber(double value)
+{
+	if ( isnan(value) )
+		return L"NAN";
+	if ( isinf(value) )
+		return value>0 ? L"INF" : L"-INF";
+
+	// the precision of php, large and small numbers are written as 1.0E+20
+	char buffer[64];
+	snprintf(buffer, sizeof(buffer), "%.14G", value);
+
+	string number = buffer;
+	size_t pos = number.find('E');
+	if ( pos!=string::npos )
+	{
+		string mantissa = number.substr(0, pos);
+		if ( mantissa.find('.')==string::npos )
+			mantissa += ".0";
+
+		char sign = number[pos+1];
+		size_t digits = pos + 2;
+		while ( digits<number.length()-1 && number[digits]=='0' )
+			digits++;
+
+		number = mantissa + "E" + sign + number.substr(digits);
+	}
+
+	wstring result;
+	for (size_t i=0; i<number.length(); i++)
+		result += (wchar_t) number[i];
+
+	return result;
+}
+
+unsigned int Expression::Hits()
+{
+	return _hits;
+}
+
+unsigned int Expression::Misses()
+{
+	return _misses;
+}
+
+// the shunting yard algorithm of the ParserFunctions extension, an operator is applied as soon as
+// it is popped from the operator stack
+bool Expression::Parse(const wchar_t* text)
+{
+	// an expression is expected at first, e.g. a "-" is a negation then and not a subtraction
+	bool expectingExpression = true;
+
+	const wchar_t* p = text;
+	while ( *p )
+	{
+		if ( _numberOfOperands>=EXPRESSION_MAX_STACK_SIZE || _numberOfOperators>=EXPRESSION_MAX_STACK_SIZE )
+			return SetError(L"Expression error: Stack exhausted.");
+
+		wchar_t c = *p;
+		wstring name;
+		int op = EXPR_NONE;
+
+		if ( c==' ' || c=='\t' || c=='\r' || c=='\n' )
+		{
+			p++;
+			continue;
+		}
+		else if ( (c>='0' && c<='9') || c=='.' )
+		{
+			if ( !expectingExpression )
+				return SetError(L"Expression error: Unexpected number.");
+
+			const wchar_t* start = p;
+			while ( (*p>='0' && *p<='9') || *p=='.' )
+				p++;
+
+			// like php's float conversion "1.2.3" is 1.2
+			wstring number(start, p - start);
+			_operands[_numberOfOperands++] = wcstod(number.c_str(), NULL);
+
+			expectingExpression = false;
+			continue;
+		}
+		else if ( (c>='a' && c<='z') || (c>='A' && c<='Z') )
+		{
+			while ( (*p>='a' && *p<='z') || (*p>='A' && *p<='Z') )
+				name += (wchar_t) towlower(*p++);
+
+			const WORD* word = words;
+			while ( word->word && name!=word->word )
+				word++;
+
+			if ( !word->word )
+				return SetError(L"Expression error: Unrecognized word \"%s\".", name);
+
+			op = word->op;
+			if ( op==EXPR_EXPONENT || op==EXPR_PI )
+			{
+				if ( expectingExpression )
+				{
+					// the constants e and pi
+					_operands[_numberOfOperands++] = op==EXPR_EXPONENT ? exp(1.0) : M_PI;
+					expectingExpression = false;
+					continue;
+				}
+				else if ( op==EXPR_PI )
+					return SetError(L"Expression error: Unexpected number.");
+
+				// 1e3
+			}
+			else if ( operatorInfos[op].precedence==9 )
+			{
+				// the functions and not
+				if ( !expectingExpression )
+					return SetError(L"Expression error: Unexpected %s operator.", name);
+
+				_operators[_numberOfOperators++] = op;
+				continue;
+			}
+		}
+		else if ( c=='<' && p[1]=='=' )
+		{
+			name = L"<=";
+			op = EXPR_LESSEQ;
+			p += 2;
+		}
+		else if ( c=='>' && p[1]=='=' )
+		{
+			name = L">=";
+			op = EXPR_GREATEREQ;
+			p += 2;
+		}
+		else if ( (c=='<' && p[1]=='>') || (c=='!' && p[1]=='=') )
+		{
+			name = wstring(p, 2);
+			op = EXPR_NOTEQ;
+			p += 2;
+		}
+		else if ( c=='+' || c=='-' || c==0x2212 )
+		{
+			p++;
+			if ( expectingExpression )
+			{
+				_operators[_numberOfOperators++] = c=='+' ? EXPR_POSITIVE : EXPR_NEGATIVE;
+				continue;
+			}
+
+			name = c=='+' ? L"+" : L"-";
+			op = c=='+' ? EXPR_PLUS : EXPR_MINUS;
+		}
+		else if ( c=='*' || c==0x00d7 || c=='/' || c=='^' || c=='=' || c=='<' || c=='>' )
+		{
+			name = c;
+			switch ( c )
+			{
+				case '*': case 0x00d7: op = EXPR_TIMES; break;
+				case '/': op = EXPR_DIVIDE; break;
+				case '^': op = EXPR_POW; break;
+				case '=': op = EXPR_EQUALITY; break;
+				case '<': op = EXPR_LESS; break;
+				case '>': op = EXPR_GREATER; break;
+			}
+			p++;
+		}
+		else if ( c=='(' )
+		{
+			if ( !expectingExpression )
+				return SetError(L"Expression error: Unexpected %s operator.", L"(");
+
+			_operators[_numberOfOperators++] = EXPR_OPEN;
+			p++;
+			continue;
+		}
+		else if ( c==')' )
+		{
+			while ( _numberOfOperators && _operators[_numberOfOperators-1]!=EXPR_OPEN )
+			{
+				if ( !DoOperation(_operators[--_numberOfOperators]) )
+					return false;
+			}
+
+			if ( !_numberOfOperators )
+				return SetError(L"Expression error: Unexpected closing bracket.");
+
+			_numberOfOperators--;
+			expectingExpression = false;
+			p++;
+			continue;
+		}
+		else
+			return SetError(L"Expression error: Unrecognized punctuation character \"%s\".", wstring(1, c));
+
+		// a binary operator
+		if ( expectingExpression )
+			return SetError(L"Expression error: Unexpected %s operator.", name);
+
+		while ( _numberOfOperators && operatorInfos[op].precedence<=operatorInfos[_operators[_numberOfOperators-1]].precedence )
+		{
+			if ( !DoOperation(_operators[--_numberOfOperators]) )
+				return false;
+		}
+
+		_operators[_numberOfOperators++] = op;
+		expectingExpression = true;
+	}
+
+	while ( _numberOfOperators )
+	{
+		int op = _operators[--_numberOfOperators];
+		if ( op==EXPR_OPEN )
+			return SetError(L"Expression error: Unclosed bracket.");
+
+		if ( !DoOperation(op) )
+			return false;
+	}
+
+	return true;
+}
+
+bool Expression::DoOperation(int op)
+{
+	int numberOfArguments = operatorInfos[op].precedence>=9 && op!=EXPR_POW && op!=EXPR_EXPONENT ? 1 : 2;
+	if ( _numberOfOperands<numberOfArguments )
+		return SetError(L"Expression error: Missing operand for %s.", operatorInfos[op].name);
+
+	double right = _operands[--_numberOfOperands];
+	double left = numberOfArguments==2 ? _operands[--_numberOfOperands] : 0;
+	double result = 0;
+
+	switch ( op )
+	{
+		// unary
+		case EXPR_NEGATIVE:
+			result = -right;
+			break;
+		case EXPR_POSITIVE:
+			result = right;
+			break;
+		case EXPR_NOT:
+			result = !right ? 1 : 0;
+			break;
+		case EXPR_SINE:
+			result = sin(right);
+			break;
+		case EXPR_COSINE:
+			result = cos(right);
+			break;
+		case EXPR_TANGENT:
+			result = tan(right);
+			break;
+		case EXPR_ARCSINE:
+		case EXPR_ARCCOS:
+			if ( right<-1 || right>1 )
+				return SetError(L"Invalid argument for %s: < -1 or > 1.", operatorInfos[op].name);
+			result = op==EXPR_ARCSINE ? asin(right) : acos(right);
+			break;
+		case EXPR_ARCTAN:
+			result = atan(right);
+			break;
+		case EXPR_EXP:
+			result = exp(right);
+			break;
+		case EXPR_LN:
+			if ( right<=0 )
+				return SetError(L"Invalid argument for ln: <= 0.");
+			result = log(right);
+			break;
+		case EXPR_ABS:
+			result = fabs(right);
+			break;
+		case EXPR_FLOOR:
+			result = floor(right);
+			break;
+		case EXPR_TRUNC:
+			result = (double) to_int(right);
+			break;
+		case EXPR_CEIL:
+			result = ceil(right);
+			break;
+		case EXPR_SQRT:
+			if ( right<0 )
+				return SetError(L"In %s: result is not a number.", L"sqrt");
+			result = sqrt(right);
+			break;
+
+		// binary
+		case EXPR_PLUS:
+			result = left + right;
+			break;
+		case EXPR_MINUS:
+			result = left - right;
+			break;
+		case EXPR_TIMES:
+			result = left * right;
+			break;
+		case EXPR_DIVIDE:
+			if ( !right )
+				return SetError(L"Division by zero.");
+			result = left / right;
+			break;
+		case EXPR_MOD:
+		{
+			long long l = to_int(left);
+			long long r = to_int(right);
+			if ( !r )
+				return SetError(L"Division by zero.");
+
+			// the smallest number divided by -1 would trap
+			result = r==-1 ? 0 : (double) (l % r);
+			break;
+		}
+		case EXPR_FMOD:
+			if ( !right )
+				return SetError(L"Division by zero.");
+			result = fmod(left, right);
+			break;
+		case EXPR_POW:
+			result = pow(left, right);
+			break;
+		case EXPR_EXPONENT:
+			result = left * pow(10.0, right);
+			break;
+		case EXPR_ROUND:
+			result = php_round(left, (int) to_int(right));
+			break;
+		case EXPR_EQUALITY:
+			result = left==right ? 1 : 0;
+			break;
+		case EXPR_LESS:
+			result = left<right ? 1 : 0;
+			break;
+		case EXPR_GREATER:
+			result = left>right ? 1 : 0;
+			break;
+		case EXPR_LESSEQ:
+			result = left<=right ? 1 : 0;
+			break;
+		case EXPR_GREATEREQ:
+			result = left>=right ? 1 : 0;
+			break;
+		case EXPR_NOTEQ:
+			result = left!=right ? 1 : 0;
+			break;
+		case EXPR_AND:
+			result = left && right ? 1 : 0;
+			break;
+		case EXPR_OR:
+			result = left || right ? 1 : 0;
+			break;
+		default:
+			return SetError(L"Expression error: Unknown error (%s).", operatorInfos[op].name);
+	}
+
+	_operands[_numberOfOperands++] = result;
+
+	return true;
+}
+
+// the message may contain one %s, replaced by param
+bool Expression::SetError(const wchar_t* message, const wstring& param)
+{
+	_error = message;
+
+	size_t pos = _error.find(L"%s");
+	if ( pos!=wstring::npos )
+		_error.replace(pos, 2, param);
+
+	return false;
+}
+
+unsigned int Expression::Hash(const wchar_t* text)
+{
+	unsigned int hash = 0;
+	while ( *text )
+		hash = hash*31 + (unsigned int) *text++;
+
+	return hash;
+}
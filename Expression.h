@@ -0,0 +1,78 @@
+/*
+ *  Expression.h
+ *  Wiki2Touch/wikisrvd
+ *
+ *  Copyright (c) 2008 by Tom Haukap.
+ *
+ *  This file is part of Wiki2Touch.
+ *
+ *  Wiki2Touch is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Wiki2Touch is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Wiki2Touch. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef EXPRESSION_H
+#define EXPRESSION_H
+
+#include <pthread.h>
+#include <string>
+using namespace std;
+
+// the limit of both the operand and the operator stack (as in the ParserFunctions extension)
+#define EXPRESSION_MAX_STACK_SIZE 100
+
+// number of results kept, an expression shares its slot with the others having the same hash
+#define EXPRESSION_CACHE_SLOTS 1024
+
+/*
+ * The expressions of #expr and #ifexpr with the operators, functions and error
+ * messages of the MediaWiki ParserFunctions extension. The operands are numbers
+ * only, so the result of an expression never changes: it is cached by the text
+ * of the expression, many templates evaluate the same expressions on every page.
+ */
+class Expression
+{
+public:
+	// returns the result as #expr shows it, an empty string for an empty expression
+	// or the (html formatted) error message; error tells which one it is
+	static wstring Evaluate(const wchar_t* text, bool* error);
+
+	// a number the way php converts a float to a string
+	static wstring FormatNumber(double value);
+
+	static unsigned int Hits();
+	static unsigned int Misses();
+
+private:
+	Expression();
+
+	double _operands[EXPRESSION_MAX_STACK_SIZE];
+	int _numberOfOperands;
+
+	int _operators[EXPRESSION_MAX_STACK_SIZE];
+	int _numberOfOperators;
+
+	wstring _error;
+
+	bool Parse(const wchar_t* text);
+	bool DoOperation(int op);
+	bool SetError(const wchar_t* message, const wstring& param=wstring());
+
+	static unsigned int Hash(const wchar_t* text);
+
+	static pthread_mutex_t _cacheMutex;
+	static void* _cache[EXPRESSION_CACHE_SLOTS];
+	static unsigned int _hits;
+	static unsigned int _misses;
+};
+
+#endif
@@ -0,0 +1,1761 @@
+/*
+ *  HttpServer.cpp
+ *  Wiki2Touch/wikisrvd
+ *
+ *  Copyright (c) 2008 by Tom Haukap.
+ *
+ *  This file is part of Wiki2Touch.
+ *
+ *  Wiki2Touch is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Wiki2Touch is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Wiki2Touch. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "HttpServer.h"
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <zlib.h>
+#include <fcntl.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#else
+#include <sys/event.h>
+#include <sys/uio.h>
+#endif
+
+#include "Settings.h"
+#include "TitleIndex.h"
+#include "ImageIndex.h"
+#include "ConfigFile.h"
+#include "WikiArticle.h"
+#include "CPPStringUtils.h"
+#include "WikiMarkupParser.h"
+#include "Expression.h"
+
+// passed to send_headers instead of a length for a "Transfer-Encoding: chunked" response
+#define CHUNKED_LENGTH -2
+
+// the extra headers of a gzip compressed response
+#define GZIP_HEADERS "Content-Encoding: gzip\r\nVary: Accept-Encoding"
+
+// the data written to a gzip stream is compressed (and sent as a chunk) in pieces of this size
+#define GZIP_BUFFER_SIZE 16384
+
+// the data written to a chunked stream is sent in chunks of this size
+#define CHUNK_BUFFER_SIZE 16384
+
+typedef struct tagCONNECTION
+{
+	int socket;
+	FILE* out;
+
+	// another request may follow the current one
+	bool keepAlive;
+
+	// bytes received but not processed yet, pipelined requests wait here
+	char buffer[REQUEST_BUFFER_SIZE];
+	int start;
+	int end;
+
+	// the event loop drops connections being idle for too long
+	time_t lastActivity;
+	tagCONNECTION* prev;
+	tagCONNECTION* next;
+} CONNECTION;
+
+// the connection served by the current thread, used to decide if it may stay open
+static pthread_key_t connectionKey;
+static pthread_once_t connectionKeyOnce = PTHREAD_ONCE_INIT;
+
+static void create_connection_key()
+{
+	pthread_key_create(&connectionKey, NULL);
+}
+
+static CONNECTION* current_connection()
+{
+	pthread_once(&connectionKeyOnce, create_connection_key);
+	return (CONNECTION*) pthread_getspecific(connectionKey);
+}
+
+static char *get_mime_type(char *name)
+{
+	char *ext = strrchr(name, '.');
+	if (!ext) return NULL;
+	if (strcasecmp(ext, ".html") == 0 || strcasecmp(ext, ".htm") == 0) return "text/html";
+	if (strcasecmp(ext, ".jpg") == 0 || strcasecmp(ext, ".jpeg") == 0) return "image/jpeg";
+	if (strcasecmp(ext, ".gif") == 0) return "image/gif";
+	if (strcasecmp(ext, ".png") == 0) return "image/png";
+	if (strcasecmp(ext, ".svg") == 0) return "image/svg+xml";      
+	if (strcasecmp(ext, ".css") == 0) return "text/css";
+	if (strcasecmp(ext, ".au") == 0) return "audio/basic";
+	if (strcasecmp(ext, ".wav") == 0) return "audio/wav";
+	if (strcasecmp(ext, ".mp3") == 0) return "audio/mpeg";
+	if (strcasecmp(ext, ".avi") == 0) return "video/x-msvideo";
+	if (strcasecmp(ext, ".mpeg") == 0 || strcasecmp(ext, ".mpg") == 0) return "video/mpeg";
+	if (strcasecmp(ext, ".mp4") == 0) return "video/mp4";  
+	return NULL;
+}
+
+static void send_headers(FILE *f, int status, char *title, char *extra, char *mime, int length, time_t date=-1, const char *etag=NULL, int maxAge=-1)
+{
+	time_t now;
+	char timebuf[128];
+	struct tm tm;
+
+	fprintf(f, "%s %d %s\r\n", PROTOCOL, status, title);
+	fprintf(f, "Server: %s\r\n", SERVER);
+	now = time(NULL);
+	strftime(timebuf, sizeof(timebuf), RFC1123FMT, gmtime_r(&now, &tm));
+	fprintf(f, "Date: %s\r\n", timebuf);
+	if (extra) fprintf(f, "%s\r\n", extra);
+	if (mime) fprintf(f, "Content-Type: %s\r\n", mime);
+	if (length >= 0) fprintf(f, "Content-Length: %d\r\n", length);
+	else if (length == CHUNKED_LENGTH) fprintf(f, "Transfer-Encoding: chunked\r\n");
+	if (date != -1)
+	{
+		strftime(timebuf, sizeof(timebuf), RFC1123FMT, gmtime_r(&date, &tm));
+		fprintf(f, "Last-Modified: %s\r\n", timebuf);
+	}
+	if (etag) fprintf(f, "ETag: %s\r\n", etag);
+	if (maxAge >= 0) fprintf(f, "Cache-Control: max-age=%d\r\n", maxAge);
+
+	// without a length (or chunks) the end of the response is marked by closing the connection,
+	// a 304 never has a body
+	CONNECTION* connection = current_connection();
+	if ( connection && length<0 && length!=CHUNKED_LENGTH && status!=304 )
+		connection->keepAlive = false;
+
+	fprintf(f, "Connection: %s\r\n", connection && connection->keepAlive ? "keep-alive" : "close");
+	fprintf(f, "\r\n");
+}
+
+// the value of a header line (headers is the part of the request following the request line),
+// empty if it is missing
+static string request_header(const char *headers, const char *name)
+{
+	size_t nameLength = strlen(name);
+
+	const char* line = headers;
+	while ( *line )
+	{
+		const char* eol = strchr(line, '\n');
+		if ( !eol )
+			eol = line + strlen(line);
+
+		if ( !strncasecmp(line, name, nameLength) && line[nameLength]==':' )
+		{
+			const char* value = line + nameLength + 1;
+			while ( value<eol && (*value==' ' || *value=='\t') )
+				value++;
+
+			const char* end = eol;
+			while ( end>value && (end[-1]=='\r' || end[-1]==' ') )
+				end--;
+
+			return string(value, end - value);
+		}
+
+		if ( !*eol )
+			break;
+		line = eol + 1;
+	}
+
+	return string();
+}
+
+// true if the client's copy (If-None-Match or, without that, If-Modified-Since) is still the current one
+static bool not_modified(const char *headers, const string& etag, time_t date)
+{
+	string ifNoneMatch = request_header(headers, "If-None-Match");
+	if ( !ifNoneMatch.empty() )
+		return !etag.empty() && (ifNoneMatch=="*" || ifNoneMatch.find(etag)!=string::npos);
+
+	string ifModifiedSince = request_header(headers, "If-Modified-Since");
+	if ( date==-1 || ifModifiedSince.empty() )
+		return false;
+
+	struct tm tm;
+	memset(&tm, 0, sizeof(tm));
+	if ( !strptime(ifModifiedSince.c_str(), RFC1123FMT, &tm) )
+		return false;
+
+	return timegm(&tm)>=date;
+}
+
+// an entry of a data file is identified by its position plus size and modification time of the file,
+// so a replaced file changes the tag; variant covers settings changing the output
+static string data_file_etag(int fd, long long pos, unsigned int subPos, const char* variant="")
+{
+	struct stat statbuf;
+	if ( fd<0 || fstat(fd, &statbuf) )
+		return string();
+
+	char etag[128];
+	snprintf(etag, sizeof(etag), "\"%llx-%lx-%llx-%x%s\"", (long long) statbuf.st_size, (long) statbuf.st_mtime, pos, subPos, variant);
+
+	return etag;
+}
+
+static void send_not_modified(FILE *f, const string& etag, time_t date, int maxAge)
+{
+	send_headers(f, 304, "Not Modified", NULL, NULL, -1, date, etag.empty() ? NULL : etag.c_str(), maxAge);
+}
+
+// true if "Accept-Encoding" lists gzip without refusing it by a quality of zero
+static bool accepts_gzip(const char *headers)
+{
+	string value = request_header(headers, "Accept-Encoding");
+	for (size_t i=0; i<value.length(); i++)
+		value[i] = tolower(value[i]);
+
+	size_t pos = value.find("gzip");
+	if ( pos==string::npos )
+		return false;
+
+	const char* p = value.c_str() + pos + 4;
+	while ( *p==' ' )
+		p++;
+	if ( *p!=';' )
+		return true;
+
+	p++;
+	while ( *p==' ' )
+		p++;
+
+	return strncmp(p, "q=", 2) || atof(p + 2)>0;
+}
+
+// the size line of a chunk ("Transfer-Encoding: chunked"), the data has to be followed by "\r\n"
+static void send_chunk_header(FILE *f, size_t length)
+{
+	fprintf(f, "%lx\r\n", (unsigned long) length);
+}
+
+// an empty chunk ends the response, so these are skipped unless last is set
+static void send_chunk(FILE *f, const char* data, size_t length, bool last=false)
+{
+	if ( length )
+	{
+		send_chunk_header(f, length);
+		fwrite(data, 1, length, f);
+		fprintf(f, "\r\n");
+	}
+	
+	if ( last )
+		fprintf(f, "0\r\n\r\n");
+}
+
+// a gzip stream wrapped around the response, the compressed data goes to f as chunks
+typedef struct tagGZIPSTREAM
+{
+	FILE* f;
+	z_stream stream;
+} GZIPSTREAM;
+
+static bool gzip_deflate(GZIPSTREAM* gzip, const char* data, size_t length, int flush)
+{
+	char buffer[GZIP_BUFFER_SIZE];
+
+	gzip->stream.next_in = (Bytef*) data;
+	gzip->stream.avail_in = length;
+	do
+	{
+		gzip->stream.next_out = (Bytef*) buffer;
+		gzip->stream.avail_out = sizeof(buffer);
+		if ( deflate(&gzip->stream, flush)==Z_STREAM_ERROR )
+			return false;
+
+		send_chunk(gzip->f, buffer, sizeof(buffer) - gzip->stream.avail_out);
+	}
+	while ( gzip->stream.avail_out==0 );
+
+	return !ferror(gzip->f);
+}
+
+#ifdef __linux__
+static ssize_t gzip_write(void* cookie, const char* data, size_t length)
+#else
+static int gzip_write(void* cookie, const char* data, int length)
+#endif
+{
+	// every buffer is flushed, the client shouldn't wait for data the server already has
+	GZIPSTREAM* gzip = (GZIPSTREAM*) cookie;
+	return gzip_deflate(gzip, data, length, Z_SYNC_FLUSH) && !fflush(gzip->f) ? length : -1;
+}
+
+static int gzip_close(void* cookie)
+{
+	GZIPSTREAM* gzip = (GZIPSTREAM*) cookie;
+
+	bool ok = gzip_deflate(gzip, NULL, 0, Z_FINISH);
+	deflateEnd(&gzip->stream);
+	free(gzip);
+
+	return ok ? 0 : EOF;
+}
+
+// returns a stream compressing everything written to it with the configured level; the chunked
+// response has to be ended after closing it
+static FILE* open_gzip_stream(FILE *f)
+{
+	GZIPSTREAM* gzip = (GZIPSTREAM*) malloc(sizeof(GZIPSTREAM));
+	if ( !gzip )
+		return NULL;
+
+	gzip->f = f;
+	memset(&gzip->stream, 0, sizeof(gzip->stream));
+
+	// 16 added to the window bits writes a gzip instead of a zlib header
+	if ( deflateInit2(&gzip->stream, __settings->CompressionLevel(), Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY)!=Z_OK )
+	{
+		free(gzip);
+		return NULL;
+	}
+
+#ifdef __linux__
+	cookie_io_functions_t functions = { NULL, gzip_write, NULL, gzip_close };
+	FILE* stream = fopencookie(gzip, "w", functions);
+#else
+	FILE* stream = funopen(gzip, NULL, gzip_write, NULL, gzip_close);
+#endif
+	if ( !stream )
+	{
+		deflateEnd(&gzip->stream);
+		free(gzip);
+		return NULL;
+	}
+
+	setvbuf(stream, NULL, _IOFBF, GZIP_BUFFER_SIZE);
+
+	return stream;
+}
+
+#ifdef __linux__
+static ssize_t chunk_write(void* cookie, const char* data, size_t length)
+#else
+static int chunk_write(void* cookie, const char* data, int length)
+#endif
+{
+	FILE* f = (FILE*) cookie;
+
+	send_chunk(f, data, length);
+	return !fflush(f) ? length : -1;
+}
+
+// returns a stream sending everything written to it as chunks, like the gzip stream the
+// response has to be ended after closing it
+static FILE* open_chunked_stream(FILE *f)
+{
+#ifdef __linux__
+	cookie_io_functions_t functions = { NULL, chunk_write, NULL, NULL };
+	FILE* stream = fopencookie(f, "w", functions);
+#else
+	FILE* stream = funopen(f, NULL, chunk_write, NULL, NULL);
+#endif
+	if ( !stream )
+		return NULL;
+
+	setvbuf(stream, NULL, _IOFBF, CHUNK_BUFFER_SIZE);
+
+	return stream;
+}
+
+static void send_error(FILE *f, int status, char *title, char *extra, char *text)
+{
+	// with a length the connection can be kept open
+	char statusLine[512];
+	snprintf(statusLine, sizeof(statusLine), "%d %s", status, title);
+
+	string body = string("<HTML><HEAD><TITLE>") + statusLine + "</TITLE></HEAD>\r\n";
+	body += string("<BODY><H4>") + statusLine + "</H4>\r\n";
+	body += string(text) + "\r\n";
+	body += "</BODY></HTML>\r\n";
+
+	send_headers(f, status, title, extra, "text/html", body.length(), -1);
+	fwrite(body.c_str(), 1, body.length(), f);
+
+	//if ( settings.Verbose() )
+		printf("error: %d %s\n\r", status, title);
+}
+
+static void redirect_to(FILE *f, const char* target)
+{
+	char extra[512];
+	sprintf(extra, "Location: %s", target);
+	string body = string("<Please follow <a href=\"") + target + "\">" + target + "</a>\r\n";
+	send_headers(f, 301, "moved permanently", extra, "text/html", body.length(), -1);
+
+	fwrite(body.c_str(), 1, body.length(), f);
+
+	//if ( settings.Verbose() )
+		printf("redirected to %s\r\n", target);
+}
+
+// sends length bytes of the file starting at offset with sendfile(), so they aren't copied through
+// user space; the headers still buffered in f are flushed first
+static bool send_file_data(FILE *f, int fd, off_t offset, size_t length)
+{
+	if ( fflush(f)!=0 )
+		return false;
+
+	int s = fileno(f);
+	while ( length>0 )
+	{
+#ifdef __linux__
+		ssize_t sent = sendfile(s, fd, &offset, length);
+		if ( sent>0 )
+		{
+			length -= sent;
+			continue;
+		}
+		if ( sent==0 )
+			break;
+#else
+		off_t sent = length;
+		int error = sendfile(fd, s, offset, &sent, NULL, 0);
+		offset += sent;
+		length -= sent;
+		if ( !error )
+		{
+			if ( sent==0 )
+				break;
+			continue;
+		}
+#endif
+		if ( errno==EINTR )
+			continue;
+
+		if ( errno!=EINVAL && errno!=ENOSYS && errno!=ENOTSOCK && errno!=EOPNOTSUPP )
+			break;
+
+		// no sendfile() for this kind of file or socket, copy the rest
+		char data[4096];
+		while ( length>0 )
+		{
+			ssize_t n = pread(fd, data, length<sizeof(data) ? length : sizeof(data), offset);
+			if ( n<=0 || fwrite(data, 1, n, f)!=(size_t) n )
+				break;
+
+			offset += n;
+			length -= n;
+		}
+		break;
+	}
+
+	if ( length>0 )
+	{
+		// the length sent in the headers is wrong now, the client can only tell by the connection being closed
+		CONNECTION* connection = current_connection();
+		if ( connection )
+			connection->keepAlive = false;
+
+		return false;
+	}
+
+	return true;
+}
+
+static void send_file(FILE *f, char *path, struct stat *statbuf, const char *headers)
+{
+	char data[4096];
+	int n;
+
+	int length = S_ISREG(statbuf->st_mode) ? statbuf->st_size : -1;
+
+	// a precompressed copy (style.css.gz) is sent instead if the client takes gzip, it
+	// is ignored if the file was changed after it was compressed
+	string gzipPath = string(path) + ".gz";
+	struct stat gzipStatbuf;
+	bool hasGzip = length>=0 && stat(gzipPath.c_str(), &gzipStatbuf)==0 && 
+		S_ISREG(gzipStatbuf.st_mode) && gzipStatbuf.st_mtime>=statbuf->st_mtime;
+	bool gzip = hasGzip && accepts_gzip(headers);
+
+	// regular files are identified by modification time and size
+	char etag[64];
+	etag[0] = 0x0;
+	if ( length>=0 )
+	{
+		snprintf(etag, sizeof(etag), "\"%lx-%x%s\"", (long) statbuf->st_mtime, length, gzip ? "-z" : "");
+		if ( not_modified(headers, etag, statbuf->st_mtime) )
+		{
+			send_not_modified(f, etag, statbuf->st_mtime, STATIC_MAX_AGE);
+			return;
+		}
+	}
+
+	if ( gzip )
+		length = gzipStatbuf.st_size;
+
+	int file = open(gzip ? gzipPath.c_str() : path, O_RDONLY);
+	if (file<0)
+		send_error(f, 403, "Forbidden", NULL, "Access denied.");
+	else
+	{
+		// caches have to tell the two variants apart whenever there is a compressed one
+		char* extra = hasGzip ? (char*) "Vary: Accept-Encoding" : NULL;
+		send_headers(f, 200, "OK", gzip ? (char*) GZIP_HEADERS : extra, get_mime_type(path), length, statbuf->st_mtime, *etag ? etag : NULL, STATIC_MAX_AGE);
+
+		if ( length>=0 )
+			send_file_data(f, file, 0, length);
+		else
+		{
+			while ((n = read(file, data, sizeof(data))) > 0)
+				if ( fwrite(data, 1, n, f)!=(size_t) n )
+					break;
+		}
+
+		close(file);
+	}
+}
+
+static void send_article(FILE *f, char* name, bool chunked, const char *headers)
+{
+	char help[strlen(name)+1];
+	char* pHelp = help;
+	char* pName = name;
+
+	while ( *pName )
+	{
+		if ( *pName=='%' )
+		{
+			pName++;
+
+			int number = 0;
+
+			unsigned char digit = (unsigned char) *pName;
+			digit = toupper(digit);
+			if ( digit<='9' )
+				digit -= 48;
+			else
+				digit -= 55;
+			number = digit;
+
+			if (*pName)
+				pName++;
+
+			digit = (unsigned char) *pName;
+			digit = toupper(digit);
+			if ( digit<='9' )
+				digit -= 48;
+			else
+				digit -= 55;
+
+			number = number*16 + digit;
+
+			*pHelp++ = number;
+		}
+		else
+			*pHelp++ = *pName;
+
+		pName++;
+	}
+	*pHelp = 0x0;
+
+	char languageCode[3];  
+	pHelp = help;
+	if ( strlen(pHelp)>=3 && pHelp[2]==':' )
+	{
+		// change the "namespace" to a subfolder
+		pHelp[2] = '/';
+		redirect_to(f, (string("/wiki/") + string(pHelp)).c_str());
+		return;
+	}
+	else if ( strlen(pHelp)<3 || pHelp[2]!='/' )
+	{
+		// no prefix, try to use the default
+		redirect_to(f, (string("/wiki/") + __settings->DefaultLanguageCode() + "/" + string(name)).c_str());
+		return;
+	}
+	else
+	{
+		strncpy(languageCode, pHelp, 2);
+		languageCode[2] = 0;
+
+		strcpy(help, pHelp+3);
+		if ( !__settings->IsLanguageInstalled(languageCode) )
+		{
+			if ( !strcmp(languageCode, "xx") )
+				send_error(f, 404, "Not found", NULL, "Language not installed.");
+			else
+				redirect_to(f, "/wiki/xx/Language not installed");
+			return;
+		}
+	}
+
+	// the article name is already utf-8 encoded (by the browser?)
+	std::string articleName = help;
+
+	if ( articleName=="testpage.txt" )
+	{
+		string name = __settings->Path() + "testpage.txt";
+		const char* path = name.c_str();
+		FILE *file = fopen(path, "r");
+		if (!file)
+			send_error(f, 403, "Forbidden", NULL, "Access denied.");
+		else
+		{                      
+			int error = fseek(file, 0, SEEK_END);
+			fpos_t length;
+
+			if ( !error )
+				error = fgetpos(file, &length);
+
+			if ( !error )
+				error = fseek(file, 0, SEEK_SET);
+
+			char* contents = (char*) malloc(length+1);
+			fread(contents, 1, length, file);
+			contents[length] = 0x0;
+			fclose(file);
+
+			WikiMarkupParser wikiMarkupParser(CPPStringUtils::to_wstring(languageCode).c_str(), L"Testpage");
+
+			wstring article = CPPStringUtils::from_utf8w(string(contents));
+			free(contents);
+
+			wikiMarkupParser.SetInput(article.c_str());
+			wikiMarkupParser.Parse();
+
+			string data = "<html><body>\r\n";
+			data += CPPStringUtils::to_utf8(wikiMarkupParser.GetOutput());
+			data += "</html></body>";
+			length = data.length();
+
+			send_headers(f, 200, "OK", NULL, "text/html; charset=utf-8", length, -1);
+			fwrite(data.c_str(), 1, length, f);
+		}              
+	}
+	else
+	{
+		WikiArticle* wikiArticle = new WikiArticle(languageCode);
+
+		TitleIndex* titleIndex = __settings->GetTitleIndex(languageCode);
+
+		ArticleSearchResult* articleSearchResult = titleIndex->FindArticle(articleName, true);
+
+		if ( articleSearchResult )
+		{
+			if ( articleSearchResult->Next )
+			{
+				wstring searchResults = wikiArticle->FormatSearchResults(articleSearchResult);
+				string data = CPPStringUtils::to_utf8(searchResults);
+				int length = data.length();
+				send_headers(f, 200, "OK", NULL, "text/html; charset=utf-8", length, -1);              
+				fwrite(data.c_str(), 1, length, f);
+			}
+			else if ( articleSearchResult->Title()!=articleSearchResult->TitleInArchive() )
+				redirect_to(f, (string("/wiki/") + string(languageCode) + string(":") + articleSearchResult->TitleInArchive()).c_str());
+			else
+			{
+				// the compressed length isn't known in advance, so only chunked responses are compressed
+				bool gzip = chunked && __settings->CompressionLevel() && accepts_gzip(headers);
+				char* extra = __settings->CompressionLevel() ? (char*) "Vary: Accept-Encoding" : NULL;
+
+				// the page only changes with the data file or the settings shaping it, a client
+				// having it already is spared decompressing and parsing
+				string variant = __settings->RenderVariant() + (gzip ? "z" : "");
+				string etag = data_file_etag(titleIndex->DataFile(), articleSearchResult->BlockPos(), articleSearchResult->ArticlePos(), variant.c_str());
+				const char* pEtag = etag.empty() ? NULL : etag.c_str();
+
+				ArticleCache* articleCache = __settings->GetArticleCache();
+
+				size_t length;
+				char* html = NULL;
+				FILE* gz = NULL;
+				if ( pEtag && not_modified(headers, etag, -1) )
+					send_not_modified(f, etag, -1, -1);
+				else if ( (html=articleCache->Get(languageCode, articleSearchResult->TitleInArchive(), &length))!=NULL )
+				{
+					if ( gzip && (gz=open_gzip_stream(f))!=NULL )
+					{
+						send_headers(f, 200, "OK", GZIP_HEADERS, "text/html; charset=utf-8", CHUNKED_LENGTH, -1, pEtag);
+						fwrite(html, 1, length, gz);
+						fclose(gz);
+						send_chunk(f, NULL, 0, true);
+					}
+					else
+					{
+						// the tag was made for the compressed page
+						send_headers(f, 200, "OK", extra, "text/html; charset=utf-8", length, -1, gzip ? NULL : pEtag);
+						fwrite(html, 1, length, f);
+					}
+
+					free(html);
+				}
+				else if ( wikiArticle->LoadArticle(articleSearchResult) )
+				{
+					if ( gzip && (gz=open_gzip_stream(f))==NULL )
+						pEtag = NULL;
+
+					// http/1.1 clients get the page while the article is parsed, it starts with
+					// the head (and the stylesheets are loaded meanwhile)
+					FILE* stream = gz;
+					if ( chunked && !stream )
+						stream = open_chunked_stream(f);
+
+					if ( stream )
+					{
+						send_headers(f, 200, "OK", gz ? (char*) GZIP_HEADERS : extra, "text/html; charset=utf-8", CHUNKED_LENGTH, -1, pEtag);
+
+						wikiArticle->WritePreArticle(stream);
+						fflush(stream);
+
+						wikiArticle->ParseArticle(stream);
+
+						wikiArticle->WritePostArticle(stream);
+						fclose(stream);
+						send_chunk(f, NULL, 0, true);
+						fflush(f);
+
+						if ( articleCache->MaxSize() || __settings->CacheArticlesOnDisk() )
+						{
+							// the cache takes the html
+							html = wikiArticle->GetUtf8Article(&length);
+							articleCache->Add(languageCode, articleSearchResult->TitleInArchive(), html, length);
+						}
+					}
+					else
+					{
+						wikiArticle->ParseArticle();
+
+						if ( articleCache->MaxSize() || __settings->CacheArticlesOnDisk() )
+						{
+							html = wikiArticle->GetUtf8Article(&length);
+
+							send_headers(f, 200, "OK", extra, "text/html; charset=utf-8", length, -1, pEtag);
+							fwrite(html, 1, length, f);
+							fflush(f);
+
+							// the cache takes the html
+							articleCache->Add(languageCode, articleSearchResult->TitleInArchive(), html, length);
+						}
+						else
+						{
+							// the html is encoded while it is written, there is no copy of the whole page
+							length = wikiArticle->ArticleLength();
+							send_headers(f, 200, "OK", extra, "text/html; charset=utf-8", length, -1, pEtag);
+
+							wikiArticle->WriteArticle(f);
+						}
+					}
+				}
+				else if ( !strcmp(languageCode, "xx") && articleName=="Article not found" )
+					send_error(f, 404, "Not Found", NULL, "Article not found.");
+				else
+					redirect_to(f, "/wiki/xx/Article not found");
+
+			}
+		}
+		else if ( !strcmp(languageCode, "xx") && articleName=="Article not found" )
+			send_error(f, 404, "Not Found", NULL, "Article not found.");
+		else
+			redirect_to(f, "/wiki/xx/Article not found");
+		titleIndex->DeleteSearchResult(articleSearchResult);
+
+		delete(wikiArticle);
+	}
+}
+
+int process(char *request, FILE *f)
+{
+	char *buf = request;
+	char *method;
+	char *relativ_path;
+	char *protocol;
+	struct stat statbuf;
+	char pathbuf[4096];
+	int len;
+	char path[4096];
+	char *last;
+
+	// the request line, the headers following it are only needed for conditional requests
+	char *headers = strchr(buf, '\n');
+	if (headers) *headers++ = 0;
+	else headers = (char*) "";
+
+	//if ( settings.Verbose() )
+		printf("URL: %s\n", buf);
+
+	method = strtok_r(buf, " ", &last);
+	relativ_path = strtok_r(NULL, " ", &last);
+	protocol = strtok_r(NULL, "\r", &last);
+	if (!method || !relativ_path || !protocol) return -1;
+
+	// access is relative to the users media/wikipedia directory
+	strcpy(path, __settings->WebContentPath().c_str());
+	strcat(path, relativ_path);
+
+	if (strcasecmp(method, "GET") != 0)
+		send_error(f, 501, "Not supported", NULL, "Method is not supported.");
+	else if ( strlen(relativ_path)>=6 && strcasestr(relativ_path, "/wiki/")==relativ_path )
+	{
+		char* url = &relativ_path[6];
+
+		char languageCode[3];
+		strcpy(languageCode, __settings->DefaultLanguageCode().c_str());
+
+		if ( strlen(url)>=3 && (url[2]=='/' || url[2]==':') )
+		{
+			languageCode[0] = tolower(*url++);
+			languageCode[1] = tolower(*url++);
+			languageCode[2] = 0;
+			url++;
+		}
+
+		if ( strcasestr(url, "image:") )
+		{
+			url += 6;
+
+			string filename = CPPStringUtils::url_decode(url);
+
+			size_t pos = 0;
+			while ( (pos=filename.find(" "))!=string::npos )
+				filename.replace(pos, 1, "_", 1);
+
+			// the index/data for the "local" file
+			ImageIndex* imageIndex = __settings->GetImageIndex(languageCode);
+			fpos_t imagePos;
+			unsigned int length;
+			if ( !imageIndex->FindImage(filename, &imagePos, &length) )
+			{
+				// not found in the "local" data file, try the "coomons" one
+				imageIndex = __settings->GetImageIndex("xc");
+				if ( !imageIndex->FindImage(filename, &imagePos, &length) )
+					imageIndex = NULL;
+			}
+
+			if ( imageIndex )
+			{
+				// the images of a data file never change
+				string etag = data_file_etag(imageIndex->DataFile(), imagePos, length);
+				if ( !etag.empty() && not_modified(headers, etag, -1) )
+					send_not_modified(f, etag, -1, DUMP_MAX_AGE);
+				else
+				{
+					// straight from the data file to the socket
+					send_headers(f, 200, "OK", NULL, get_mime_type(url), length, -1, etag.empty() ? NULL : etag.c_str(), DUMP_MAX_AGE);
+					send_file_data(f, imageIndex->DataFile(), imagePos, length);
+				}
+			}
+			else
+			{
+				// first try the web content folder in the package
+				strcpy(path, __settings->WebContentPath().c_str());
+				strcat(path, "/Images/");
+				strcat(path, url);
+				if ( stat(path, &statbuf)!=0 )
+				{
+					// Nope
+					strcpy(path, __settings->Path().c_str());
+					strcat(path, "/Images/");
+					strcat(path, url);
+				}
+				if ( stat(path, &statbuf)==0 )
+					send_file(f, path, &statbuf, headers);
+				else
+				{
+					/*
+					strcpy(path, 
+settings.WebContentPath().c_str());
+					strcat(path, 
+"/Images/NotFound.gif");
+					if ( stat(path, &statbuf)==0 )
+						send_file(f, path, 
+&statbuf);
+					else
+					 */
+					send_error(f, 404, "Not Found", NULL, "File not found.");
+				}
+			}
+		}
+		else if ( !*url )
+		{
+			// redirect to the main page if possible
+			ConfigFile* configFile = __settings->LanguageConfig(languageCode);
+			if ( configFile )
+			{
+				string mainPage = configFile->GetSetting("mainPage");
+				if ( !mainPage.empty() )
+				{
+					mainPage = string("/wiki/") + languageCode + "/" + mainPage;
+					redirect_to(f, mainPage.c_str());
+					return 0;
+				}
+			}
+
+			redirect_to(f, "/wiki/xx/Article not found");
+		}
+		else
+			send_article(f, &relativ_path[6], !strcasecmp(protocol, "HTTP/1.1"), headers);
+	}
+	else if ( strlen(relativ_path)>6 && strcasestr(relativ_path, "/ajax/")==relativ_path )
+	{
+		char* url = &relativ_path[6];
+
+		if ( strcasestr(url, "search:") )
+		{
+			url += 7;
+
+			char languageCode[3];
+			if ( strlen(url)>=3 && url[2]==':' )
+			{
+				languageCode[0] = *url++;
+				languageCode[1] = *url++;
+				languageCode[2] = 0x0;
+				url++;
+			}
+			else
+			{
+				// no language code in the url, use the default one
+				strcpy(languageCode, __settings->DefaultLanguageCode().c_str());
+			}
+
+			if ( strlen(url)==0 )
+			{
+				send_error(f, 404, "Nothing to search for or search string to short.", NULL, "");
+				return 0;
+			}
+
+			TitleIndex* titleIndex = __settings->GetTitleIndex(languageCode);
+			if ( !titleIndex )
+			{
+				send_error(f, 404, "No language code not installed", NULL, "");
+				return 0;
+			}
+
+			string phrase = CPPStringUtils::url_decode(url);
+			string suggestions = titleIndex->GetSuggestions(phrase, 25);
+			int length = suggestions.length();
+
+			send_headers(f, 200, "OK", NULL, "text/html; charset=utf-8", length, -1);
+			fwrite(suggestions.c_str(), 1, length, f);
+		}                          
+		else if ( strcasestr(url, "RedirectToRandomArticle") )
+		{
+			url += 23;
+
+			char languageCode[3];
+			if ( strlen(url)>=2 )
+			{
+				languageCode[0] = *url++;
+				languageCode[1] = *url++;
+				languageCode[2] = 0x0;
+			}
+			else
+			{
+				// no language code in the url, use the default one
+				strcpy(languageCode, __settings->DefaultLanguageCode().c_str());
+			}
+
+
+			TitleIndex* titleIndex = __settings->GetTitleIndex(languageCode);
+			if ( !titleIndex || titleIndex->NumberOfArticles()<=0 )
+			{
+				redirect_to(f, "/wiki/xx/Language not installed");
+				return 0;
+			}
+
+			string articleTitle = titleIndex->GetRandomArticleTitle();
+			if ( articleTitle.empty() )
+			{
+				redirect_to(f, "/wiki/xx/Article not found");
+				return 0;
+			}
+
+			string redirectUrl = "/wiki/" + string(languageCode) + ":" + CPPStringUtils::url_encode(articleTitle);
+			redirect_to(f, redirectUrl.c_str());
+		}
+		else if ( strcasestr(url, "GetInstalledLanguages") )
+		{
+			// returns a list of installed languages, the default one is the first entry, the xx one is ignored
+			// if there are other languages
+
+			// there is a bug somewhere so memory management gets corrupted
+
+			string result;
+			ConfigFile* configFile = __settings->LanguageConfig(__settings->DefaultLanguageCode());
+			if ( configFile )
+				result = __settings->DefaultLanguageCode() + ":" + configFile->GetSetting("name", __settings->DefaultLanguageCode());
+
+			string installedLanguages = __settings->InstalledLanguages();
+			if ( !installedLanguages.empty() )
+			{
+				size_t pos = 0;
+				while ( pos!=string::npos )
+				{
+					size_t nextPos = installedLanguages.find(",", pos);
+
+					size_t length = 0;
+					if ( nextPos==string::npos )
+						length = installedLanguages.length() - pos;
+					else
+						length = nextPos - pos;
+
+					string languageCode = installedLanguages.substr(pos, length);
+					if ( languageCode!=__settings->DefaultLanguageCode() && languageCode!="xx" )
+					{
+						ConfigFile* configFile = __settings->LanguageConfig(languageCode);
+						if ( configFile )
+						{
+							result += "\n";
+							result += languageCode + ":" + configFile->GetSetting("name", languageCode);
+						}
+					}
+
+					pos = nextPos;
+					if ( pos!=string::npos )
+						pos++;
+				}
+			}
+
+			send_headers(f, 200, "OK", NULL, "text/html; charset=utf-8", result.length(), -1);
+			fwrite(result.c_str(), 1, result.length(), f);
+		}
+		else if ( strcasestr(url, "GetStatistics") )
+		{
+			BlockCache* blockCache = __settings->GetBlockCache();
+			TemplateCache* templateCache = __settings->GetTemplateCache();
+			ArticleCache* articleCache = __settings->GetArticleCache();
+
+			char result[1024];
+			snprintf(result, sizeof(result), "blockCacheHits:%u\nblockCacheMisses:%u\nblockCacheBlocks:%d\nblockCacheSize:%lu\nblockCacheMaxSize:%lu\n"
+				"templateCacheHits:%u\ntemplateCacheMisses:%u\ntemplateCacheTemplates:%d\ntemplateCacheSize:%lu\ntemplateCacheMaxSize:%lu\n"
+				"articleCacheHits:%u\narticleCacheDiskHits:%u\narticleCacheMisses:%u\narticleCacheArticles:%d\narticleCacheSize:%lu\narticleCacheMaxSize:%lu\n"
+				"expressionCacheHits:%u\nexpressionCacheMisses:%u",
+				blockCache->Hits(), blockCache->Misses(), blockCache->NumberOfBlocks(), (unsigned long) blockCache->Size(), (unsigned long) blockCache->MaxSize(),
+				templateCache->Hits(), templateCache->Misses(), templateCache->NumberOfTemplates(), (unsigned long) templateCache->Size(), (unsigned long) templateCache->MaxSize(),
+				articleCache->Hits(), articleCache->DiskHits(), articleCache->Misses(), articleCache->NumberOfArticles(), (unsigned long) articleCache->Size(), (unsigned long) articleCache->MaxSize(),
+				Expression::Hits(), Expression::Misses());
+
+			send_headers(f, 200, "OK", NULL, "text/plain; charset=utf-8", strlen(result), -1);
+			fwrite(result, 1, strlen(result), f);
+		}
+		else
+		{
+			send_error(f, 404, "Command not found", NULL, "File not found.");
+		}
+	}
+	else
+	{
+		if ( stat(path, &statbuf) < 0 )
+		{
+			// if this is not found switch to the users media dir
+			strcpy(path, __settings->Path().c_str());
+			strcat(path, relativ_path);
+		}
+		if (stat(path, &statbuf) < 0) {
+			send_error(f, 404, "Not Found", NULL, "File not found.");
+		}
+		else if (S_ISDIR(statbuf.st_mode))
+		{
+			len = strlen(path);
+			if (len == 0 || path[len - 1] != '/')
+			{
+				snprintf(pathbuf, sizeof(pathbuf), "%s/index.html", path);
+				if (stat(pathbuf, &statbuf) >= 0)
+				{
+					char newLocation[512];
+					snprintf(newLocation, sizeof(newLocation), "%s/index.html", relativ_path);      
+
+					redirect_to(f, newLocation);
+				}
+				else {
+					snprintf(pathbuf, sizeof(pathbuf), "Location: %s/", path);
+					send_error(f, 302, "Found", pathbuf, "Directories must end with a slash.");
+				}
+			}
+			else
+			{
+				snprintf(pathbuf, sizeof(pathbuf), "%sindex.html", path);
+				if (stat(pathbuf, &statbuf) >= 0)
+					send_file(f, pathbuf, &statbuf, headers);
+				else if ( DIRECTORY_LISTING_ALLOWED )
+				{
+					DIR *dir;
+					struct dirent *de;
+
+					send_headers(f, 200, "OK", NULL, "text/html", -1, statbuf.st_mtime);
+					fprintf(f, "<HTML><HEAD><TITLE>Index of %s</TITLE></HEAD>\r\n<BODY>", path);
+					fprintf(f, "<H4>Index of %s</H4>\r\n<PRE>\n", path);
+					fprintf(f, "Name Last Modified Size\r\n");
+					fprintf(f, "<HR>\r\n");
+					if (len > 1) fprintf(f, "<A HREF=\"..\">..</A>\r\n");
+
+					dir = opendir(path);
+					while ((de = readdir(dir)) != NULL)
+					{
+						char timebuf[32];
+						struct tm tm;
+						int namlen = strlen(de->d_name);
+
+						strcpy(pathbuf, path);
+						strcat(pathbuf, de->d_name);
+
+						stat(pathbuf, &statbuf);
+						gmtime_r(&statbuf.st_mtime, &tm);
+						strftime(timebuf, sizeof(timebuf), "%d-%b-%Y %H:%M:%S", &tm);
+
+						fprintf(f, "<A HREF=\"%s%s\">", de->d_name, S_ISDIR(statbuf.st_mode) ? "/" : "");
+						fprintf(f, "%s%s", de->d_name, S_ISDIR(statbuf.st_mode) ? "/</A>" : "</A> ");
+						if (namlen < 32) fprintf(f, "%*s", 32 - namlen, "");
+
+						if (S_ISDIR(statbuf.st_mode))
+							fprintf(f, "%s\r\n", timebuf);
+						else
+							fprintf(f, "%s %10d\r\n", timebuf, statbuf.st_size);
+					}
+					closedir(dir);
+
+					fprintf(f, "</PRE>\r\n<HR>\r\n<ADDRESS>%s</ADDRESS>\r\n</BODY></HTML>\r\n", SERVER);
+				}
+				else
+					send_error(f, 403, "Directory Listing Denied", NULL, "This virtual directory does not allow contents to be listed.");
+			}
+		}
+		else
+			send_file(f, path, &statbuf, headers);
+	}
+
+	return 0;
+}
+
+// returns the length of the request line and headers (including the empty line ending them)
+// at the start of data, or 0 if they are not complete yet
+static int request_length(const char* data, int length)
+{
+	for (int i=0; i<length; i++)
+	{
+		if ( data[i]!='\n' )
+			continue;
+
+		if ( i+1<length && data[i+1]=='\n' )
+			return i+2;
+		if ( i+2<length && data[i+1]=='\r' && data[i+2]=='\n' )
+			return i+3;
+	}
+
+	return 0;
+}
+
+// the empty lines between requests are ignored, returns the length of the request at the
+// start of the buffer or 0 if it isn't complete yet
+static int complete_request(CONNECTION* connection)
+{
+	while ( connection->start<connection->end && (connection->buffer[connection->start]=='\r' || connection->buffer[connection->start]=='\n') )
+		connection->start++;
+
+	return request_length(connection->buffer + connection->start, connection->end - connection->start);
+}
+
+// copies the next complete request into request (size has to exceed REQUEST_BUFFER_SIZE), the bytes
+// following it stay in the connection's buffer; false if there is no complete request
+static bool next_request(CONNECTION* connection, char* request, int size)
+{
+	int length = complete_request(connection);
+	if ( !length || length>=size )
+		return false;
+
+	memcpy(request, connection->buffer + connection->start, length);
+	request[length] = 0x0;
+	connection->start += length;
+
+	return true;
+}
+
+// reads whatever has arrived on the (non blocking) socket, false on eof, errors or a request
+// not fitting in the buffer
+static bool receive(CONNECTION* connection)
+{
+	if ( connection->start>0 )
+	{
+		memmove(connection->buffer, connection->buffer + connection->start, connection->end - connection->start);
+		connection->end -= connection->start;
+		connection->start = 0;
+	}
+
+	while ( connection->end<REQUEST_BUFFER_SIZE )
+	{
+		int n = recv(connection->socket, connection->buffer + connection->end, REQUEST_BUFFER_SIZE - connection->end, 0);
+		if ( n>0 )
+			connection->end += n;
+		else if ( n==0 )
+			return false;
+		else if ( errno!=EINTR )
+			return errno==EAGAIN || errno==EWOULDBLOCK;
+	}
+
+	return complete_request(connection)>0;
+}
+
+// http/1.1 connections are persistent unless the client asks to close them, http/1.0 ones only on request
+static bool keep_alive_requested(const char* request)
+{
+	const char* line = strchr(request, '\n');
+	if ( !line )
+		return false;
+
+	// the protocol is the last word of the request line
+	const char* protocol = line;
+	while ( protocol>request && protocol[-1]!=' ' )
+		protocol--;
+
+	bool keepAlive = !strncasecmp(protocol, "HTTP/1.1", 8);
+
+	while ( *++line )
+	{
+		const char* eol = strchr(line, '\n');
+		if ( !eol )
+			break;
+
+		string value = string(line, eol - line);
+		if ( !strncasecmp(line, "Connection:", 11) )
+		{
+			if ( strcasestr(value.c_str(), "close") )
+				keepAlive = false;
+			else if ( strcasestr(value.c_str(), "keep-alive") )
+				keepAlive = true;
+		}
+		else if ( !strncasecmp(line, "Transfer-Encoding:", 18) || (!strncasecmp(line, "Content-Length:", 15) && atoi(value.c_str() + 15)!=0) )
+		{
+			// a request body isn't read, nothing after it could be understood
+			return false;
+		}
+
+		line = eol;
+	}
+
+	return keepAlive;
+}
+
+static void set_blocking(int fd, bool blocking)
+{
+	int flags = fcntl(fd, F_GETFL, 0);
+	if ( flags!=-1 )
+		fcntl(fd, F_SETFL, blocking ? flags & ~O_NONBLOCK : flags | O_NONBLOCK);
+}
+
+static CONNECTION* open_connection(int s)
+{
+	CONNECTION* connection = (CONNECTION*) malloc(sizeof(CONNECTION));
+	FILE* out = connection ? fdopen(s, "w") : NULL;
+	if ( !out )
+	{
+		if ( connection )
+			free(connection);
+		close(s);
+		return NULL;
+	}
+
+	// a client not reading its response doesn't keep the worker forever
+	struct timeval timeout;
+	timeout.tv_sec = SEND_TIMEOUT;
+	timeout.tv_usec = 0;
+	setsockopt(s, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+	set_blocking(s, false);
+
+	connection->socket = s;
+	connection->out = out;
+	connection->keepAlive = false;
+	connection->start = 0;
+	connection->end = 0;
+	connection->lastActivity = time(NULL);
+	connection->prev = NULL;
+	connection->next = NULL;
+
+	return connection;
+}
+
+static void close_connection(CONNECTION* connection)
+{
+	// closes the socket too
+	fclose(connection->out);
+	free(connection);
+}
+
+static void link_connection(CONNECTION** first, CONNECTION* connection)
+{
+	connection->prev = NULL;
+	connection->next = *first;
+	if ( connection->next )
+		connection->next->prev = connection;
+	*first = connection;
+}
+
+static void unlink_connection(CONNECTION** first, CONNECTION* connection)
+{
+	if ( connection->prev )
+		connection->prev->next = connection->next;
+	else
+		*first = connection->next;
+
+	if ( connection->next )
+		connection->next->prev = connection->prev;
+
+	connection->prev = NULL;
+	connection->next = NULL;
+}
+
+// the data of the listening socket in the poller, _socket is volatile and can't be used
+static char listenTag;
+
+// the event loop waits for readable sockets with epoll on linux and kqueue everywhere else
+static int poller_create()
+{
+#ifdef __linux__
+	return epoll_create(MAX_EVENTS);
+#else
+	return kqueue();
+#endif
+}
+
+static bool poller_add(int poller, int fd, void* data)
+{
+#ifdef __linux__
+	struct epoll_event event;
+	memset(&event, 0, sizeof(event));
+	event.events = EPOLLIN;
+	event.data.ptr = data;
+
+	return epoll_ctl(poller, EPOLL_CTL_ADD, fd, &event)==0;
+#else
+	struct kevent event;
+	EV_SET(&event, fd, EVFILT_READ, EV_ADD, 0, 0, data);
+
+	return kevent(poller, &event, 1, NULL, 0, NULL)==0;
+#endif
+}
+
+static void poller_remove(int poller, int fd)
+{
+#ifdef __linux__
+	// older kernels don't accept a NULL event
+	struct epoll_event event;
+	memset(&event, 0, sizeof(event));
+	epoll_ctl(poller, EPOLL_CTL_DEL, fd, &event);
+#else
+	struct kevent event;
+	EV_SET(&event, fd, EVFILT_READ, EV_DELETE, 0, 0, NULL);
+	kevent(poller, &event, 1, NULL, 0, NULL);
+#endif
+}
+
+// waits up to timeout ms, the data of the readable sockets is stored in ready
+static int poller_wait(int poller, void** ready, int maxReady, int timeout)
+{
+#ifdef __linux__
+	struct epoll_event events[maxReady];
+	int n = epoll_wait(poller, events, maxReady, timeout);
+	for (int i=0; i<n; i++)
+		ready[i] = events[i].data.ptr;
+#else
+	struct kevent events[maxReady];
+	struct timespec ts;
+	ts.tv_sec = timeout/1000;
+	ts.tv_nsec = (timeout%1000)*1000000;
+	int n = kevent(poller, NULL, 0, events, maxReady, &ts);
+	for (int i=0; i<n; i++)
+		ready[i] = events[i].udata;
+#endif
+
+	return n;
+}
+
+HttpServer::HttpServer(int numberOfWorkers, int maxPendingConnections)
+{
+	_socket = -1;
+	_stopped = false;
+
+	_poller = -1;
+	_wakeup[0] = -1;
+	_wakeup[1] = -1;
+	_returnedConnections = NULL;
+
+	if ( numberOfWorkers<1 )
+		numberOfWorkers = 1;
+	if ( maxPendingConnections<1 )
+		maxPendingConnections = 1;
+
+	_numberOfWorkers = numberOfWorkers;
+	_workers = (pthread_t*) malloc(sizeof(pthread_t)*_numberOfWorkers);
+
+	_maxPendingConnections = maxPendingConnections;
+	_pendingConnections = (void**) malloc(sizeof(void*)*_maxPendingConnections);
+	_firstPending = 0;
+	_numberOfPending = 0;
+
+	pthread_mutex_init(&_mutex, NULL);
+	pthread_cond_init(&_connectionAvailable, NULL);
+	pthread_cond_init(&_slotAvailable, NULL);
+}
+
+HttpServer::~HttpServer()
+{
+	if ( _socket!=-1 )
+		close(_socket);
+
+	if ( _wakeup[0]!=-1 )
+	{
+		close(_wakeup[0]);
+		close(_wakeup[1]);
+	}
+	if ( _poller!=-1 )
+		close(_poller);
+
+	pthread_cond_destroy(&_slotAvailable);
+	pthread_cond_destroy(&_connectionAvailable);
+	pthread_mutex_destroy(&_mutex);
+
+	free(_pendingConnections);
+	free(_workers);
+}
+
+bool HttpServer::Listen(in_addr_t addr, int port)
+{
+	struct sockaddr_in sin;
+
+	int s = socket(AF_INET, SOCK_STREAM, 0);
+	if ( s<0 )
+		return false;
+
+	int reuse = 1;
+	if ( setsockopt(s, SOL_SOCKET, SO_REUSEADDR, (char*) &reuse, sizeof(int))<0 )
+	{
+		fprintf(stderr, "setsockopt() failed, maybe the socket is already in use?\r\n");
+		close(s);
+		return false;
+	}
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(port);
+	sin.sin_addr.s_addr = addr;
+
+	if ( bind(s, (struct sockaddr *) &sin, sizeof(sin))!=0 || listen(s, 25)!=0 )
+	{
+		fprintf(stderr, "Failed to listen on port %d on host %s\r\n", ntohs(sin.sin_port), inet_ntoa(sin.sin_addr));
+		close(s);
+		return false;
+	}
+
+	_socket = s;
+	return true;
+}
+
+void HttpServer::Run()
+{
+	int listenSocket = _socket;
+	if ( listenSocket==-1 )
+		return;
+
+	_poller = poller_create();
+	if ( _poller==-1 || pipe(_wakeup)!=0 )
+	{
+		fprintf(stderr, "Failed to create the event loop\r\n");
+		return;
+	}
+
+	set_blocking(listenSocket, false);
+	set_blocking(_wakeup[0], false);
+	set_blocking(_wakeup[1], false);
+
+	// the listening socket and the pipe are told apart from the connections by their data
+	poller_add(_poller, listenSocket, &listenTag);
+	poller_add(_poller, _wakeup[0], _wakeup);
+
+	int numberOfWorkers = 0;
+	while ( numberOfWorkers<_numberOfWorkers )
+	{
+		if ( pthread_create(&_workers[numberOfWorkers], NULL, WorkerThread, this)!=0 )
+			break;
+		numberOfWorkers++;
+	}
+
+	// connections waiting for (the rest of) a request, only touched by this thread
+	CONNECTION* idleConnections = NULL;
+	time_t lastTimeoutCheck = time(NULL);
+
+	void* ready[MAX_EVENTS];
+	while ( !_stopped )
+	{
+		int n = poller_wait(_poller, ready, MAX_EVENTS, 1000);
+		if ( n<0 )
+		{
+			if ( errno==EINTR )
+				continue;
+			break;
+		}
+
+		for (int i=0; i<n && !_stopped; i++)
+		{
+			if ( ready[i]==&listenTag )
+			{
+				while ( true )
+				{
+					int s = accept(listenSocket, NULL, NULL);
+					if ( s<0 )
+					{
+						if ( errno==EINTR || errno==ECONNABORTED )
+							continue;
+						break;
+					}
+
+					CONNECTION* connection = open_connection(s);
+					if ( !connection )
+						continue;
+
+					if ( !poller_add(_poller, s, connection) )
+					{
+						close_connection(connection);
+						continue;
+					}
+
+					link_connection(&idleConnections, connection);
+				}
+			}
+			else if ( ready[i]==_wakeup )
+			{
+				char buffer[64];
+				while ( read(_wakeup[0], buffer, sizeof(buffer))>0 )
+					;
+
+				// connections the workers are done with
+				pthread_mutex_lock(&_mutex);
+				CONNECTION* connection = (CONNECTION*) _returnedConnections;
+				_returnedConnections = NULL;
+				pthread_mutex_unlock(&_mutex);
+
+				while ( connection )
+				{
+					CONNECTION* next = connection->next;
+
+					connection->lastActivity = time(NULL);
+					if ( poller_add(_poller, connection->socket, connection) )
+						link_connection(&idleConnections, connection);
+					else
+						close_connection(connection);
+
+					connection = next;
+				}
+			}
+			else
+			{
+				CONNECTION* connection = (CONNECTION*) ready[i];
+				if ( !receive(connection) )
+				{
+					// closing the socket removes it from the poller
+					unlink_connection(&idleConnections, connection);
+					close_connection(connection);
+				}
+				else if ( complete_request(connection) )
+				{
+					// the worker owns the connection until the response is sent
+					poller_remove(_poller, connection->socket);
+					unlink_connection(&idleConnections, connection);
+
+					if ( !numberOfWorkers )
+						ServeRequests(connection);
+					else if ( !PushConnection(connection) )
+						close_connection(connection);
+				}
+				else
+					connection->lastActivity = time(NULL);
+			}
+		}
+
+		time_t now = time(NULL);
+		if ( now!=lastTimeoutCheck )
+		{
+			lastTimeoutCheck = now;
+
+			CONNECTION* connection = idleConnections;
+			while ( connection )
+			{
+				CONNECTION* next = connection->next;
+				if ( now - connection->lastActivity>=KEEPALIVE_TIMEOUT )
+				{
+					unlink_connection(&idleConnections, connection);
+					close_connection(connection);
+				}
+
+				connection = next;
+			}
+		}
+	}
+
+	pthread_mutex_lock(&_mutex);
+	_stopped = true;
+	pthread_cond_broadcast(&_connectionAvailable);
+	pthread_cond_broadcast(&_slotAvailable);
+	pthread_mutex_unlock(&_mutex);
+
+	for (int i=0; i<numberOfWorkers; i++)
+		pthread_join(_workers[i], NULL);
+
+	// connections nobody has taken care of
+	while ( _numberOfPending>0 )
+	{
+		close_connection((CONNECTION*) _pendingConnections[_firstPending]);
+		_firstPending = (_firstPending + 1) % _maxPendingConnections;
+		_numberOfPending--;
+	}
+
+	while ( idleConnections )
+	{
+		CONNECTION* connection = idleConnections;
+		unlink_connection(&idleConnections, connection);
+		close_connection(connection);
+	}
+
+	while ( _returnedConnections )
+	{
+		CONNECTION* connection = (CONNECTION*) _returnedConnections;
+		_returnedConnections = connection->next;
+		close_connection(connection);
+	}
+
+	if ( _socket!=-1 )
+	{
+		close(_socket);
+		_socket = -1;
+	}
+}
+
+void HttpServer::Stop()
+{
+	// only async signal safe calls here, Run() does the cleanup
+	_stopped = true;
+
+	int s = _socket;
+	if ( s!=-1 )
+	{
+		_socket = -1;
+		shutdown(s, SHUT_RDWR);
+		close(s);
+	}
+
+	// wakes up the event loop
+	if ( _wakeup[1]!=-1 )
+		write(_wakeup[1], "", 1);
+}
+
+bool HttpServer::PushConnection(void* connection)
+{
+	pthread_mutex_lock(&_mutex);
+
+	// the event loop blocks while all workers are busy and the queue is full
+	while ( !_stopped && _numberOfPending==_maxPendingConnections )
+		pthread_cond_wait(&_slotAvailable, &_mutex);
+
+	if ( _stopped )
+	{
+		pthread_mutex_unlock(&_mutex);
+		return false;
+	}
+
+	_pendingConnections[(_firstPending + _numberOfPending) % _maxPendingConnections] = connection;
+	_numberOfPending++;
+
+	pthread_cond_signal(&_connectionAvailable);
+	pthread_mutex_unlock(&_mutex);
+
+	return true;
+}
+
+void* HttpServer::PopConnection()
+{
+	pthread_mutex_lock(&_mutex);
+
+	while ( !_stopped && _numberOfPending==0 )
+		pthread_cond_wait(&_connectionAvailable, &_mutex);
+
+	void* connection = NULL;
+	if ( !_stopped )
+	{
+		connection = _pendingConnections[_firstPending];
+		_firstPending = (_firstPending + 1) % _maxPendingConnections;
+		_numberOfPending--;
+
+		pthread_cond_signal(&_slotAvailable);
+	}
+	else
+		pthread_cond_broadcast(&_slotAvailable); // Stop() can't do that from the signal handler
+
+	pthread_mutex_unlock(&_mutex);
+
+	return connection;
+}
+
+void HttpServer::ReturnConnection(void* item)
+{
+	CONNECTION* connection = (CONNECTION*) item;
+
+	pthread_mutex_lock(&_mutex);
+	connection->prev = NULL;
+	connection->next = (CONNECTION*) _returnedConnections;
+	_returnedConnections = connection;
+	pthread_mutex_unlock(&_mutex);
+
+	write(_wakeup[1], "", 1);
+}
+
+void HttpServer::ServeRequests(void* item)
+{
+	CONNECTION* connection = (CONNECTION*) item;
+	char request[REQUEST_BUFFER_SIZE + 1];
+
+	// the response is written directly by the parser, that needs a blocking socket
+	set_blocking(connection->socket, true);
+
+	current_connection();
+	pthread_setspecific(connectionKey, connection);
+
+	// pipelined requests already received are answered in turn
+	bool keepAlive = true;
+	while ( keepAlive && next_request(connection, request, sizeof(request)) )
+	{
+		connection->keepAlive = keep_alive_requested(request);
+		keepAlive = process(request, connection->out)==0 && fflush(connection->out)==0 && connection->keepAlive;
+	}
+
+	pthread_setspecific(connectionKey, NULL);
+
+	if ( keepAlive )
+	{
+		set_blocking(connection->socket, false);
+		ReturnConnection(connection);
+	}
+	else
+		close_connection(connection);
+}
+
+void* HttpServer::WorkerThread(void* param)
+{
+	HttpServer* server = (HttpServer*) param;
+
+	void* connection;
+	while ( (connection=server->PopConnection())!=NULL )
+		server->ServeRequests(connection);
+
+	return NULL;
+}
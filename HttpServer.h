@@ -0,0 +1,111 @@
+/*
+ *  HttpServer.h
+ *  Wiki2Touch/wikisrvd
+ *
+ *  Copyright (c) 2008 by Tom Haukap.
+ *
+ *  This file is part of Wiki2Touch.
+ *
+ *  Wiki2Touch is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Wiki2Touch is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Wiki2Touch. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef HTTPSERVER_H
+#define HTTPSERVER_H
+
+#include <stdio.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+
+#define SERVER "wikiserver/1.0"
+#define PROTOCOL "HTTP/1.1"
+#define RFC1123FMT "%a, %d %b %Y %H:%M:%S GMT"
+
+#define DIRECTORY_LISTING_ALLOWED false
+
+// default number of connections with a complete request waiting for a free worker
+#define MAX_PENDING_CONNECTIONS 64
+
+// seconds an idle persistent connection is kept open
+#define KEEPALIVE_TIMEOUT 15
+
+// seconds a response may be blocked by a client not reading it
+#define SEND_TIMEOUT 30
+
+// seconds a client may use its copy of a file of the web content without asking again
+#define STATIC_MAX_AGE 3600
+
+// the same for images from the data files, they only change if the data file is replaced
+#define DUMP_MAX_AGE 604800
+
+// maximum number of sockets handled per pass of the event loop
+#define MAX_EVENTS 64
+
+// maximum size of a request line and its headers
+#define REQUEST_BUFFER_SIZE 8192
+
+// handles a single request (the request line and headers), the response is written to f
+int process(char *request, FILE *f);
+
+class HttpServer
+{
+public:
+	HttpServer(int numberOfWorkers, int maxPendingConnections = MAX_PENDING_CONNECTIONS);
+	~HttpServer();
+
+	bool Listen(in_addr_t addr, int port);
+
+	// runs the event loop until Stop() is called: connections are accepted and requests
+	// are received without blocking, complete requests are answered by the workers
+	void Run();
+
+	// may be called from a signal handler
+	void Stop();
+
+private:
+	static void* WorkerThread(void* param);
+
+	bool PushConnection(void* connection);
+	void* PopConnection();
+
+	// answers the received requests of a connection, it is handed back to the event loop
+	// if it stays open
+	void ServeRequests(void* connection);
+	void ReturnConnection(void* connection);
+
+	volatile int _socket;
+	volatile bool _stopped;
+
+	int _poller;
+
+	// a byte written to the pipe wakes up the event loop
+	int _wakeup[2];
+
+	int _numberOfWorkers;
+	pthread_t* _workers;
+
+	// bounded ring buffer of connections with a complete request
+	void** _pendingConnections;
+	int _maxPendingConnections;
+	int _firstPending;
+	int _numberOfPending;
+
+	// connections the workers are done with, taken over by the event loop
+	void* _returnedConnections;
+
+	pthread_mutex_t _mutex;
+	pthread_cond_t _connectionAvailable;
+	pthread_cond_t _slotAvailable;
+};
+
+#endif
@@ -20,6 +20,12 @@
  *  along with Wiki2Touch. If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
 #include "ImageIndex.h"
 #include "CPPStringUtils.h"
 
@@ -27,6 +33,7 @@ const char* IMAGES_DATA_NAME = "images";
 const char* IMAGES_DATA_EXTENSION = ".bin";
 
 #define SIZEOF_POSITION_INFORMATION 16
+#define TITLERECORD_READ_SIZE 512
 
 #pragma pack(1)
 typedef struct 
@@ -50,9 +57,10 @@ ImageIndex::ImageIndex(string pathToDataFile)
 	
 	_numberOfImages = -1;
 		
-	// get the number of articles; this also checks if the files exists
-	FILE* f = fopen(_dataFileName.c_str(), "rb");
-	if ( !f )
+	// get the number of articles; this also checks if the files exists. The file stays open
+	// until the index is deleted, all threads read it with pread()
+	_dataFile = open(_dataFileName.c_str(), O_RDONLY);
+	if ( _dataFile<0 )
 	{
 		// second try
 		_dataFileName = "";
@@ -70,15 +78,15 @@ ImageIndex::ImageIndex(string pathToDataFile)
 		}
 		
 		if ( _dataFileName!="" )
-			f = fopen(_dataFileName.c_str(), "rb");
+			_dataFile = open(_dataFileName.c_str(), O_RDONLY);
 	}
 	
-	if ( f )
+	if ( _dataFile>=0 )
 	{
 		int error = 0;
 
 		IMAGEFILEHEADER fileheader;		
-		if ( fread(&fileheader, sizeof(IMAGEFILEHEADER), 1, f)!=1 )
+		if ( pread(_dataFile, &fileheader, sizeof(IMAGEFILEHEADER), 0)!=sizeof(IMAGEFILEHEADER) )
 			error = 1;
 		
 		if ( !error ) 
@@ -87,8 +95,6 @@ ImageIndex::ImageIndex(string pathToDataFile)
 			_titlesPos = fileheader.titlesPos;
 			_indexPos = fileheader.indexPos;
 		}
-		
-		fclose(f);
 	}
 	else
 		_dataFileName = "";
@@ -96,23 +102,20 @@ ImageIndex::ImageIndex(string pathToDataFile)
 
 ImageIndex::~ImageIndex()
 {
+	if ( _dataFile>=0 )
+		close(_dataFile);
 }
 
-unsigned char* ImageIndex::GetImage(string filename, int* size)
+bool ImageIndex::FindImage(string filename, fpos_t* imagePos, unsigned int* imageLength)
 {
-	_lastImagePos = -1;
-	_lastImageLength = 0;
-	
-	if ( !size )
-		return NULL;
-	*size = 0;
+	*imagePos = -1;
+	*imageLength = 0;
 	
 	if ( _numberOfImages<=0  )
-		return NULL;
+		return false;
 
-	FILE* f = fopen(_dataFileName.c_str(), "rb");
-	if ( !f )
-		return NULL;
+	if ( _dataFile<0 )
+		return false;
 
 	string lowercaseFilename = CPPStringUtils::to_lower_utf8(filename);
 	
@@ -130,7 +133,7 @@ unsigned char* ImageIndex::GetImage(string filename, int* size)
 		index = (lBound + uBound) >> 1;
 		
 		// get the title at the specific index
-		string filenameAtIndex = GetFilename(f, index);
+		string filenameAtIndex = GetFilename(index, imagePos, imageLength);
 		
 		if ( lowercaseFilename<filenameAtIndex )
 			uBound = index - 1;
@@ -144,23 +147,14 @@ unsigned char* ImageIndex::GetImage(string filename, int* size)
 	}
 	
 	if ( foundAt<0 )
-	{
-		fclose(f);
-		return NULL;
-	}
+		return false;
 
-	if ( _lastImagePos<0 || _lastImageLength==0 )
-	{
-		fclose(f);
-		return NULL;
-	}
-	
-	unsigned char* data = (unsigned char*) malloc(_lastImageLength);
-	fseeko(f, _lastImagePos, SEEK_SET);
-	*size = fread(data, 1, _lastImageLength, f);
-	fclose(f);
-	
-	return data;
+	return *imagePos>=0 && *imageLength>0;
+}
+
+int ImageIndex::DataFile()
+{
+	return _dataFile;
 }
 
 int ImageIndex::NumberOfImages()
@@ -168,41 +162,52 @@ int ImageIndex::NumberOfImages()
 	return _numberOfImages;
 }
 
-string ImageIndex::GetFilename(FILE* f, int imageNumber)
+string ImageIndex::GetFilename(int imageNumber, fpos_t* imagePos, unsigned int* imageLength)
 {
-	_lastImagePos = 0;
-	_lastImageLength = 0;					  
+	*imagePos = 0;
+	*imageLength = 0;
 						  
-	if ( !f || imageNumber<0 || imageNumber>=_numberOfImages  )
+	if ( _dataFile<0 || imageNumber<0 || imageNumber>=_numberOfImages  )
 		return string();
 	
-	int error = fseeko(f, _indexPos + imageNumber*sizeof(int), SEEK_SET);
-	if ( error )
-		return string();
-
 	int titlePos;
-	size_t read = fread(&titlePos, sizeof(int), 1, f);
-
-	if ( !read )
+	if ( pread(_dataFile, &titlePos, sizeof(int), _indexPos + (fpos_t) imageNumber*sizeof(int))!=sizeof(int) )
 		return string();
-
-	error = fseeko(f, _titlesPos + titlePos, SEEK_SET);
-	if ( error )
+	
+	// one read usually covers the whole record
+	char buffer[TITLERECORD_READ_SIZE];
+	fpos_t pos = _titlesPos + titlePos;
+	
+	ssize_t read = pread(_dataFile, buffer, sizeof(buffer), pos);
+	if ( read<SIZEOF_POSITION_INFORMATION )
 		return string();
 	
-	// store the article location and size for use in the future
-	fread(&_lastImagePos, sizeof(_lastImagePos), 1, f);
-	fread(&_lastImageLength, sizeof(_lastImageLength), 1, f);
+	// store the image location and size for use in the future
+	memcpy(imagePos, buffer, sizeof(*imagePos));
+	memcpy(imageLength, buffer + sizeof(*imagePos), sizeof(*imageLength));
 	
 	string result;
-	unsigned char c = 0;
-	while ( !feof(f) && (c=fgetc(f)) )
-		result += c;
+	ssize_t offset = SIZEOF_POSITION_INFORMATION;
+	while ( true )
+	{
+		const char* start = buffer + offset;
+		const char* end = (const char*) memchr(start, 0, read - offset);
+		if ( end )
+		{
+			result.append(start, end - start);
+			break;
+		}
+		
+		// the name continues behind the buffer
+		result.append(start, read - offset);
+		
+		pos += read;
+		read = pread(_dataFile, buffer, sizeof(buffer), pos);
+		if ( read<=0 )
+			break;
+		
+		offset = 0;
+	}
 	
 	return result;
 }
-
-
-
-
-
@@ -33,19 +33,21 @@ public:
 	~ImageIndex();
 	
 	int NumberOfImages();
-	unsigned char* GetImage(string filename, int* size);
+
+	// looks up the position and size of an image inside the data file, so it can be sent
+	// from there without reading it
+	bool FindImage(string filename, fpos_t* imagePos, unsigned int* imageLength);
+	int DataFile();
 	
 private:
 	string	_dataFileName;
+	int		_dataFile;
 	int		_numberOfImages;
 	
 	fpos_t	_titlesPos;
 	fpos_t	_indexPos;
 	
-	string GetFilename(FILE* f, int imageNumber);
-	
-	fpos_t			_lastImagePos;
-	unsigned int	_lastImageLength;
+	string GetFilename(int imageNumber, fpos_t* imagePos, unsigned int* imageLength);
 };
 
 #endif
@@ -0,0 +1,217 @@
+/*
+ *  LruCache.cpp
+ *  Wiki2Touch/wikisrvd
+ *
+ *  Copyright (c) 2008 by Tom Haukap.
+ *
+ *  This file is part of Wiki2Touch.
+ *
+ *  Wiki2Touch is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Wiki2Touch is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Wiki2Touch. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "LruCache.h"
+
+typedef struct tagLRUITEM
+{
+	string	key;
+	unsigned int hash;
+
+	void*	value;
+	size_t	size;
+
+	tagLRUITEM* prev;
+	tagLRUITEM* next;
+	tagLRUITEM* nextInBucket;
+} LRUITEM;
+
+LruCache::LruCache(size_t maxSize, int numberOfBuckets)
+{
+	_maxSize = maxSize;
+	_size = 0;
+	_numberOfItems = 0;
+	_hits = 0;
+	_misses = 0;
+
+	_numberOfBuckets = numberOfBuckets;
+	_first = NULL;
+	_last = NULL;
+	_buckets = (void**) calloc(numberOfBuckets, sizeof(void*));
+
+	pthread_mutex_init(&_mutex, NULL);
+}
+
+LruCache::~LruCache()
+{
+	free(_buckets);
+
+	pthread_mutex_destroy(&_mutex);
+}
+
+size_t LruCache::MaxSize()
+{
+	return _maxSize;
+}
+
+size_t LruCache::Size()
+{
+	return _size;
+}
+
+unsigned int LruCache::Hits()
+{
+	return _hits;
+}
+
+unsigned int LruCache::Misses()
+{
+	return _misses;
+}
+
+void* LruCache::Find(const string& key, unsigned int hash)
+{
+	LRUITEM* item = (LRUITEM*) FindItem(key, hash);
+
+	return item ? item->value : NULL;
+}
+
+void* LruCache::Use(const string& key, unsigned int hash)
+{
+	LRUITEM* item = (LRUITEM*) FindItem(key, hash);
+	if ( !item )
+		return NULL;
+
+	MoveToFront(item);
+
+	return item->value;
+}
+
+bool LruCache::Insert(const string& key, unsigned int hash, void* value, size_t size)
+{
+	if ( size>_maxSize/2 )
+		return false;
+
+	while ( _last && _size+size>_maxSize )
+		RemoveItem(_last);
+
+	LRUITEM* item = new LRUITEM;
+	item->key = key;
+	item->hash = hash;
+	item->value = value;
+	item->size = size;
+
+	item->prev = NULL;
+	item->next = (LRUITEM*) _first;
+	if ( item->next )
+		item->next->prev = item;
+	else
+		_last = item;
+	_first = item;
+
+	int bucket = hash % _numberOfBuckets;
+	item->nextInBucket = (LRUITEM*) _buckets[bucket];
+	_buckets[bucket] = item;
+
+	_size += size;
+	_numberOfItems++;
+
+	return true;
+}
+
+void LruCache::Remove(const string& key, unsigned int hash)
+{
+	void* item = FindItem(key, hash);
+	if ( item )
+		RemoveItem(item);
+}
+
+void LruCache::Clear()
+{
+	while ( _first )
+		RemoveItem(_first);
+}
+
+unsigned int LruCache::Hash(const string& key)
+{
+	unsigned int hash = 0;
+
+	const char* p = key.c_str();
+	while ( *p )
+		hash = hash*31 + (unsigned char) *p++;
+
+	return hash;
+}
+
+void* LruCache::FindItem(const string& key, unsigned int hash)
+{
+	LRUITEM* item = (LRUITEM*) _buckets[hash % _numberOfBuckets];
+	while ( item )
+	{
+		if ( item->hash==hash && item->key==key )
+			return item;
+
+		item = item->nextInBucket;
+	}
+
+	return NULL;
+}
+
+void LruCache::RemoveItem(void* p)
+{
+	LRUITEM* item = (LRUITEM*) p;
+
+	// unlink from the bucket
+	LRUITEM** pItem = (LRUITEM**) &_buckets[item->hash % _numberOfBuckets];
+	while ( *pItem && *pItem!=item )
+		pItem = &(*pItem)->nextInBucket;
+	if ( *pItem )
+		*pItem = item->nextInBucket;
+
+	// unlink from the lru list
+	if ( item->prev )
+		item->prev->next = item->next;
+	else
+		_first = item->next;
+
+	if ( item->next )
+		item->next->prev = item->prev;
+	else
+		_last = item->prev;
+
+	_size -= item->size;
+	_numberOfItems--;
+
+	FreeValue(item->value);
+	delete(item);
+}
+
+void LruCache::MoveToFront(void* p)
+{
+	LRUITEM* item = (LRUITEM*) p;
+	if ( item==_first )
+		return;
+
+	item->prev->next = item->next;
+	if ( item->next )
+		item->next->prev = item->prev;
+	else
+		_last = item->prev;
+
+	item->prev = NULL;
+	item->next = (LRUITEM*) _first;
+	item->next->prev = item;
+	_first = item;
+}
@@ -0,0 +1,85 @@
+/*
+ *  LruCache.h
+ *  Wiki2Touch/wikisrvd
+ *
+ *  Copyright (c) 2008 by Tom Haukap.
+ *
+ *  This file is part of Wiki2Touch.
+ *
+ *  Wiki2Touch is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Wiki2Touch is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Wiki2Touch. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef LRUCACHE_H
+#define LRUCACHE_H
+
+#include <pthread.h>
+#include <string>
+using namespace std;
+
+/*
+ * The part the caches share: the items are found by a key in hash buckets and
+ * kept in a list, most recently used first. The least recently used items are
+ * dropped if the size of all items exceeds the given limit. A derived cache
+ * makes up the keys, holds _mutex while calling the protected methods, frees
+ * its values in FreeValue() and calls Clear() in its destructor.
+ */
+class LruCache
+{
+public:
+	LruCache(size_t maxSize, int numberOfBuckets);
+	virtual ~LruCache();
+
+	size_t MaxSize();
+	size_t Size();
+	unsigned int Hits();
+	unsigned int Misses();
+
+protected:
+	size_t _maxSize;
+	size_t _size;
+	int _numberOfItems;
+	unsigned int _hits;
+	unsigned int _misses;
+
+	pthread_mutex_t _mutex;
+
+	// the value stored with key or NULL, Use() makes it the most recently used one
+	void* Find(const string& key, unsigned int hash);
+	void* Use(const string& key, unsigned int hash);
+
+	// adds a value accounted with size, false if a single item that size would flush
+	// the whole cache (the value isn't taken then)
+	bool Insert(const string& key, unsigned int hash, void* value, size_t size);
+
+	void Remove(const string& key, unsigned int hash);
+	void Clear();
+
+	virtual void FreeValue(void* value) = 0;
+
+	static unsigned int Hash(const string& key);
+
+private:
+	int _numberOfBuckets;
+
+	// most recently used first
+	void* _first;
+	void* _last;
+	void** _buckets;
+
+	void* FindItem(const string& key, unsigned int hash);
+	void RemoveItem(void* item);
+	void MoveToFront(void* item);
+};
+
+#endif
@@ -25,6 +25,7 @@
 #include <sys/types.h>
 #include <dirent.h>
 #include <sys/stat.h>
+#include <unistd.h>
 #include "CPPStringUtils.h"
 
 const char* version = "0.60";
@@ -57,10 +58,20 @@ Settings::Settings()
 	_debug = false;
 	_verbose = false;
 	_expandTemplates = false;
+	_mapDataFiles = true;
+	_cacheArticlesOnDisk = false;
+	_checkLinks = true;
 	
 	_addr = inet_addr("127.0.0.1");
 	_addr = INADDR_ANY;
 	_port = 8082;
+	_workers = 0;
+	_decompressionThreads = 0;
+	_compressionLevel = 1;
+	_blockCacheSize = 4*1024*1024;
+	_suggestionTableSize = 8*1024*1024;
+	_templateCacheSize = 2*1024*1024;
+	_articleCacheSize = 4*1024*1024;
 	_path = "~/Media/Wikipedia";
 	_webContentPath = "";
 	
@@ -69,6 +80,12 @@ Settings::Settings()
 	
 	_languageConfigs = NULL;
 	_titleIndexes = NULL;
+	_imageIndexes = NULL;
+	_blockCache = NULL;
+	_templateCache = NULL;
+	_articleCache = NULL;
+	
+	pthread_mutex_init(&_mutex, NULL);
 }
 
 Settings::~Settings()
@@ -94,6 +111,28 @@ Settings::~Settings()
 		
 		delete(titleIndex);
 	}
+	
+	while ( _imageIndexes )
+	{
+		IMAGEINDEX* imageIndex = (IMAGEINDEX*) _imageIndexes;
+		_imageIndexes = imageIndex->next;
+		
+		if ( imageIndex->imageIndex )
+			delete(imageIndex->imageIndex);
+		
+		delete(imageIndex);
+	}
+	
+	if ( _blockCache )
+		delete(_blockCache);
+	
+	if ( _templateCache )
+		delete(_templateCache);
+	
+	if ( _articleCache )
+		delete(_articleCache);
+	
+	pthread_mutex_destroy(&_mutex);
 }
 
 bool Settings::Init(int argc, char *argv[])
@@ -122,6 +161,107 @@ bool Settings::Init(int argc, char *argv[])
 				}
 			}
 		}
+		else if ( !strcmp(argv[i], "-w") ) 
+		{
+			if ( i<argc-1 )
+			{
+				i++;
+				_workers = atoi(argv[i]);
+				if ( _workers<0 ) 
+				{
+					printf("illegal number of workers: %i\r\n", _workers);
+					return false;
+				}
+			}
+		}
+		else if ( !strcmp(argv[i], "-dt") ) 
+		{
+			if ( i<argc-1 )
+			{
+				// threads decompressing one large article, 1 disables it
+				i++;
+				_decompressionThreads = atoi(argv[i]);
+				if ( _decompressionThreads<0 ) 
+				{
+					printf("illegal number of decompression threads: %i\r\n", _decompressionThreads);
+					return false;
+				}
+			}
+		}
+		else if ( !strcmp(argv[i], "-z") ) 
+		{
+			if ( i<argc-1 )
+			{
+				// gzip level of the article responses, 0 sends them uncompressed
+				i++;
+				_compressionLevel = atoi(argv[i]);
+				if ( _compressionLevel<0 || _compressionLevel>9 ) 
+				{
+					printf("illegal compression level: %i\r\n", _compressionLevel);
+					return false;
+				}
+			}
+		}
+		else if ( !strcmp(argv[i], "-c") ) 
+		{
+			if ( i<argc-1 )
+			{
+				// size of the block cache in kb, 0 disables it
+				i++;
+				int size = atoi(argv[i]);
+				if ( size<0 ) 
+				{
+					printf("illegal cache size: %i\r\n", size);
+					return false;
+				}
+				_blockCacheSize = (size_t) size*1024;
+			}
+		}
+		else if ( !strcmp(argv[i], "-s") ) 
+		{
+			if ( i<argc-1 )
+			{
+				// memory for the suggestion tables in kb, 0 always searches the data files
+				i++;
+				int size = atoi(argv[i]);
+				if ( size<0 ) 
+				{
+					printf("illegal suggestion table size: %i\r\n", size);
+					return false;
+				}
+				_suggestionTableSize = (size_t) size*1024;
+			}
+		}
+		else if ( !strcmp(argv[i], "-tc") ) 
+		{
+			if ( i<argc-1 )
+			{
+				// size of the template cache in kb, 0 disables it
+				i++;
+				int size = atoi(argv[i]);
+				if ( size<0 ) 
+				{
+					printf("illegal template cache size: %i\r\n", size);
+					return false;
+				}
+				_templateCacheSize = (size_t) size*1024;
+			}
+		}
+		else if ( !strcmp(argv[i], "-ac") ) 
+		{
+			if ( i<argc-1 )
+			{
+				// memory for rendered articles in kb, 0 disables it
+				i++;
+				int size = atoi(argv[i]);
+				if ( size<0 ) 
+				{
+					printf("illegal article cache size: %i\r\n", size);
+					return false;
+				}
+				_articleCacheSize = (size_t) size*1024;
+			}
+		}
 		else if ( !strcmp(argv[i], "-a") ) 
 		{
 			if ( i<argc-1 )
@@ -142,6 +282,18 @@ bool Settings::Init(int argc, char *argv[])
 			_expandTemplates = true;
 		else if ( !strcmp(argv[i], "-t-") ) 
 			_expandTemplates = false;
+		else if ( !strcmp(argv[i], "-m") || !strcmp(argv[i], "-m+") ) 
+			_mapDataFiles = true;
+		else if ( !strcmp(argv[i], "-m-") ) 
+			_mapDataFiles = false;
+		else if ( !strcmp(argv[i], "-ad") || !strcmp(argv[i], "-ad+") ) 
+			_cacheArticlesOnDisk = true;
+		else if ( !strcmp(argv[i], "-ad-") ) 
+			_cacheArticlesOnDisk = false;
+		else if ( !strcmp(argv[i], "-lc") || !strcmp(argv[i], "-lc+") ) 
+			_checkLinks = true;
+		else if ( !strcmp(argv[i], "-lc-") ) 
+			_checkLinks = false;
 		else if ( !strcmp(argv[i], "-v") || !strcmp(argv[i], "-v+") ) 
 			_verbose = true;
 		else if ( !strcmp(argv[i], "-v-") )
@@ -270,6 +422,29 @@ bool Settings::ExpandTemplates()
 	return _expandTemplates;
 }
 
+bool Settings::MapDataFiles()
+{
+	return _mapDataFiles;
+}
+
+bool Settings::CacheArticlesOnDisk()
+{
+	return _cacheArticlesOnDisk;
+}
+
+bool Settings::CheckLinks()
+{
+	return _checkLinks;
+}
+
+string Settings::RenderVariant()
+{
+	char variant[8];
+	snprintf(variant, sizeof(variant), "-%d%d", _expandTemplates, _checkLinks);
+	
+	return variant;
+}
+
 in_addr_t Settings::Addr()
 {
 	return _addr;
@@ -280,6 +455,57 @@ int Settings::Port()
 	return _port;
 }
 
+int Settings::Workers()
+{
+	if ( _workers>0 )
+		return _workers;
+	
+	// not set, use one thread more than we have cores (at least two)
+	long cores = sysconf(_SC_NPROCESSORS_ONLN);
+	if ( cores<1 )
+		cores = 1;
+	
+	return cores + 1;
+}
+
+int Settings::DecompressionThreads()
+{
+	if ( _decompressionThreads>0 )
+		return _decompressionThreads;
+	
+	// not set, one per core
+	long cores = sysconf(_SC_NPROCESSORS_ONLN);
+	if ( cores<1 )
+		cores = 1;
+	
+	return cores;
+}
+
+int Settings::CompressionLevel()
+{
+	return _compressionLevel;
+}
+
+size_t Settings::BlockCacheSize()
+{
+	return _blockCacheSize;
+}
+
+size_t Settings::SuggestionTableSize()
+{
+	return _suggestionTableSize;
+}
+
+size_t Settings::TemplateCacheSize()
+{
+	return _templateCacheSize;
+}
+
+size_t Settings::ArticleCacheSize()
+{
+	return _articleCacheSize;
+}
+
 string Settings::Path()
 {
 	return _path;
@@ -327,12 +553,17 @@ ConfigFile* Settings::LanguageConfig(string languageCode)
 {
 	CPPStringUtils::to_lower(languageCode);
 	
+	pthread_mutex_lock(&_mutex);
+	
 	LANGUAGECONFIG* languageConfig = (LANGUAGECONFIG*) _languageConfigs;
 	while ( languageConfig && languageConfig->languageCode!=languageCode)
 		languageConfig = languageConfig->next;
 	
 	if ( languageConfig )
+	{
+		pthread_mutex_unlock(&_mutex);
 		return languageConfig->configFile;
+	}
 	
 	languageConfig = new LANGUAGECONFIG;
 	
@@ -342,6 +573,8 @@ ConfigFile* Settings::LanguageConfig(string languageCode)
 	
 	_languageConfigs = languageConfig;
 	
+	pthread_mutex_unlock(&_mutex);
+	
 	return languageConfig->configFile;
 }
 
@@ -349,12 +582,17 @@ TitleIndex* Settings::GetTitleIndex(string languageCode)
 {
 	CPPStringUtils::to_lower(languageCode);
 	
+	pthread_mutex_lock(&_mutex);
+	
 	TITLEINDEX* titleIndex = (TITLEINDEX*) _titleIndexes;
 	while ( titleIndex && titleIndex->languageCode!=languageCode)
 		titleIndex = titleIndex->next;
 	
 	if ( titleIndex )
+	{
+		pthread_mutex_unlock(&_mutex);
 		return titleIndex->titleIndex;
+	}
 	
 	titleIndex = new TITLEINDEX;
 	
@@ -362,14 +600,16 @@ TitleIndex* Settings::GetTitleIndex(string languageCode)
 	
 	// our "special" database is located here
 	if ( languageCode=="xx" )
-		titleIndex->titleIndex = new TitleIndex(_basePath + languageCode);
+		titleIndex->titleIndex = new TitleIndex(_basePath + languageCode, _mapDataFiles, _suggestionTableSize);
 	else
-		titleIndex->titleIndex = new TitleIndex(Path() + languageCode);
+		titleIndex->titleIndex = new TitleIndex(Path() + languageCode, _mapDataFiles, _suggestionTableSize);
 	
 	titleIndex->next = (TITLEINDEX*) _titleIndexes;
 	
 	_titleIndexes = titleIndex;
 	
+	pthread_mutex_unlock(&_mutex);
+	
 	return titleIndex->titleIndex;
 }
 
@@ -377,12 +617,17 @@ ImageIndex* Settings::GetImageIndex(string languageCode)
 {
 	CPPStringUtils::to_lower(languageCode);
 	
+	pthread_mutex_lock(&_mutex);
+	
 	IMAGEINDEX* imageIndex = (IMAGEINDEX*) _imageIndexes;
 	while ( imageIndex && imageIndex->languageCode!=languageCode)
 		imageIndex = imageIndex->next;
 	
 	if ( imageIndex )
+	{
+		pthread_mutex_unlock(&_mutex);
 		return imageIndex->imageIndex;
+	}
 	
 	imageIndex = new IMAGEINDEX;
 	
@@ -399,7 +644,45 @@ ImageIndex* Settings::GetImageIndex(string languageCode)
 	
 	_imageIndexes = imageIndex;
 	
+	pthread_mutex_unlock(&_mutex);
+	
 	return imageIndex->imageIndex;
 }
 
+BlockCache* Settings::GetBlockCache()
+{
+	pthread_mutex_lock(&_mutex);
+	
+	if ( !_blockCache )
+		_blockCache = new BlockCache(_blockCacheSize);
+	
+	pthread_mutex_unlock(&_mutex);
+	
+	return _blockCache;
+}
+
+TemplateCache* Settings::GetTemplateCache()
+{
+	pthread_mutex_lock(&_mutex);
+	
+	if ( !_templateCache )
+		_templateCache = new TemplateCache(_templateCacheSize);
+	
+	pthread_mutex_unlock(&_mutex);
+	
+	return _templateCache;
+}
+
+ArticleCache* Settings::GetArticleCache()
+{
+	pthread_mutex_lock(&_mutex);
+	
+	if ( !_articleCache )
+		_articleCache = new ArticleCache(_articleCacheSize, _cacheArticlesOnDisk);
+	
+	pthread_mutex_unlock(&_mutex);
+	
+	return _articleCache;
+}
+
 
@@ -25,11 +25,15 @@
 
 #include <sys/types.h>
 #include <arpa/inet.h>
+#include <pthread.h>
 #include <string>
 
 #include "ConfigFile.h"
 #include "TitleIndex.h"
 #include "ImageIndex.h"
+#include "BlockCache.h"
+#include "TemplateCache.h"
+#include "ArticleCache.h"
 
 using namespace std;
 
@@ -44,9 +48,22 @@ public:
 	bool Verbose();
 	bool Debug();
 	bool ExpandTemplates();
+	bool MapDataFiles();
+	bool CacheArticlesOnDisk();
+	bool CheckLinks();
+	
+	// the settings changing the rendered html, a part of the ETag and the article cache key
+	string RenderVariant();
 	
 	in_addr_t Addr();
 	int Port();
+	int Workers();
+	int DecompressionThreads();
+	int CompressionLevel();
+	size_t BlockCacheSize();
+	size_t SuggestionTableSize();
+	size_t TemplateCacheSize();
+	size_t ArticleCacheSize();
 	
 	string Path();
 	string DefaultLanguageCode();
@@ -60,14 +77,27 @@ public:
 	ConfigFile* LanguageConfig(string languageCode);
 	TitleIndex* GetTitleIndex(string languageCode);
 	ImageIndex* GetImageIndex(string languageCode);
+	BlockCache* GetBlockCache();
+	TemplateCache* GetTemplateCache();
+	ArticleCache* GetArticleCache();
 	
 private:
 	bool _verbose;
 	bool _debug;
 	bool _expandTemplates;
+	bool _mapDataFiles;
+	bool _cacheArticlesOnDisk;
+	bool _checkLinks;
 	
 	in_addr_t _addr;
 	int _port;
+	int _workers;
+	int _decompressionThreads;
+	int _compressionLevel;
+	size_t _blockCacheSize;
+	size_t _suggestionTableSize;
+	size_t _templateCacheSize;
+	size_t _articleCacheSize;
 	string _path;
 	string _defaultLanguageCode;
 	string _installedLanguages;
@@ -77,6 +107,12 @@ private:
 	void* _languageConfigs;
 	void* _titleIndexes;
 	void* _imageIndexes;
+	BlockCache* _blockCache;
+	TemplateCache* _templateCache;
+	ArticleCache* _articleCache;
+	
+	/* guards the lists above, they are created lazily by the server threads */
+	pthread_mutex_t _mutex;
 };
 
 extern Settings settings;
@@ -23,8 +23,16 @@
  */
 
 #include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
 #include "StringUtils.h"
 
+// the vector code works on 32 bit chars only
+#if defined(__SSE2__) && WCHAR_MAX>0xffff
+#define SCAN_SSE2
+#include <emmintrin.h>
+#endif
+
 const wchar_t* dayName[] = {L"Sunday", L"Monday", L"Tuesday", L"Wednesday", L"Thursday", L"Friday", L"Saturday", 0x0};
 const wchar_t* monNameAbbr[] = {L"Jan", L"Feb", L"Mar", L"Apr", L"May", L"Jun", L"Jul", L"Aug", L"Sep", L"Oct", L"Nov", L"Dec", 0x0};
 const wchar_t* monName[] = {L"January", L"February", L"March", L"April", L"May", L"June", L"July", L"August", L"September", L"October", L"November", L"December", 0x0};
@@ -338,3 +346,158 @@ void free_split_result(wchar_t** data)
 	free(list);
 }
 
+
+void init_charset(CHARSET* charset, const char* chars)
+{
+	memset(charset, 0, sizeof(CHARSET));
+	
+	// the terminating 0 is always found
+	charset->member[0] = 1;
+	
+	while ( *chars && charset->count<16 )
+	{
+		unsigned char c = (unsigned char) *chars++;
+		if ( c<0x80 )
+		{
+			charset->member[c] = 1;
+			charset->chars[charset->count++] = c;
+		}
+	}
+}
+
+static inline bool in_charset(wchar_t c, const CHARSET* charset)
+{
+	return (unsigned int) c<0x80 && charset->member[c];
+}
+
+const wchar_t* find_first_of(const wchar_t* src, const CHARSET* charset)
+{
+#ifdef SCAN_SSE2
+	// the blocks of 16 chars are aligned to 64 bytes, so reading behind the terminating 0 never leaves its page
+	while ( ((uintptr_t) src) & 63 )
+	{
+		if ( in_charset(*src, charset) )
+			return src;
+		src++;
+	}
+	
+	__m128i zero = _mm_setzero_si128();
+	__m128i chars[16];
+	for (int i=0; i<charset->count; i++)
+		chars[i] = _mm_set1_epi8(charset->chars[i]);
+	
+	while ( true )
+	{
+		// the chars are packed into bytes, everything above 0xff becomes 0xff and is never looked for
+		__m128i low = _mm_packs_epi32(_mm_load_si128((const __m128i*) src), _mm_load_si128((const __m128i*) (src + 4)));
+		__m128i high = _mm_packs_epi32(_mm_load_si128((const __m128i*) (src + 8)), _mm_load_si128((const __m128i*) (src + 12)));
+		__m128i bytes = _mm_packus_epi16(low, high);
+		
+		__m128i found = _mm_cmpeq_epi8(bytes, zero);
+		for (int i=0; i<charset->count; i++)
+			found = _mm_or_si128(found, _mm_cmpeq_epi8(bytes, chars[i]));
+		
+		if ( _mm_movemask_epi8(found) )
+		{
+			// negative chars are packed to 0 too, so check the chars themselves
+			for (int i=0; i<16; i++)
+			{
+				if ( in_charset(src[i], charset) )
+					return src + i;
+			}
+		}
+		
+		src += 16;
+	}
+#else
+	while ( !in_charset(*src, charset) )
+		src++;
+	
+	return src;
+#endif
+}
+
+size_t ascii_length(const wchar_t* src, size_t length)
+{
+	size_t count = 0;
+	
+#ifdef SCAN_SSE2
+	__m128i zero = _mm_setzero_si128();
+	while ( count+4<=length )
+	{
+		__m128i high = _mm_srli_epi32(_mm_loadu_si128((const __m128i*) (src + count)), 7);
+		if ( _mm_movemask_epi8(_mm_cmpeq_epi32(high, zero))!=0xffff )
+			break;
+		
+		count += 4;
+	}
+#endif
+	
+	while ( count<length && (unsigned int) src[count]<0x80 )
+		count++;
+	
+	return count;
+}
+
+size_t copy_ascii(const wchar_t* src, size_t length, char* dest)
+{
+	size_t count = 0;
+	
+#ifdef SCAN_SSE2
+	__m128i zero = _mm_setzero_si128();
+	while ( count+16<=length )
+	{
+		__m128i a = _mm_loadu_si128((const __m128i*) (src + count));
+		__m128i b = _mm_loadu_si128((const __m128i*) (src + count + 4));
+		__m128i c = _mm_loadu_si128((const __m128i*) (src + count + 8));
+		__m128i d = _mm_loadu_si128((const __m128i*) (src + count + 12));
+		
+		__m128i high = _mm_or_si128(_mm_or_si128(a, b), _mm_or_si128(c, d));
+		if ( _mm_movemask_epi8(_mm_cmpeq_epi32(_mm_srli_epi32(high, 7), zero))!=0xffff )
+			break;
+		
+		_mm_storeu_si128((__m128i*) (dest + count), _mm_packus_epi16(_mm_packs_epi32(a, b), _mm_packs_epi32(c, d)));
+		count += 16;
+	}
+#endif
+	
+	while ( count<length && (unsigned int) src[count]<0x80 )
+	{
+		dest[count] = (char) src[count];
+		count++;
+	}
+	
+	return count;
+}
+
+size_t copy_ascii(const char* src, size_t length, wchar_t* dest)
+{
+	size_t count = 0;
+	
+#ifdef SCAN_SSE2
+	__m128i zero = _mm_setzero_si128();
+	while ( count+16<=length )
+	{
+		__m128i bytes = _mm_loadu_si128((const __m128i*) (src + count));
+		if ( _mm_movemask_epi8(bytes) )
+			break;
+		
+		__m128i low = _mm_unpacklo_epi8(bytes, zero);
+		__m128i high = _mm_unpackhi_epi8(bytes, zero);
+		
+		_mm_storeu_si128((__m128i*) (dest + count), _mm_unpacklo_epi16(low, zero));
+		_mm_storeu_si128((__m128i*) (dest + count + 4), _mm_unpackhi_epi16(low, zero));
+		_mm_storeu_si128((__m128i*) (dest + count + 8), _mm_unpacklo_epi16(high, zero));
+		_mm_storeu_si128((__m128i*) (dest + count + 12), _mm_unpackhi_epi16(high, zero));
+		count += 16;
+	}
+#endif
+	
+	while ( count<length && (unsigned char) src[count]<0x80 )
+	{
+		dest[count] = (unsigned char) src[count];
+		count++;
+	}
+	
+	return count;
+}
@@ -53,6 +53,25 @@ char* LoadFile(const char* filename);
 wchar_t** split(const wchar_t* src, wchar_t splitChar);
 void free_split_result(wchar_t** data);
 
+// up to 16 ascii chars to look for with find_first_of()
+typedef struct tagCHARSET
+{
+	unsigned char	member[128];
+	char			chars[16];
+	int				count;
+} CHARSET;
+
+void init_charset(CHARSET* charset, const char* chars);
+
+// the first char of src that is in the charset or the terminating 0; with SSE2 the
+// text in between is checked 16 chars at a time
+const wchar_t* find_first_of(const wchar_t* src, const CHARSET* charset);
+
+// the number of leading chars below 0x80 and copying them to/from bytes, returns the number copied
+size_t ascii_length(const wchar_t* src, size_t length);
+size_t copy_ascii(const wchar_t* src, size_t length, char* dest);
+size_t copy_ascii(const char* src, size_t length, wchar_t* dest);
+
 #endif STRINGUTILS_H
 
 
@@ -0,0 +1,280 @@
+/*
+ *  SuggestionTable.cpp
+ *  Wiki2Touch/wikisrvd
+ *
+ *  Copyright (c) 2008 by Tom Haukap.
+ *
+ *  This file is part of Wiki2Touch.
+ *
+ *  Wiki2Touch is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Wiki2Touch is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Wiki2Touch. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "SuggestionTable.h"
+
+// lengths are stored with 7 bits per byte, the high bit marks a following byte
+static size_t put_length(unsigned char* p, size_t length)
+{
+	size_t n = 0;
+	while ( length>=0x80 )
+	{
+		p[n++] = (unsigned char) (length | 0x80);
+		length >>= 7;
+	}
+	p[n++] = (unsigned char) length;
+
+	return n;
+}
+
+static size_t get_length(const unsigned char* p, size_t* length)
+{
+	size_t n = 0;
+	int shift = 0;
+
+	*length = 0;
+	while ( p[n] & 0x80 )
+	{
+		*length |= (size_t) (p[n++] & 0x7f) << shift;
+		shift += 7;
+	}
+	*length |= (size_t) p[n++] << shift;
+
+	return n;
+}
+
+SuggestionTable::SuggestionTable(size_t maxSize)
+{
+	_maxSize = maxSize;
+
+	_data = NULL;
+	_dataSize = 0;
+	_dataCapacity = 0;
+
+	_buckets = NULL;
+	_bucketsCapacity = 0;
+
+	_numberOfKeys = 0;
+}
+
+SuggestionTable::~SuggestionTable()
+{
+	if ( _data )
+		free(_data);
+
+	if ( _buckets )
+		free(_buckets);
+}
+
+bool SuggestionTable::Add(const string& key)
+{
+	size_t shared = 0;
+	bool first = (_numberOfKeys % SUGGESTIONTABLE_BUCKET_SIZE)==0;
+
+	if ( !first )
+	{
+		size_t length = _lastKey.length();
+		if ( length>key.length() )
+			length = key.length();
+
+		while ( shared<length && _lastKey[shared]==key[shared] )
+			shared++;
+	}
+
+	size_t suffixLength = key.length() - shared;
+
+	// two lengths with up to 5 bytes each
+	if ( !Reserve(_dataSize + suffixLength + 10) )
+		return false;
+
+	if ( first )
+	{
+		if ( _numberOfKeys/SUGGESTIONTABLE_BUCKET_SIZE>=_bucketsCapacity )
+		{
+			int capacity = _bucketsCapacity ? _bucketsCapacity*2 : 1024;
+			if ( _dataCapacity + capacity*sizeof(unsigned int)>_maxSize )
+				return false;
+
+			unsigned int* buckets = (unsigned int*) realloc(_buckets, capacity*sizeof(unsigned int));
+			if ( !buckets )
+				return false;
+
+			_buckets = buckets;
+			_bucketsCapacity = capacity;
+		}
+
+		_buckets[_numberOfKeys/SUGGESTIONTABLE_BUCKET_SIZE] = _dataSize;
+	}
+	else
+		_dataSize += put_length(_data + _dataSize, shared);
+
+	_dataSize += put_length(_data + _dataSize, suffixLength);
+	memcpy(_data + _dataSize, key.data() + shared, suffixLength);
+	_dataSize += suffixLength;
+
+	_lastKey = key;
+	_numberOfKeys++;
+
+	return true;
+}
+
+void SuggestionTable::Compact()
+{
+	_lastKey = string();
+
+	if ( _data && _dataSize<_dataCapacity )
+	{
+		unsigned char* data = (unsigned char*) realloc(_data, _dataSize ? _dataSize : 1);
+		if ( data )
+		{
+			_data = data;
+			_dataCapacity = _dataSize;
+		}
+	}
+
+	int numberOfBuckets = (_numberOfKeys + SUGGESTIONTABLE_BUCKET_SIZE - 1) / SUGGESTIONTABLE_BUCKET_SIZE;
+	if ( _buckets && numberOfBuckets<_bucketsCapacity )
+	{
+		unsigned int* buckets = (unsigned int*) realloc(_buckets, (numberOfBuckets ? numberOfBuckets : 1)*sizeof(unsigned int));
+		if ( buckets )
+		{
+			_buckets = buckets;
+			_bucketsCapacity = numberOfBuckets;
+		}
+	}
+}
+
+int SuggestionTable::NumberOfKeys()
+{
+	return _numberOfKeys;
+}
+
+size_t SuggestionTable::Size()
+{
+	return _dataCapacity + _bucketsCapacity*sizeof(unsigned int);
+}
+
+int SuggestionTable::Find(const string& prefix, int maxKeys, int* first)
+{
+	*first = -1;
+
+	if ( !_numberOfKeys || maxKeys<=0 )
+		return 0;
+
+	// the last bucket starting with a key less than the prefix
+	int numberOfBuckets = (_numberOfKeys + SUGGESTIONTABLE_BUCKET_SIZE - 1) / SUGGESTIONTABLE_BUCKET_SIZE;
+	int lBound = 0;
+	int uBound = numberOfBuckets - 1;
+	int bucket = 0;
+
+	string key;
+	while ( lBound<=uBound )
+	{
+		int index = (lBound + uBound) >> 1;
+
+		Decode(_buckets[index], key, true);
+		if ( key<prefix )
+		{
+			bucket = index;
+			lBound = index + 1;
+		}
+		else
+			uBound = index - 1;
+	}
+
+	// walk to the first key not less than the prefix
+	int index = bucket*SUGGESTIONTABLE_BUCKET_SIZE;
+	size_t offset = _buckets[bucket];
+
+	offset = Decode(offset, key, true);
+	while ( key<prefix )
+	{
+		index++;
+		if ( index>=_numberOfKeys )
+			return 0;
+
+		offset = Decode(offset, key, (index % SUGGESTIONTABLE_BUCKET_SIZE)==0);
+	}
+
+	if ( !StartsWith(key, prefix) )
+		return 0;
+
+	*first = index;
+
+	int found = 1;
+	while ( found<maxKeys )
+	{
+		index++;
+		if ( index>=_numberOfKeys )
+			break;
+
+		offset = Decode(offset, key, (index % SUGGESTIONTABLE_BUCKET_SIZE)==0);
+		if ( !StartsWith(key, prefix) )
+			break;
+
+		found++;
+	}
+
+	return found;
+}
+
+bool SuggestionTable::Reserve(size_t size)
+{
+	if ( size<=_dataCapacity )
+		return true;
+
+	size_t capacity = _dataCapacity ? _dataCapacity : 65536;
+	while ( capacity<size )
+		capacity *= 2;
+
+	size_t bucketsSize = _bucketsCapacity*sizeof(unsigned int);
+	if ( capacity + bucketsSize>_maxSize )
+	{
+		// don't waste the budget on doubling, take what is left
+		if ( size + bucketsSize>_maxSize )
+			return false;
+
+		capacity = _maxSize - bucketsSize;
+	}
+
+	unsigned char* data = (unsigned char*) realloc(_data, capacity);
+	if ( !data )
+		return false;
+
+	_data = data;
+	_dataCapacity = capacity;
+
+	return true;
+}
+
+size_t SuggestionTable::Decode(size_t offset, string& key, bool first)
+{
+	size_t shared = 0;
+	if ( !first )
+		offset += get_length(_data + offset, &shared);
+
+	size_t suffixLength;
+	offset += get_length(_data + offset, &suffixLength);
+
+	key.resize(shared);
+	key.append((const char*) _data + offset, suffixLength);
+
+	return offset + suffixLength;
+}
+
+bool SuggestionTable::StartsWith(const string& key, const string& prefix)
+{
+	return key.length()>=prefix.length() && key.compare(0, prefix.length(), prefix)==0;
+}
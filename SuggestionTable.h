@@ -0,0 +1,76 @@
+/*
+ *  SuggestionTable.h
+ *  Wiki2Touch/wikisrvd
+ *
+ *  Copyright (c) 2008 by Tom Haukap.
+ *
+ *  This file is part of Wiki2Touch.
+ *
+ *  Wiki2Touch is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Wiki2Touch is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Wiki2Touch. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SUGGESTIONTABLE_H
+#define SUGGESTIONTABLE_H
+
+#include <stdio.h>
+#include <string>
+using namespace std;
+
+// number of keys sharing one fully stored key
+#define SUGGESTIONTABLE_BUCKET_SIZE 16
+
+/*
+ * The (already prepared) search keys of all titles in index order, front coded:
+ * the first key of every bucket is stored completely, the others only store the
+ * number of bytes shared with their predecessor and the remaining bytes.
+ */
+class SuggestionTable
+{
+public:
+	SuggestionTable(size_t maxSize);
+	~SuggestionTable();
+
+	// appends the next key, the keys have to be added sorted; returns false if
+	// the table would grow beyond its maximum size
+	bool Add(const string& key);
+
+	// releases the memory reserved for further keys
+	void Compact();
+
+	int NumberOfKeys();
+	size_t Size();
+
+	// returns the number of keys starting with prefix (at most maxKeys), the
+	// index of the first one is stored in first
+	int Find(const string& prefix, int maxKeys, int* first);
+
+private:
+	size_t _maxSize;
+
+	unsigned char* _data;
+	size_t _dataSize;
+	size_t _dataCapacity;
+
+	unsigned int* _buckets;
+	int _bucketsCapacity;
+
+	int _numberOfKeys;
+	string _lastKey;
+
+	bool Reserve(size_t size);
+	size_t Decode(size_t offset, string& key, bool first);
+	static bool StartsWith(const string& key, const string& prefix);
+};
+
+#endif
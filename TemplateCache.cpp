@@ -0,0 +1,185 @@
+/*
+ *  TemplateCache.cpp
+ *  Wiki2Touch/wikisrvd
+ *
+ *  Copyright (c) 2008 by Tom Haukap.
+ *
+ *  This file is part of Wiki2Touch.
+ *
+ *  Wiki2Touch is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Wiki2Touch is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Wiki2Touch. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "TemplateCache.h"
+
+typedef struct tagCACHEDTEMPLATE
+{
+	wstring	text;
+	int*	parameters;
+	int		numberOfParameters;
+} CACHEDTEMPLATE;
+
+TemplateCache::TemplateCache(size_t maxSize) : LruCache(maxSize, TEMPLATECACHE_BUCKETS)
+{
+}
+
+TemplateCache::~TemplateCache()
+{
+	Clear();
+}
+
+bool TemplateCache::Get(const string& languageCode, const string& templateName, wstring& text, int** parameters, int* numberOfParameters)
+{
+	if ( !_maxSize )
+		return false;
+
+	string key = languageCode + ":" + templateName;
+	unsigned int hash = Hash(key);
+
+	pthread_mutex_lock(&_mutex);
+
+	CACHEDTEMPLATE* item = (CACHEDTEMPLATE*) Use(key, hash);
+	if ( !item )
+	{
+		_misses++;
+		pthread_mutex_unlock(&_mutex);
+		return false;
+	}
+
+	_hits++;
+
+	text = item->text;
+
+	if ( parameters )
+	{
+		*parameters = NULL;
+		*numberOfParameters = item->numberOfParameters;
+		if ( item->numberOfParameters )
+		{
+			*parameters = (int*) malloc(2*item->numberOfParameters*sizeof(int));
+			memcpy(*parameters, item->parameters, 2*item->numberOfParameters*sizeof(int));
+		}
+	}
+
+	pthread_mutex_unlock(&_mutex);
+
+	return true;
+}
+
+void TemplateCache::Add(const string& languageCode, const string& templateName, const wstring& text, const int* parameters, int numberOfParameters)
+{
+	string key = languageCode + ":" + templateName;
+	size_t size = sizeof(CACHEDTEMPLATE) + key.length() + text.length()*sizeof(wchar_t) + 2*numberOfParameters*sizeof(int);
+
+	// a single template must not flush the whole cache
+	if ( size>_maxSize/2 )
+		return;
+
+	unsigned int hash = Hash(key);
+
+	CACHEDTEMPLATE* item = new CACHEDTEMPLATE;
+	item->text = text;
+	item->parameters = NULL;
+	item->numberOfParameters = numberOfParameters;
+	if ( numberOfParameters )
+	{
+		item->parameters = (int*) malloc(2*numberOfParameters*sizeof(int));
+		memcpy(item->parameters, parameters, 2*numberOfParameters*sizeof(int));
+	}
+
+	pthread_mutex_lock(&_mutex);
+
+	// another thread may have been faster
+	bool added = !Find(key, hash) && Insert(key, hash, item, size);
+
+	pthread_mutex_unlock(&_mutex);
+
+	if ( !added )
+		FreeValue(item);
+}
+
+int TemplateCache::NumberOfTemplates()
+{
+	return _numberOfItems;
+}
+
+int TemplateCache::FindParameters(const wstring& text, int** parameters)
+{
+	*parameters = NULL;
+
+	int count = 0;
+	int size = 0;
+	int length = text.length();
+
+	size_t start = 0;
+	while ( (start=text.find(L"{{{", start))!=string::npos )
+	{
+		start += 3;
+
+		// "{{{{{1}}}}}" is a parameter in double braces
+		while ( text[start]==L'{' )
+			start++;
+
+		int end = start;
+		int braketCount = 3;
+
+		while ( braketCount && end<length )
+		{
+			wchar_t c = text[end];
+
+			if ( c=='{' )
+				braketCount++;
+			else if ( c=='}' )
+				braketCount--;
+
+			// we're on the way out but we don't see enought brakets
+			if ( (braketCount<3) && c!=L'}' )
+				break;
+
+			end++;
+		}
+
+		if ( braketCount )
+		{
+			// this is an error, skip that section
+			start = end;
+			continue;
+		}
+
+		if ( count==size )
+		{
+			size = size ? 2*size : 8;
+			*parameters = (int*) realloc(*parameters, 2*size*sizeof(int));
+		}
+
+		(*parameters)[2*count] = start - 3;
+		(*parameters)[2*count + 1] = end - start + 3;
+		count++;
+
+		start = end;
+	}
+
+	return count;
+}
+
+void TemplateCache::FreeValue(void* value)
+{
+	CACHEDTEMPLATE* item = (CACHEDTEMPLATE*) value;
+
+	if ( item->parameters )
+		free(item->parameters);
+	delete(item);
+}
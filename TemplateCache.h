@@ -0,0 +1,61 @@
+/*
+ *  TemplateCache.h
+ *  Wiki2Touch/wikisrvd
+ *
+ *  Copyright (c) 2008 by Tom Haukap.
+ *
+ *  This file is part of Wiki2Touch.
+ *
+ *  Wiki2Touch is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Wiki2Touch is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Wiki2Touch. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TEMPLATECACHE_H
+#define TEMPLATECACHE_H
+
+#include "LruCache.h"
+
+#define TEMPLATECACHE_BUCKETS 512
+
+/*
+ * Keeps the prepared text of the templates (noinclude/onlyinclude already
+ * handled, redirects resolved) in memory, so the expansion of a template used
+ * hundreds of times doesn't read and decode it again. The text is kept split
+ * at its parameters, see FindParameters(). Missing templates are cached as
+ * well. The least recently used templates are dropped if the size of all
+ * templates exceeds the given limit.
+ */
+class TemplateCache : public LruCache
+{
+public:
+	TemplateCache(size_t maxSize);
+	~TemplateCache();
+
+	// copies the cached text of the template to text and (if parameters isn't NULL) its
+	// parameters to a (malloc'ed) array, returns false if the template isn't cached
+	bool Get(const string& languageCode, const string& templateName, wstring& text, int** parameters=NULL, int* numberOfParameters=NULL);
+
+	void Add(const string& languageCode, const string& templateName, const wstring& text, const int* parameters, int numberOfParameters);
+
+	// the parameters ("{{{name|default}}}") of a template text, two ints for each one: the
+	// position of the braces and the length up to behind the closing ones; the (malloc'ed)
+	// array is stored in parameters (NULL if there are none) and freed by the caller
+	static int FindParameters(const wstring& text, int** parameters);
+
+	int NumberOfTemplates();
+
+protected:
+	void FreeValue(void* value);
+};
+
+#endif
@@ -0,0 +1,111 @@
+/*
+ *  TitleFilter.cpp
+ *  Wiki2Touch/wikisrvd
+ *
+ *  Copyright (c) 2008 by Tom Haukap.
+ *
+ *  This file is part of Wiki2Touch.
+ *
+ *  Wiki2Touch is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Wiki2Touch is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Wiki2Touch. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "TitleFilter.h"
+
+TitleFilter::TitleFilter(int numberOfKeys)
+{
+	if ( numberOfKeys<1 )
+		numberOfKeys = 1;
+
+	// rounded up to whole bytes
+	_numberOfBits = ((unsigned int) numberOfKeys*TITLEFILTER_BITS_PER_KEY + 7) & ~7;
+
+	_bits = (unsigned char*) malloc(_numberOfBits/8);
+	if ( _bits )
+		memset(_bits, 0, _numberOfBits/8);
+	else
+		_numberOfBits = 0;
+}
+
+TitleFilter::~TitleFilter()
+{
+	if ( _bits )
+		free(_bits);
+}
+
+void TitleFilter::Add(const string& key)
+{
+	if ( !_numberOfBits )
+		return;
+
+	unsigned int h1, h2;
+	Hash(key, &h1, &h2);
+
+	for (int i=0; i<TITLEFILTER_PROBES; i++)
+	{
+		unsigned int bit = (h1 + i*h2) % _numberOfBits;
+		_bits[bit>>3] |= 1 << (bit & 7);
+	}
+}
+
+bool TitleFilter::MayContain(const string& key)
+{
+	// without memory nothing can be rejected
+	if ( !_numberOfBits )
+		return true;
+
+	unsigned int h1, h2;
+	Hash(key, &h1, &h2);
+
+	for (int i=0; i<TITLEFILTER_PROBES; i++)
+	{
+		unsigned int bit = (h1 + i*h2) % _numberOfBits;
+		if ( !(_bits[bit>>3] & (1 << (bit & 7))) )
+			return false;
+	}
+
+	return true;
+}
+
+size_t TitleFilter::Size()
+{
+	return _numberOfBits/8;
+}
+
+void TitleFilter::Hash(const string& key, unsigned int* h1, unsigned int* h2)
+{
+	// fnv-1a, the second hash is derived by mixing the first one
+	unsigned int hash = 2166136261u;
+
+	const char* p = key.data();
+	const char* end = p + key.length();
+	while ( p<end )
+	{
+		hash ^= (unsigned char) *p++;
+		hash *= 16777619u;
+	}
+
+	*h1 = hash;
+
+	hash ^= hash >> 16;
+	hash *= 0x85ebca6bu;
+	hash ^= hash >> 13;
+	hash *= 0xc2b2ae35u;
+	hash ^= hash >> 16;
+
+	// odd, so the probes don't repeat early
+	*h2 = hash | 1;
+}
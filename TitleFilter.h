@@ -0,0 +1,57 @@
+/*
+ *  TitleFilter.h
+ *  Wiki2Touch/wikisrvd
+ *
+ *  Copyright (c) 2008 by Tom Haukap.
+ *
+ *  This file is part of Wiki2Touch.
+ *
+ *  Wiki2Touch is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Wiki2Touch is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Wiki2Touch. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TITLEFILTER_H
+#define TITLEFILTER_H
+
+#include <stdio.h>
+#include <string>
+using namespace std;
+
+// 10 bits and 7 probes per key give about 1% false positives
+#define TITLEFILTER_BITS_PER_KEY	10
+#define TITLEFILTER_PROBES			7
+
+/*
+ * A bloom filter over the (lowercase) title keys: a key which was never added
+ * is rejected without touching the titles, a key that passes may still be
+ * missing and has to be looked up.
+ */
+class TitleFilter
+{
+public:
+	TitleFilter(int numberOfKeys);
+	~TitleFilter();
+
+	void Add(const string& key);
+	bool MayContain(const string& key);
+
+	size_t Size();
+
+private:
+	unsigned char* _bits;
+	unsigned int _numberOfBits;
+
+	static void Hash(const string& key, unsigned int* h1, unsigned int* h2);
+};
+
+#endif
@@ -20,6 +20,13 @@
  *  along with Wiki2Touch. If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
+
 #include "TitleIndex.h"
 #include "CPPStringUtils.h"
 
@@ -27,28 +34,35 @@ const char* ARTICLES_DATA_NAME = "articles";
 const char* ARTICLES_DATA_EXTENSION = ".bin";
 
 #define SIZEOF_POSITION_INFORMATION 16
+#define TITLERECORD_READ_SIZE 512
 
-#pragma pack(1)
-typedef struct 
-{
-	char languageCode[2];				// 2 bytes
-	unsigned int numberOfArticles;		// 4 bytes
-	fpos_t	titlesPos;					// 8 bytes
-	fpos_t	indexPos_0;					// 8 bytes
-	fpos_t	indexPos_1;					// 8 bytes; the second one has discritcs removed or traditional chineses chars are converted to simpified chineses chars
-	unsigned char version;				// 1 byte
-	char reserved1[1];					// 1 byte
-	char imageNamespace[32];			// namespace prefix for images   (without the colon)
-	char templateNamespace[32];			// namespace prefix for template (without the colon)
-	char reserved2[160];				// for future use
-} FILEHEADER;
-#pragma pack(pop)
 
-TitleIndex::TitleIndex(string pathToDataFile)
+TitleIndex::TitleIndex(string pathToDataFile, bool mapDataFile, size_t suggestionTableSize)
 {
 	_imageNamespace = "";
 	_templateNamespace = "";
 	isChinese = false;
+	_titleKeys = 0;
+	_version = 0;
+	
+	_framesPos = 0;
+	_frameSize = 0;
+	_numberOfFrames = 0;
+	
+	_mappedData = NULL;
+	_mappedSize = 0;
+	_mappedPos = 0;
+	_mapping = NULL;
+	_mappingSize = 0;
+	
+	_suggestionTable = NULL;
+	_suggestionTableSize = suggestionTableSize;
+	_suggestionTableLoaded = false;
+	pthread_mutex_init(&_suggestionTableMutex, NULL);
+	
+	_titleFilter = NULL;
+	_titleFilterLoaded = false;
+	pthread_mutex_init(&_titleFilterMutex, NULL);
 
 	_dataFileName = pathToDataFile;
 	if ( _dataFileName.length()>0 && _dataFileName[_dataFileName.length()-1]!='/' )
@@ -57,6 +71,7 @@ TitleIndex::TitleIndex(string pathToDataFile)
 	_dataFileName += ARTICLES_DATA_EXTENSION;
 	
 	_numberOfArticles = -1;
+	_dataFile = -1;
 	
 	_indexPos_0 = 0;
 	_indexPos_1 = 0;
@@ -64,9 +79,10 @@ TitleIndex::TitleIndex(string pathToDataFile)
 	_imageNamespace = "";
 	_templateNamespace = "";
 		
-	// get the number of articles; this also checks if the files exists
-	FILE* f = fopen(_dataFileName.c_str(), "rb");
-	if ( !f )
+	// get the number of articles; this also checks if the files exists. The file stays open
+	// until the index is deleted, all threads read it with pread()
+	_dataFile = open(_dataFileName.c_str(), O_RDONLY);
+	if ( _dataFile<0 )
 	{
 		// second try
 		_dataFileName = "";
@@ -84,10 +100,10 @@ TitleIndex::TitleIndex(string pathToDataFile)
 		}
 		
 		if ( _dataFileName!="" )
-			f = fopen(_dataFileName.c_str(), "rb");
+			_dataFile = open(_dataFileName.c_str(), O_RDONLY);
 	}
 	
-	if ( f )
+	if ( _dataFile>=0 )
 	{
 		int error = 0;
 
@@ -95,7 +111,7 @@ TitleIndex::TitleIndex(string pathToDataFile)
 		
 		// if the old, short fileheader is used this will read over the end of the header
 		// no problem, if the file is less than 256 it's unuseable anyway
-		if ( fread(&fileheader, sizeof(FILEHEADER), 1, f)!=1 )
+		if ( !ReadData(0, &fileheader, sizeof(FILEHEADER)) )
 			error = 1;
 		
 		if ( !error ) 
@@ -106,20 +122,52 @@ TitleIndex::TitleIndex(string pathToDataFile)
 			
 			isChinese = (tolower(fileheader.languageCode[0])=='z') && (tolower(fileheader.languageCode[1])=='h'); 
 			
-			if ( fileheader.version==1 )
+			if ( fileheader.version>=1 && fileheader.version<=ARTICLES_FRAMED_VERSION )
 			{
 				_indexPos_1 = fileheader.indexPos_1;
 				_imageNamespace = string(fileheader.imageNamespace);
 				_templateNamespace = string(fileheader.templateNamespace);
 			}
+			
+			if ( fileheader.version==2 || fileheader.version==ARTICLES_FRAMED_VERSION )
+			{
+				_titleKeys = fileheader.titleKeys & (TITLEKEY_LOWERCASE | TITLEKEY_SEARCH);
+				if ( !_indexPos_1 )
+					_titleKeys &= ~TITLEKEY_SEARCH;
+			}
+			
+			if ( fileheader.version==ARTICLES_FRAMED_VERSION )
+			{
+				_framesPos = fileheader.framesPos;
+				_frameSize = fileheader.frameSize;
+				_numberOfFrames = fileheader.numberOfFrames;
+			}
+			
+			_version = fileheader.version;
+			
+			// try to serve all lookups from memory, if this fails the file is read on every request
+			if ( mapDataFile && _numberOfArticles>0 )
+				MapDataFile();
 		}
-		
-		fclose(f);
 	}
 }
 
 TitleIndex::~TitleIndex()
 {
+	if ( _suggestionTable )
+		delete(_suggestionTable);
+	
+	pthread_mutex_destroy(&_suggestionTableMutex);
+	
+	if ( _titleFilter )
+		delete(_titleFilter);
+	
+	pthread_mutex_destroy(&_titleFilterMutex);
+	
+	UnmapDataFile();
+	
+	if ( _dataFile>=0 )
+		close(_dataFile);
 }
 
 ArticleSearchResult* TitleIndex::FindArticle(string title, bool multiple)
@@ -127,13 +175,9 @@ ArticleSearchResult* TitleIndex::FindArticle(string title, bool multiple)
 	if ( _numberOfArticles<=0  )
 		return NULL;
 
-	FILE* f = fopen(_dataFileName.c_str(), "rb");
-	if ( !f )
-		return NULL;
-
 	int indexNo = 0;
 	
-	string lowercaseTitle = CPPStringUtils::to_lower_utf8(title);
+	string lowercaseTitle = LowercaseKey(title);
 	int foundAt = -1;
 	int lBound = 0;
 	int uBound = _numberOfArticles - 1;
@@ -143,15 +187,12 @@ ArticleSearchResult* TitleIndex::FindArticle(string title, bool multiple)
 	{	
 		index = (lBound + uBound) >> 1;
 		
-		// get the title at the specific index
-		string titleAtIndex = GetTitle(f, index, indexNo);
-		
-		// make it lowercase and skip the prefix
-		titleAtIndex = CPPStringUtils::to_lower_utf8(titleAtIndex);
+		// compare with the (lowercase) title at the specific index
+		int comparison = CompareTitleKey(index, indexNo, lowercaseTitle);
 		
-		if ( lowercaseTitle<titleAtIndex )
+		if ( comparison<0 )
 			uBound = index - 1;
-		else if ( lowercaseTitle>titleAtIndex )
+		else if ( comparison>0 )
 			lBound = ++index;
 		else
 		{
@@ -162,8 +203,6 @@ ArticleSearchResult* TitleIndex::FindArticle(string title, bool multiple)
 	
 	if ( foundAt<0 )
 	{
-		fclose(f);
-		
 		return NULL;
 	}
 	
@@ -171,10 +210,7 @@ ArticleSearchResult* TitleIndex::FindArticle(string title, bool multiple)
 	int startIndex = foundAt;
 	while ( startIndex>0 )
 	{
-		string titleAtIndex = GetTitle(f, startIndex-1, indexNo);
-		titleAtIndex = CPPStringUtils::to_lower_utf8(titleAtIndex);
-	
-		if ( lowercaseTitle!=titleAtIndex )
+		if ( CompareTitleKey(startIndex-1, indexNo, lowercaseTitle)!=0 )
 			break;
 			
 		startIndex--;
@@ -183,15 +219,14 @@ ArticleSearchResult* TitleIndex::FindArticle(string title, bool multiple)
 	int endIndex = foundAt;
 	while ( endIndex<(_numberOfArticles-1) )
 	{
-		string titleAtIndex = GetTitle(f, endIndex+1, indexNo);
-		titleAtIndex = CPPStringUtils::to_lower_utf8(titleAtIndex);
-		
-		if ( lowercaseTitle!=titleAtIndex )
+		if ( CompareTitleKey(endIndex+1, indexNo, lowercaseTitle)!=0 )
 			break;
 		
 		endIndex++;
 	}
 	
+	ARTICLEPOSITION position;
+	
 	if ( !multiple )
 	{
 		// return a result only if we have a direct hit (case is taken into account)
@@ -201,27 +236,21 @@ ArticleSearchResult* TitleIndex::FindArticle(string title, bool multiple)
 			// check if one matches 100%
 			for(int i=startIndex; i<=endIndex; i++)
 			{		
-				string titleInArchive = GetTitle(f, i, indexNo);
+				string titleInArchive = GetTitle(i, indexNo, &position);
 				if ( title==titleInArchive )
 				{					
-					fclose(f);
-					
-					return new ArticleSearchResult(title, titleInArchive, _lastBlockPos, _lastArticlePos, _lastArticleLength);
+					return new ArticleSearchResult(title, titleInArchive, &position);
 				}
 			}
 		
 			// nope, multiple matches
-			fclose(f);
-
 			return NULL;
 		}
 		else
 		{
 			// return the one and only result
-			string titleInArchive = GetTitle(f, foundAt, indexNo);		
-			fclose(f);
-
-			return new ArticleSearchResult(title, titleInArchive, _lastBlockPos, _lastArticlePos, _lastArticleLength);
+			string titleInArchive = GetTitle(foundAt, indexNo, &position);		
+			return new ArticleSearchResult(title, titleInArchive, &position);
 		}
 	}
 	else
@@ -229,31 +258,99 @@ ArticleSearchResult* TitleIndex::FindArticle(string title, bool multiple)
 		ArticleSearchResult* result = NULL;
 		for(int i=startIndex; i<=endIndex; i++)
 		{
-			string titleInArchive = GetTitle(f, i, indexNo);
+			string titleInArchive = GetTitle(i, indexNo, &position);
 			
 			if ( title==titleInArchive )
 			{
 				// 100% match
 				DeleteSearchResult(result);
-				
-				fclose(f);
 
-				return new ArticleSearchResult(title, titleInArchive, _lastBlockPos, _lastArticlePos, _lastArticleLength);
+				return new ArticleSearchResult(title, titleInArchive, &position);
 			}
 
 			// collect the results
 			if ( !result )
-				result = new ArticleSearchResult(title, titleInArchive, _lastBlockPos, _lastArticlePos, _lastArticleLength);
+				result = new ArticleSearchResult(title, titleInArchive, &position);
 			else
-				result->Next = new ArticleSearchResult(title, titleInArchive, _lastBlockPos, _lastArticlePos, _lastArticleLength);
+				result->Next = new ArticleSearchResult(title, titleInArchive, &position);
 		}
-		
-		fclose(f);
-		
+
 		return result;
 	}
 }
 
+// orders the positions of the keys to check
+struct KeyOrder
+{
+	const string* keys;
+	
+	KeyOrder(const string* keys) : keys(keys) {}
+	bool operator()(int a, int b) const { return keys[a]<keys[b]; }
+};
+
+int TitleIndex::ArticlesExist(const string* titles, int count, bool* exists)
+{
+	for (int i=0; i<count; i++)
+		exists[i] = false;
+	
+	if ( _numberOfArticles<=0 || count<=0 )
+		return 0;
+
+	TitleFilter* titleFilter = GetTitleFilter();
+	
+	// most missing titles are rejected by the filter, the others are looked up
+	string* keys = new string[count];
+	int* order = new int[count];
+	int numberOfCandidates = 0;
+	
+	for (int i=0; i<count; i++)
+	{
+		keys[i] = LowercaseKey(titles[i]);
+		if ( !titleFilter || titleFilter->MayContain(keys[i]) )
+			order[numberOfCandidates++] = i;
+	}
+	
+	int found = 0;
+	
+	if ( numberOfCandidates )
+	{
+		// sorted, so every lookup starts where the one before ended
+		sort(order, order + numberOfCandidates, KeyOrder(keys));
+		
+		int lBound = 0;
+		for (int i=0; i<numberOfCandidates; i++)
+		{
+			const string& key = keys[order[i]];
+			
+			int uBound = _numberOfArticles - 1;
+			int index = lBound;
+			while ( lBound<=uBound )
+			{
+				index = (lBound + uBound) >> 1;
+				
+				int comparison = CompareTitleKey(index, 0, key);
+				if ( comparison<0 )
+					uBound = index - 1;
+				else if ( comparison>0 )
+					lBound = index + 1;
+				else
+				{
+					exists[order[i]] = true;
+					found++;
+					
+					lBound = index;
+					break;
+				}
+			}
+		}
+	}
+	
+	delete[] keys;
+	delete[] order;
+	
+	return found;
+}
+
 void TitleIndex::DeleteSearchResult(ArticleSearchResult* articleSearchResult)
 {
 	while ( articleSearchResult )
@@ -270,6 +367,43 @@ string TitleIndex::DataFileName()
 	return _dataFileName;
 }
 
+int TitleIndex::DataFile()
+{
+	return _dataFile;
+}
+
+int TitleIndex::Version()
+{
+	return _version;
+}
+
+unsigned int TitleIndex::FrameSize()
+{
+	return _frameSize;
+}
+
+bool TitleIndex::GetFrame(int frameNumber, fpos_t* framePos, unsigned int* compressedSize)
+{
+	*framePos = 0;
+	*compressedSize = 0;
+	
+	if ( _dataFile<0 || !_frameSize || frameNumber<0 || (unsigned int) frameNumber>=_numberOfFrames )
+		return false;
+	
+	// the frame starts where the one before ended
+	fpos_t positions[2];
+	if ( !ReadData(_framesPos + (fpos_t) frameNumber*sizeof(fpos_t), positions, sizeof(positions)) )
+		return false;
+	
+	if ( positions[1]<=positions[0] )
+		return false;
+	
+	*framePos = positions[0];
+	*compressedSize = (unsigned int) (positions[1] - positions[0]);
+	
+	return true;
+}
+
 int TitleIndex::NumberOfArticles()
 {
 	return _numberOfArticles;
@@ -293,28 +427,44 @@ string TitleIndex::GetSuggestions(string phrase, int maxSuggestions)
 	if ( phraseLength==0 )
 		return suggestions;
 	
-	FILE* f = fopen(_dataFileName.c_str(), "rb");
-	if ( !f )
-		return suggestions;
+	SuggestionTable* suggestionTable = GetSuggestionTable();
+	if ( suggestionTable )
+	{
+		// one more to find out if the list is complete
+		int first;
+		int found = suggestionTable->Find(lowercasePhrase, maxSuggestions+1, &first);
+		if ( !found )
+			return suggestions;
+
+		for (int i=0; i<found && i<maxSuggestions; i++)
+		{
+			if ( !suggestions.empty() )
+				suggestions += "\n";
+			suggestions += GetTitle(first+i, indexNo);
+		}
 		
+		// more to come, add an empty line at the end of the list
+		if ( found>maxSuggestions )
+			suggestions += "\n";
+
+		return suggestions;
+	}
+
 	int foundAt = -1;
 	int lBound = 0;
 	int uBound = _numberOfArticles - 1;
 	int index = 0;	
-	string titleAtIndex;
 	
 	while ( lBound<=uBound )
 	{	
 		index = (lBound + uBound) >> 1;
 		
-		// get the title at the specific index
-		titleAtIndex = GetTitle(f, index, indexNo);
-		
-		titleAtIndex = PrepareSearchPhrase(titleAtIndex);
+		// compare with the prepared title at the specific index
+		int comparison = CompareTitleKey(index, indexNo, lowercasePhrase);
 		
-		if ( lowercasePhrase<titleAtIndex )
+		if ( comparison<0 )
 			uBound = index - 1;
-		else if ( lowercasePhrase>titleAtIndex )
+		else if ( comparison>0 )
 			lBound = index + 1;
 		else
 		{
@@ -325,55 +475,40 @@ string TitleIndex::GetSuggestions(string phrase, int maxSuggestions)
 	
 	if ( foundAt<0 )
 	{
-		if ( titleAtIndex.length()>phraseLength )
-			titleAtIndex = titleAtIndex.substr(0, phraseLength);
+		// compare only the first characters of the title
+		int comparison = CompareTitleKey(index, indexNo, lowercasePhrase, true);
 		
-		if ( lowercasePhrase>titleAtIndex )
+		if ( comparison>0 )
 		{
 			// last one?
 			if ( index==_numberOfArticles-1) 
 			{
-				fclose(f);
 				return suggestions;
 			}
 			
 			// no
 			index++;
-			titleAtIndex = GetTitle(f, index, indexNo);
 			
-			titleAtIndex = PrepareSearchPhrase(titleAtIndex);
-						
-			if ( titleAtIndex.length()>phraseLength )
-				titleAtIndex = titleAtIndex.substr(0, phraseLength);
-			
-			if ( lowercasePhrase!=titleAtIndex )
+			if ( CompareTitleKey(index, indexNo, lowercasePhrase, true)!=0 )
 			{
 				// still not starting with the phrase?
-				fclose(f);
 				return suggestions;
 			}
 		}
-		else if ( lowercasePhrase<titleAtIndex )
+		else if ( comparison<0 )
 		{
 			// first one?
 			if ( index==0 ) 
 			{
-				fclose(f);
 				return suggestions;
 			}
 			
 			// no
 			index--;
-			titleAtIndex = GetTitle(f, index, indexNo);
-			titleAtIndex = PrepareSearchPhrase(titleAtIndex);
-			
-			if ( titleAtIndex.length()>phraseLength )
-				titleAtIndex = titleAtIndex.substr(0, phraseLength);
 			
-			if ( lowercasePhrase!=titleAtIndex )
+			if ( CompareTitleKey(index, indexNo, lowercasePhrase, true)!=0 )
 			{
 				// still not starting with the phrase?
-				fclose(f);
 				return suggestions;
 			}
 		}
@@ -385,13 +520,7 @@ string TitleIndex::GetSuggestions(string phrase, int maxSuggestions)
 	int startIndex = foundAt;
 	while ( startIndex>0 )
 	{
-		string titleAtIndex = GetTitle(f, startIndex-1, indexNo);
-		titleAtIndex = PrepareSearchPhrase(titleAtIndex);
-		
-		if ( titleAtIndex.length()>phraseLength )
-			titleAtIndex = titleAtIndex.substr(0, phraseLength);
-		
-		if ( lowercasePhrase!=titleAtIndex )
+		if ( CompareTitleKey(startIndex-1, indexNo, lowercasePhrase, true)!=0 )
 			break;
 		
 		startIndex--;
@@ -400,18 +529,12 @@ string TitleIndex::GetSuggestions(string phrase, int maxSuggestions)
 	int results = 0;
 	while ( startIndex<(_numberOfArticles-1) && results<maxSuggestions )
 	{
-		string suggestion = GetTitle(f, startIndex, indexNo);
-		titleAtIndex = PrepareSearchPhrase(suggestion);
-		
-		if ( titleAtIndex.length()>phraseLength )
-			titleAtIndex = titleAtIndex.substr(0, phraseLength);
-			
-		if ( lowercasePhrase!=titleAtIndex )
+		if ( CompareTitleKey(startIndex, indexNo, lowercasePhrase, true)!=0 )
 			break;
 
 		if ( !suggestions.empty() )
 			suggestions += "\n";
-		suggestions += suggestion;
+		suggestions += GetTitle(startIndex, indexNo);
 		
 		startIndex++;
 		results++;
@@ -422,19 +545,11 @@ string TitleIndex::GetSuggestions(string phrase, int maxSuggestions)
 		// check if the next would also meet
 		startIndex++;
 		
-		string suggestion = GetTitle(f, startIndex, indexNo);
-		titleAtIndex = PrepareSearchPhrase(suggestion);
-		
-		if ( titleAtIndex.length()>phraseLength )
-			titleAtIndex = titleAtIndex.substr(0, phraseLength);
-
 		// yes, add an empty line at the end of the list
-		if ( lowercasePhrase==titleAtIndex )
+		if ( CompareTitleKey(startIndex, indexNo, lowercasePhrase, true)==0 )
 			suggestions += "\n";
 	}
 
-	fclose(f);
-
 	return suggestions;
 }
 
@@ -442,25 +557,19 @@ string TitleIndex::GetRandomArticleTitle()
 {
 	if ( _numberOfArticles<=0 )
 		return string();
-	
-	FILE* f = fopen(_dataFileName.c_str(), "rb");
-	if ( !f )
-		return string();
-	
+
 	int j = 20;
 	while ( j-- )
 	{
 		int i = (int) ((double) random() / RAND_MAX * _numberOfArticles);
-		string result = GetTitle(f, i, 0);
+		string result = GetTitle(i, 0);
 		
 		if ( result.find(":")==string::npos )
 		{
-			fclose(f);
 			return result;
 		}
 	}
 	
-	fclose(f);
 	return string();
 }
 
@@ -474,61 +583,454 @@ string TitleIndex::TemplateNamespace()
 	return _templateNamespace;
 }
 
-string TitleIndex::GetTitle(FILE* f, int articleNumber, int indexNo)
+string TitleIndex::GetTitle(int articleNumber, int indexNo, ARTICLEPOSITION* position)
+{
+	if ( _mappedData )
+	{
+		int length;
+		const char* title = GetTitleView(articleNumber, indexNo, &length, position);
+		if ( !title )
+			return string();
+		
+		return string(title, length);
+	}
+	
+	return ReadTitleRecord(articleNumber, indexNo, 1, position);
+}
+
+/*
+ Reads the record of a title from the data file: the position of the article followed by
+ numberOfStrings zero terminated strings (the title and the keys behind it). Returns the 
+ last of these strings.
+ */
+string TitleIndex::ReadTitleRecord(int articleNumber, int indexNo, int numberOfStrings, ARTICLEPOSITION* position)
 {
-	_lastBlockPos = 0;
-	_lastArticlePos = 0;
-	_lastArticleLength = 0;					  
+	ARTICLEPOSITION help;
+	if ( !position )
+		position = &help;
+	
+	position->blockPos = 0;
+	position->articlePos = 0;
+	position->articleLength = 0;
 						  
-	if ( !f || articleNumber<0 || articleNumber>=_numberOfArticles  )
+	if ( _dataFile<0 || articleNumber<0 || articleNumber>=_numberOfArticles  )
 		return string();
 	
-	int indexPos = _indexPos_0;
+	fpos_t indexPos = _indexPos_0;
 	if ( indexNo==1 && _indexPos_1 )
 		indexPos = _indexPos_1;
 	
-	int error = fseeko(f, indexPos + articleNumber*sizeof(int), SEEK_SET);
-	if ( error )
-		return string();
-
 	int titlePos;
-	size_t read = fread(&titlePos, sizeof(int), 1, f);
-
-	if ( !read )
+	if ( !ReadData(indexPos + (fpos_t) articleNumber*sizeof(int), &titlePos, sizeof(int)) )
 		return string();
-
-	error = fseeko(f, _titlesPos + titlePos, SEEK_SET);
-	if ( error )
+	
+	// one read usually covers the whole record
+	char buffer[TITLERECORD_READ_SIZE];
+	fpos_t pos = _titlesPos + titlePos;
+	
+	ssize_t read = pread(_dataFile, buffer, sizeof(buffer), pos);
+	if ( read<SIZEOF_POSITION_INFORMATION )
 		return string();
 	
 	// store the article location and size for use in the future
-	fread(&_lastBlockPos, sizeof(_lastBlockPos), 1, f);
-	fread(&_lastArticlePos, sizeof(_lastArticlePos), 1, f);
-	fread(&_lastArticleLength, sizeof(_lastArticleLength), 1, f);
+	memcpy(&position->blockPos, buffer, sizeof(position->blockPos));
+	memcpy(&position->articlePos, buffer + sizeof(position->blockPos), sizeof(position->articlePos));
+	memcpy(&position->articleLength, buffer + sizeof(position->blockPos) + sizeof(position->articlePos), sizeof(position->articleLength));
 	
 	string result;
-	unsigned char c = 0;
-	while ( !feof(f) && (c=fgetc(f)) )
-		result += c;
+	ssize_t offset = SIZEOF_POSITION_INFORMATION;
+	while ( numberOfStrings>0 )
+	{
+		if ( offset>=read )
+		{
+			// the record continues behind the buffer
+			pos += read;
+			read = pread(_dataFile, buffer, sizeof(buffer), pos);
+			if ( read<=0 )
+				break;
+			
+			offset = 0;
+		}
+		
+		const char* start = buffer + offset;
+		const char* end = (const char*) memchr(start, 0, read - offset);
+		if ( !end )
+		{
+			result.append(start, read - offset);
+			offset = read;
+			continue;
+		}
+		
+		result.append(start, end - start);
+		offset = end - buffer + 1;
+		
+		if ( --numberOfStrings>0 )
+			result = string();
+	}
 	
 	return result;
 }
 
-string TitleIndex::PrepareSearchPhrase(string phrase)
+/*
+ Reads size bytes at the given position, the file offset is not used so this may be called
+ by several threads at the same time.
+ */
+bool TitleIndex::ReadData(fpos_t pos, void* data, size_t size)
+{
+	char* p = (char*) data;
+	while ( size>0 )
+	{
+		ssize_t read = pread(_dataFile, p, size, pos);
+		if ( read<=0 )
+			return false;
+		
+		p += read;
+		pos += read;
+		size -= read;
+	}
+	
+	return true;
+}
+
+/*
+ Returns a pointer to the title inside the mapped data file, the title is not copied. The
+ position information of the article is stored the same way GetTitle() does.
+ */
+const char* TitleIndex::GetTitleView(int articleNumber, int indexNo, int* length, ARTICLEPOSITION* position)
 {
-	string lowercasePhrase = CPPStringUtils::to_lower_utf8(phrase);
+	ARTICLEPOSITION help;
+	if ( !position )
+		position = &help;
+	
+	position->blockPos = 0;
+	position->articlePos = 0;
+	position->articleLength = 0;
+	*length = 0;
+	
+	if ( !_mappedData || articleNumber<0 || articleNumber>=_numberOfArticles  )
+		return NULL;
+	
+	fpos_t indexPos = _indexPos_0;
+	if ( indexNo==1 && _indexPos_1 )
+		indexPos = _indexPos_1;
+	
+	int titlePos;
+	memcpy(&titlePos, _mappedData + (indexPos - _mappedPos) + articleNumber*sizeof(int), sizeof(int));
 	
+	fpos_t recordPos = _titlesPos + titlePos - _mappedPos;
+	if ( titlePos<0 || recordPos+SIZEOF_POSITION_INFORMATION>=(fpos_t) _mappedSize )
+		return NULL;
+	
+	// the article location and size for use in the future
+	const char* record = _mappedData + recordPos;
+	memcpy(&position->blockPos, record, sizeof(position->blockPos));
+	memcpy(&position->articlePos, record + sizeof(position->blockPos), sizeof(position->articlePos));
+	memcpy(&position->articleLength, record + sizeof(position->blockPos) + sizeof(position->articlePos), sizeof(position->articleLength));
+	
+	const char* title = record + SIZEOF_POSITION_INFORMATION;
+	const char* end = (const char*) memchr(title, 0, (_mappedData + _mappedSize) - title);
+	if ( !end )
+		end = _mappedData + _mappedSize;
+	
+	*length = end - title;
+	return title;
+}
+
+/*
+ Returns a pointer to the stored key of a title inside the mapped data file (version 2 and 3 only).
+ */
+const char* TitleIndex::GetTitleKeyView(int articleNumber, int indexNo, int* length)
+{
+	bool searchKey = indexNo==1 && _indexPos_1;
+	
+	const char* key = GetTitleView(articleNumber, indexNo, length);
+	if ( !key )
+		return NULL;
+	
+	const char* end = _mappedData + _mappedSize;
+	
+	int skip = (searchKey && (_titleKeys & TITLEKEY_LOWERCASE)) ? 2 : 1;
+	while ( skip-- )
+	{
+		key += *length + 1;
+		if ( key>=end )
+		{
+			*length = 0;
+			return NULL;
+		}
+		
+		const char* keyEnd = (const char*) memchr(key, 0, end - key);
+		if ( !keyEnd )
+			keyEnd = end;
+		
+		*length = keyEnd - key;
+	}
+	
+	return key;
+}
+
+/*
+ Maps the titles and the index arrays into memory. The compressed articles are not mapped,
+ usually they are located between the header and the titles. On failure the index falls 
+ back to reading the file for every lookup.
+ */
+bool TitleIndex::MapDataFile()
+{
+	struct stat statbuf;
+	if ( fstat(_dataFile, &statbuf)<0 )
+		return false;
+	
+	fpos_t fileSize = statbuf.st_size;
+	fpos_t indexSize = (fpos_t) _numberOfArticles * sizeof(int);
+	
+	fpos_t startPos = _titlesPos;
+	fpos_t endPos = _indexPos_0 + indexSize;
+	if ( _indexPos_0<startPos )
+		startPos = _indexPos_0;
+	
+	if ( _indexPos_1 )
+	{
+		if ( _indexPos_1<startPos )
+			startPos = _indexPos_1;
+		if ( _indexPos_1+indexSize>endPos )
+			endPos = _indexPos_1 + indexSize;
+	}
+	
+	if ( endPos>fileSize )
+		return false;
+	
+	// the titles are stored behind the index arrays, so map up to the end of the file
+	if ( _titlesPos>=endPos )
+		endPos = fileSize;
+	
+	if ( startPos<0 || endPos>fileSize || startPos>=endPos )
+		return false;
+	
+	// the offset of a mapping must be page aligned
+	fpos_t pageSize = sysconf(_SC_PAGESIZE);
+	fpos_t mappingPos = startPos - (startPos % pageSize);
+	fpos_t mappingSize = endPos - mappingPos;
+	
+	// does not fit into the address space
+	if ( (fpos_t) (size_t) mappingSize!=mappingSize )
+		return false;
+	
+	void* mapping = mmap(NULL, (size_t) mappingSize, PROT_READ, MAP_SHARED, _dataFile, mappingPos);
+	if ( mapping==MAP_FAILED )
+		return false;
+	
+	// the binary search jumps around, read ahead is useless
+	madvise(mapping, (size_t) mappingSize, MADV_RANDOM);
+	
+	_mapping = mapping;
+	_mappingSize = (size_t) mappingSize;
+	
+	_mappedPos = startPos;
+	_mappedData = (const char*) mapping + (startPos - mappingPos);
+	_mappedSize = (size_t) (endPos - startPos);
+	
+	return true;
+}
+
+void TitleIndex::UnmapDataFile()
+{
+	if ( _mapping )
+		munmap(_mapping, _mappingSize);
+	
+	_mapping = NULL;
+	_mappingSize = 0;
+	
+	_mappedData = NULL;
+	_mappedSize = 0;
+	_mappedPos = 0;
+}
+
+SuggestionTable* TitleIndex::GetSuggestionTable()
+{
+	if ( !_suggestionTableSize )
+		return NULL;
+	
+	// the table doesn't change once it is loaded, so it is used without locking
+	if ( _suggestionTableLoaded )
+	{
+		__sync_synchronize();
+		return _suggestionTable;
+	}
+	
+	// while another thread is loading the table the data file is used
+	if ( pthread_mutex_trylock(&_suggestionTableMutex)!=0 )
+		return NULL;
+	
+	if ( !_suggestionTableLoaded )
+	{
+		LoadSuggestionTable();
+		
+		// the table is complete before the flag is seen by the other threads
+		__sync_synchronize();
+		_suggestionTableLoaded = true;
+	}
+	
+	pthread_mutex_unlock(&_suggestionTableMutex);
+	
+	return _suggestionTable;
+}
+
+void TitleIndex::LoadSuggestionTable()
+{
+	if ( _numberOfArticles<=0 )
+		return;
+	
+	int indexNo = 1;
+	if ( !_indexPos_1 )
+		indexNo = 0;
+
+	SuggestionTable* suggestionTable = new SuggestionTable(_suggestionTableSize);
+	
+	for (int i=0; i<_numberOfArticles; i++)
+	{
+		if ( !suggestionTable->Add(GetTitleKey(i, indexNo)) )
+		{
+			// too large, stay with the data file
+			printf("suggestion table for %s exceeds %lu bytes\r\n", _dataFileName.c_str(), (unsigned long) _suggestionTableSize);
+			
+			delete(suggestionTable);
+			suggestionTable = NULL;
+			break;
+		}
+	}
+
+	if ( suggestionTable )
+		suggestionTable->Compact();
+	
+	_suggestionTable = suggestionTable;
+}
+
+TitleFilter* TitleIndex::GetTitleFilter()
+{
+	// the filter doesn't change once it is built, so it is used without locking
+	if ( _titleFilterLoaded )
+	{
+		__sync_synchronize();
+		return _titleFilter;
+	}
+	
+	// while another thread is building the filter all titles are looked up
+	if ( pthread_mutex_trylock(&_titleFilterMutex)!=0 )
+		return NULL;
+	
+	if ( !_titleFilterLoaded )
+	{
+		LoadTitleFilter();
+		
+		// the filter is complete before the flag is seen by the other threads
+		__sync_synchronize();
+		_titleFilterLoaded = true;
+	}
+	
+	pthread_mutex_unlock(&_titleFilterMutex);
+	
+	return _titleFilter;
+}
+
+void TitleIndex::LoadTitleFilter()
+{
+	if ( _numberOfArticles<=0 )
+		return;
+
+	TitleFilter* titleFilter = new TitleFilter(_numberOfArticles);
+	
+	for (int i=0; i<_numberOfArticles; i++)
+		titleFilter->Add(GetTitleKey(i, 0));
+
+	_titleFilter = titleFilter;
+}
+
+string TitleIndex::PrepareSearchPhrase(string phrase)
+{
 	// do we have a different index sorting ?
 	if ( _indexPos_1==0 )
-		return lowercasePhrase;
+		return LowercaseKey(phrase);
 
 	// yes
-	if ( isChinese )
-		lowercasePhrase = CPPStringUtils::tc2sc_utf8(lowercasePhrase);
+	return SearchKey(phrase, isChinese); 
+}
+
+string TitleIndex::LowercaseKey(string title)
+{
+	return CPPStringUtils::to_lower_utf8(title);
+}
+
+string TitleIndex::SearchKey(string title, bool chinese)
+{
+	string lowercaseTitle = CPPStringUtils::to_lower_utf8(title);
+	
+	if ( chinese )
+		return CPPStringUtils::tc2sc_utf8(lowercaseTitle);
 	else
-		lowercasePhrase = CPPStringUtils::exchange_diacritic_chars_utf8(lowercasePhrase);
+		return CPPStringUtils::exchange_diacritic_chars_utf8(lowercaseTitle);
+}
+
+/*
+ Returns the key of a title as used by the sorting of the given index, version 2 files
+ contain them, otherwise they are created from the title.
+ */
+string TitleIndex::GetTitleKey(int articleNumber, int indexNo)
+{
+	bool searchKey = indexNo==1 && _indexPos_1;
+	unsigned char titleKey = searchKey ? TITLEKEY_SEARCH : TITLEKEY_LOWERCASE;
 	
-	return lowercasePhrase; 
+	if ( !(_titleKeys & titleKey) )
+	{
+		string title = GetTitle(articleNumber, indexNo);
+		return searchKey ? SearchKey(title, isChinese) : LowercaseKey(title);
+	}
+	
+	if ( _mappedData )
+	{
+		int length;
+		const char* key = GetTitleKeyView(articleNumber, indexNo, &length);
+		if ( !key )
+			return string();
+		
+		return string(key, length);
+	}
+	
+	// the keys follow the title
+	int skip = (searchKey && (_titleKeys & TITLEKEY_LOWERCASE)) ? 1 : 0;
+	return ReadTitleRecord(articleNumber, indexNo, skip + 2);
+}
+
+/*
+ Compares the key with the key of the title at the given index, returns a value less than,
+ equal to or greater than zero like memcmp() does. If prefixOnly is set only the first 
+ characters of the title (as many as the key has) are used.
+ */
+int TitleIndex::CompareTitleKey(int articleNumber, int indexNo, const string& key, bool prefixOnly)
+{
+	string help;
+	const char* titleKey = NULL;
+	int length = 0;
+	
+	unsigned char storedKey = (indexNo==1 && _indexPos_1) ? TITLEKEY_SEARCH : TITLEKEY_LOWERCASE;
+	if ( _mappedData && (_titleKeys & storedKey) )
+		titleKey = GetTitleKeyView(articleNumber, indexNo, &length);
+	
+	if ( !titleKey )
+	{
+		help = GetTitleKey(articleNumber, indexNo);
+		titleKey = help.data();
+		length = help.length();
+	}
+	
+	int keyLength = key.length();
+	if ( prefixOnly && length>keyLength )
+		length = keyLength;
+	
+	int result = memcmp(key.data(), titleKey, keyLength<length ? keyLength : length);
+	if ( result )
+		return result;
+	
+	return keyLength - length;
 }
 
 /* search result class */
@@ -545,6 +1047,18 @@ ArticleSearchResult::ArticleSearchResult(string title, string titleInArchive, fp
 	_articleLength = articleLength;
 }
 
+ArticleSearchResult::ArticleSearchResult(string title, string titleInArchive, ARTICLEPOSITION* position)
+{
+	Next = NULL;
+	
+	_title = title;
+	_titleInArchive = titleInArchive;
+	
+	_blockPos = position->blockPos;
+	_articlePos = position->articlePos;
+	_articleLength = position->articleLength;
+}
+
 string ArticleSearchResult::Title()
 {
 	return _title;
@@ -554,7 +1068,6 @@ string ArticleSearchResult::TitleInArchive()
 {
 	return _titleInArchive;
 }
-									
 
 fpos_t ArticleSearchResult::BlockPos()
 {
@@ -571,7 +1084,3 @@ int ArticleSearchResult::ArticleLength()
 	return _articleLength;
 }
 
-
-
-
-
@@ -23,13 +23,62 @@
 #ifndef TITLEINDEX_H
 #define TITLEINDEX_H
 
+#include <pthread.h>
 #include <string>
 using namespace std;
 
+#include "SuggestionTable.h"
+#include "TitleFilter.h"
+
+#pragma pack(push, 1)
+typedef struct 
+{
+	char languageCode[2];				// 2 bytes
+	unsigned int numberOfArticles;		// 4 bytes
+	fpos_t	titlesPos;					// 8 bytes
+	fpos_t	indexPos_0;					// 8 bytes
+	fpos_t	indexPos_1;					// 8 bytes; the second one has discritcs removed or traditional chineses chars are converted to simpified chineses chars
+	unsigned char version;				// 1 byte
+	char reserved1[1];					// 1 byte
+	char imageNamespace[32];			// namespace prefix for images   (without the colon)
+	char templateNamespace[32];			// namespace prefix for template (without the colon)
+	unsigned char titleKeys;			// 1 byte; version 2: the keys stored behind each title (TITLEKEY_xxx)
+	fpos_t	framesPos;					// 8 bytes; version 3: the frame table
+	unsigned int frameSize;				// 4 bytes; version 3: uncompressed size of every frame (but the last)
+	unsigned int numberOfFrames;		// 4 bytes; version 3
+	char reserved2[143];				// for future use
+} FILEHEADER;
+#pragma pack(pop)
+
+/* 
+ version 2 files store the sort keys of both indexes behind each title, so lookups 
+ don't have to convert the titles: position, title\0, lowercase title\0, search key\0
+ */
+#define TITLEKEY_LOWERCASE	0x01	// CPPStringUtils::to_lower_utf8(title), the sorting of index 0
+#define TITLEKEY_SEARCH		0x02	// lowercase title without diacritics (or simplified chinese), the sorting of index 1
+
+/*
+ version 3 files are laid out like version 2 files, but the articles are not stored in bzip2 
+ blocks. All articles form one stream which is cut into frames of frameSize bytes, each one 
+ deflated (zlib) on its own. The frame table holds numberOfFrames+1 file positions, frame i 
+ is stored between entry i and i+1. The blockPos of a title is the position of the article 
+ inside the uncompressed stream, articlePos is always 0.
+ */
+#define ARTICLES_FRAMED_VERSION	3
+
+/* location of an article inside the data file, filled by every title lookup */
+typedef struct tagARTICLEPOSITION
+{
+	fpos_t	blockPos;
+	int		articlePos;
+	int		articleLength;
+} ARTICLEPOSITION;
+
 class ArticleSearchResult
 {
 public:
 	ArticleSearchResult(string title, string titleInArchive, fpos_t blockPos, int articlePos, int articleLength);
+	ArticleSearchResult(string title, string titleInArchive, ARTICLEPOSITION* position);
 	
 	string Title();
 	string TitleInArchive();
@@ -51,12 +100,25 @@ private:
 class TitleIndex
 {
 public:
-	TitleIndex(string pathToDataFile);
+	TitleIndex(string pathToDataFile, bool mapDataFile=true, size_t suggestionTableSize=0);
 	~TitleIndex();
 	
 	ArticleSearchResult* FindArticle(string title, bool multiple=false);
+	
+	// checks a batch of titles at once, exists[i] is set if FindArticle(titles[i], true) 
+	// would find an article; returns the number of existing titles
+	int ArticlesExist(const string* titles, int count, bool* exists);
 	void DeleteSearchResult(ArticleSearchResult* articleSearchResult);
 	string DataFileName();
+	int Version();
+	
+	// the data file, kept open while the index exists; read it with pread() only, the
+	// descriptor is shared by all threads
+	int DataFile();
+	
+	// version 3 only: the uncompressed size of the frames and the location of one frame
+	unsigned int FrameSize();
+	bool GetFrame(int frameNumber, fpos_t* framePos, unsigned int* compressedSize);
 	int NumberOfArticles();
 	
 	string GetSuggestions(string phrase, int maxSuggestions);
@@ -64,22 +126,66 @@ public:
 	
 	string ImageNamespace();
 	string TemplateNamespace();	
+	
+	// the keys the indexes are sorted by, also used to create version 2 files
+	static string LowercaseKey(string title);
+	static string SearchKey(string title, bool chinese);
 
 private:
 	string  _dataFileName;
+	int		_dataFile;
 	int		_numberOfArticles;
 	bool	isChinese;
+	unsigned char _titleKeys;
+	unsigned char _version;
+	
+	fpos_t	_framesPos;
+	unsigned int _frameSize;
+	unsigned int _numberOfFrames;
 	
 	fpos_t	_titlesPos;
 	fpos_t	_indexPos_0;
 	fpos_t	_indexPos_1;
 		
-	string GetTitle(FILE* f, int articleNumber, int indexNo);
+	string GetTitle(int articleNumber, int indexNo, ARTICLEPOSITION* position=NULL);
+	string ReadTitleRecord(int articleNumber, int indexNo, int numberOfStrings, ARTICLEPOSITION* position=NULL);
+	const char* GetTitleView(int articleNumber, int indexNo, int* length, ARTICLEPOSITION* position=NULL);
+	const char* GetTitleKeyView(int articleNumber, int indexNo, int* length);
 	string PrepareSearchPhrase(string phrase);
 	
-	fpos_t	_lastBlockPos;
-	int	_lastArticlePos;
-	int _lastArticleLength;
+	string GetTitleKey(int articleNumber, int indexNo);
+	int CompareTitleKey(int articleNumber, int indexNo, const string& key, bool prefixOnly=false);
+	
+	bool ReadData(fpos_t pos, void* data, size_t size);
+	
+	bool MapDataFile();
+	void UnmapDataFile();
+	
+	SuggestionTable* GetSuggestionTable();
+	void LoadSuggestionTable();
+	
+	TitleFilter* GetTitleFilter();
+	void LoadTitleFilter();
+	
+	/* the titles and index arrays mapped into memory, NULL if the file could not be mapped */
+	const char*	_mappedData;
+	size_t		_mappedSize;
+	fpos_t		_mappedPos;
+	
+	/* the page aligned mapping itself, used to unmap it */
+	void*		_mapping;
+	size_t		_mappingSize;
+	
+	/* the prepared search keys of index 1 (or 0) kept in memory, loaded with the first search */
+	SuggestionTable* _suggestionTable;
+	size_t		_suggestionTableSize;
+	volatile bool _suggestionTableLoaded;
+	pthread_mutex_t _suggestionTableMutex;
+	
+	/* filter over the keys of index 0, created with the first existence check */
+	TitleFilter* _titleFilter;
+	volatile bool _titleFilterLoaded;
+	pthread_mutex_t _titleFilterMutex;
 	
 	string _imageNamespace;
 	string _templateNamespace;
@@ -20,6 +20,9 @@
  *  along with Wiki2Touch. If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <stdlib.h>
+#include <string.h>
+
 #include "WikiArticle.h"
 #include "WikiMarkupGetter.h"
 #include "WikiMarkupParser.h"
@@ -31,10 +34,18 @@ WikiArticle::WikiArticle(string languageCode)
 {
 	_languageCode = string(languageCode);
 	_articleName = string();
+	_parser = NULL;
+	_text = NULL;
+	_textLength = 0;
 }
 
 WikiArticle::~WikiArticle()
 {
+	if ( _parser )
+		delete((WikiMarkupParser*) _parser);
+	
+	if ( _text )
+		free(_text);
 }
 
 string WikiArticle::GetArticleName()
@@ -44,69 +55,233 @@ string WikiArticle::GetArticleName()
 
 wstring WikiArticle::GetArticle(ArticleSearchResult* articleSearchResult)
 {
-	WikiMarkupGetter wikiMarkupGetter(_languageCode);
-	wstring article = wikiMarkupGetter.GetMarkupForArticle(articleSearchResult);
+	if ( !PrepareArticle(articleSearchResult) )
+		return wstring();
 	
-	return ProcessArticle(article, wikiMarkupGetter.GetLastArticleTitle());
+	return PreparedArticle();
 }
 
 wstring WikiArticle::GetArticle(string utf8articleName)
 {
-	WikiMarkupGetter wikiMarkupGetter(_languageCode);
-	wstring article = wikiMarkupGetter.GetMarkupForArticle(utf8articleName);
+	if ( !PrepareArticle(utf8articleName) )
+		return wstring();
 	
-	return ProcessArticle(article, wikiMarkupGetter.GetLastArticleTitle());
+	return PreparedArticle();
 }	
 
 wstring WikiArticle::ProcessArticle(wstring article, string articleTitle)
 {
 	if ( article.empty() )
 		return article;
+	
+	string data = CPPStringUtils::to_utf8(article);
+	
+	char* text = (char*) malloc(data.length()+1);
+	memcpy(text, data.c_str(), data.length()+1);
+	
+	if ( !ProcessArticle(text, data.length(), articleTitle) )
+		return wstring();
+	
+	return PreparedArticle();
+}
+
+bool WikiArticle::PrepareArticle(ArticleSearchResult* articleSearchResult)
+{
+	return LoadArticle(articleSearchResult) && ParseArticle();
+}
+
+bool WikiArticle::LoadArticle(ArticleSearchResult* articleSearchResult)
+{
+	WikiMarkupGetter wikiMarkupGetter(_languageCode);
+	
+	int length;
+	char* text = wikiMarkupGetter.GetUtf8MarkupForArticle(articleSearchResult, &length);
+	
+	return LoadArticle(text, length, wikiMarkupGetter.GetLastArticleTitle());
+}
+
+bool WikiArticle::ParseArticle(FILE* stream)
+{
+	if ( !_text )
+		return false;
+	
+	wstring pageName = CPPStringUtils::to_wstring(_articleName);
+	WikiMarkupParser* wikiMarkupParser = new WikiMarkupParser(CPPStringUtils::to_wstring(_languageCode).c_str(), pageName.c_str());
+	wikiMarkupParser->SetInput(_text, _textLength);
+	
+	free(_text);
+	_text = NULL;
+	_textLength = 0;
+	
+	if ( stream )
+		wikiMarkupParser->SetOutputStream(stream);
+	
+	wikiMarkupParser->Parse();
+	_parser = wikiMarkupParser;
+	
+	return true;
+}
+
+bool WikiArticle::PrepareArticle(string utf8articleName)
+{
+	WikiMarkupGetter wikiMarkupGetter(_languageCode);
+	
+	int length;
+	char* text = wikiMarkupGetter.GetUtf8MarkupForArticle(utf8articleName, &length);
+	
+	return ProcessArticle(text, length, wikiMarkupGetter.GetLastArticleTitle());
+}
+
+size_t WikiArticle::ArticleLength(bool withPreArticle)
+{
+	if ( !_parser )
+		return 0;
+	
+	return (withPreArticle ? PreArticleLength() : 0) + 
+		((WikiMarkupParser*) _parser)->GetOutputUtf8Length() + 
+		CPPStringUtils::utf8_length(_postArticleHtml.c_str());
+}
+
+bool WikiArticle::WriteArticle(FILE* f, bool withPreArticle)
+{
+	if ( !_parser )
+		return false;
+	
+	return (!withPreArticle || WritePreArticle(f)) && 
+		((WikiMarkupParser*) _parser)->WriteOutput(f) && 
+		CPPStringUtils::write_utf8(f, _postArticleHtml.c_str());
+}
+
+size_t WikiArticle::PreArticleLength()
+{
+	return CPPStringUtils::utf8_length(_preArticleHtml.c_str());
+}
+
+bool WikiArticle::WritePreArticle(FILE* f)
+{
+	return CPPStringUtils::write_utf8(f, _preArticleHtml.c_str());
+}
+
+bool WikiArticle::WritePostArticle(FILE* f)
+{
+	return CPPStringUtils::write_utf8(f, _postArticleHtml.c_str());
+}
+
+char* WikiArticle::GetUtf8Article(size_t* length)
+{
+	*length = 0;
+	
+	if ( !_parser )
+		return NULL;
+	
+	const wchar_t* output = ((WikiMarkupParser*) _parser)->GetOutput();
+	
+	char* html = (char*) malloc(ArticleLength() + 1);
+	char* dest = html;
+	
+	dest += CPPStringUtils::encode_utf8(_preArticleHtml.c_str(), _preArticleHtml.length(), dest);
+	dest += CPPStringUtils::encode_utf8(output, wcslen(output), dest);
+	dest += CPPStringUtils::encode_utf8(_postArticleHtml.c_str(), _postArticleHtml.length(), dest);
+	*dest = 0x0;
+	
+	*length = dest - html;
+	
+	return html;
+}
+
+wstring WikiArticle::PreparedArticle()
+{
+	wstring article = _preArticleHtml;
+	article.append(((WikiMarkupParser*) _parser)->GetOutput());
+	article.append(_postArticleHtml);
+	
+	return article;
+}
+
+// takes the ownership of the (malloc'ed) text
+bool WikiArticle::ProcessArticle(char* text, int length, string articleTitle)
+{
+	return LoadArticle(text, length, articleTitle) && ParseArticle();
+}
+
+// takes the ownership of the (malloc'ed) text, it is kept until ParseArticle() is called
+bool WikiArticle::LoadArticle(char* text, int length, string articleTitle)
+{
+	if ( _parser )
+	{
+		delete((WikiMarkupParser*) _parser);
+		_parser = NULL;
+	}
+	
+	if ( _text )
+	{
+		free(_text);
+		_text = NULL;
+		_textLength = 0;
+	}
+	
+	if ( !text )
+		return false;
+	
+	if ( !length )
+	{
+		free(text);
+		return false;
+	}
 	_articleName = articleTitle;
 	
 	wstring redirected = wstring();
-	// check if we're redirected
-	if ( article.length()<200 )
+	// check if we're redirected, a redirect has less than 200 characters which are 800 bytes at most
+	if ( length<800 )
 	{
-		// for speed reason, make no sense to scan a 1 MB articles
-		wstring lowercaseArticle = CPPStringUtils::to_lower(article);
+		wstring article = CPPStringUtils::from_utf8w(text, length);
 		
-		size_t pos;
-		if ( (pos=lowercaseArticle.find(L"#redirect"))!=string::npos )
+		// for speed reason, make no sense to scan a 1 MB articles
+		if ( article.length()<200 )
 		{
-			string newUtf8ArticleName = CPPStringUtils::to_utf8(article.substr(pos + 9)); 
-			while ( newUtf8ArticleName.length()>0 && newUtf8ArticleName[0]!='[' )
-				newUtf8ArticleName = newUtf8ArticleName.substr(1);
-
-			while ( newUtf8ArticleName.length()>0 && newUtf8ArticleName[0]=='[' )
-				newUtf8ArticleName = newUtf8ArticleName.substr(1);
+			wstring lowercaseArticle = CPPStringUtils::to_lower(article);
 			
-			pos = newUtf8ArticleName.find("]]");
-			if ( pos!=string::npos )
+			size_t pos;
+			if ( (pos=lowercaseArticle.find(L"#redirect"))!=string::npos )
 			{
-				newUtf8ArticleName = newUtf8ArticleName.substr(0, pos);
+				string newUtf8ArticleName = CPPStringUtils::to_utf8(article.substr(pos + 9)); 
+				while ( newUtf8ArticleName.length()>0 && newUtf8ArticleName[0]!='[' )
+					newUtf8ArticleName = newUtf8ArticleName.substr(1);
+
+				while ( newUtf8ArticleName.length()>0 && newUtf8ArticleName[0]=='[' )
+					newUtf8ArticleName = newUtf8ArticleName.substr(1);
 				
-				while ( (pos=newUtf8ArticleName.find("_"))!=string::npos )
-					   newUtf8ArticleName.replace(pos, 1, " ", 1);
-						
-				WikiMarkupGetter wikiMarkupGetter(_languageCode);
-				article =  wikiMarkupGetter.GetMarkupForArticle(newUtf8ArticleName);
-			
-				redirected = L"<span class=\"wkRedirected\">(Redirected from " + CPPStringUtils::from_utf8w(_articleName) + L")</span>\r\n";
-				_articleName = wikiMarkupGetter.GetLastArticleTitle();
+				pos = newUtf8ArticleName.find("]]");
+				if ( pos!=string::npos )
+				{
+					newUtf8ArticleName = newUtf8ArticleName.substr(0, pos);
+					
+					while ( (pos=newUtf8ArticleName.find("_"))!=string::npos )
+						   newUtf8ArticleName.replace(pos, 1, " ", 1);
+							
+					free(text);
+					
+					WikiMarkupGetter wikiMarkupGetter(_languageCode);
+					text = wikiMarkupGetter.GetUtf8MarkupForArticle(newUtf8ArticleName, &length);
+					if ( !text )
+					{
+						// the target is missing, show an empty page like before
+						text = (char*) malloc(1);
+						*text = 0x0;
+						length = 0;
+					}
+				
+					redirected = L"<span class=\"wkRedirected\">(Redirected from " + CPPStringUtils::from_utf8w(_articleName) + L")</span>\r\n";
+					_articleName = wikiMarkupGetter.GetLastArticleTitle();
+				}
 			}
 		}
 	}
 		
-	wstring pageName = CPPStringUtils::to_wstring(_articleName);
-	WikiMarkupParser wikiMarkupParser(CPPStringUtils::to_wstring(_languageCode).c_str(), pageName.c_str());
-	wikiMarkupParser.SetInput(article.c_str());
-	wikiMarkupParser.Parse();
-
-	article = wstring(wikiMarkupParser.GetOutput()); 
+	_text = text;
+	_textLength = length;
 	
 	// Prepare everything what should go before the article body itself
-	wstring preArticleHtml;
 	wstring articleTitleW = CPPStringUtils::from_utf8w(_articleName);
 	
 	//string filename = settings.WebContentPath() + "PreArticle.html";
@@ -114,64 +289,58 @@ wstring WikiArticle::ProcessArticle(wstring article, string articleTitle)
 	void* contents = LoadFile(filename.c_str());
 	if ( contents )
 	{
-		preArticleHtml = CPPStringUtils::from_utf8w(string((char*) contents));
+		_preArticleHtml = CPPStringUtils::from_utf8w(string((char*) contents));
 		
 		// replace some params
 		size_t pos;
 		
 		wstring placeholder = L"%ArticleTitle%";
-		while ( (pos=preArticleHtml.find(placeholder))!=string::npos )
-			preArticleHtml.replace(pos, placeholder.length(), articleTitleW);
+		while ( (pos=_preArticleHtml.find(placeholder))!=string::npos )
+			_preArticleHtml.replace(pos, placeholder.length(), articleTitleW);
 			   
 		placeholder = L"%RedirectedFrom%";
-		while ( (pos=preArticleHtml.find(placeholder))!=string::npos )
-			preArticleHtml.replace(pos, placeholder.length(), redirected);
+		while ( (pos=_preArticleHtml.find(placeholder))!=string::npos )
+			_preArticleHtml.replace(pos, placeholder.length(), redirected);
 		
 		free(contents);
 	}
 	else
 	{
-		preArticleHtml = L"<html><head>\r\n";
-
-		preArticleHtml.append(L"<meta id=\"viewport\" name=\"viewport\" content=\"width=320; initial-scale=0.6667; maximum-scale=1.0; minimum-scale=0.6667 \"/>\r\n");
-
-		preArticleHtml.append(L"<LINK href=\"/stylesheets/shared.css\" type=\"text/css\" rel=\"stylesheet\">\r\n");
-		preArticleHtml.append(L"<LINK href=\"/stylesheets/main.css\" type=\"text/css\" rel=\"stylesheet\">\r\n");
-		preArticleHtml.append(L"<LINK href=\"/stylesheets/mediawiki_common.css\" type=\"text/css\" rel=\"stylesheet\">\r\n");
-		preArticleHtml.append(L"<LINK href=\"/stylesheets/mediawiki_monobook.css\" type=\"text/css\" rel=\"stylesheet\">\r\n");
-		preArticleHtml.append(L"<LINK href=\"/stylesheets/wikisrv.css\" type=\"text/css\" rel=\"stylesheet\">\r\n");
-		preArticleHtml.append(L"<title>");
-		preArticleHtml.append(articleTitleW);
-		preArticleHtml.append(L"</title>\r\n");
-	
-		preArticleHtml.append(L"</head>\r\n<body class=\"wkBody\">\r\n");
-		preArticleHtml.append(L"<div class=\"wkTitle\">");
-		preArticleHtml.append(L"<a href=\"/\" class=\"wkTitleLink\"><img src=\"/icon_search.gif\"/>&nbsp;");
-		preArticleHtml.append(articleTitleW);
-		preArticleHtml.append(L"</a></div>\r\n");
+		_preArticleHtml = L"<html><head>\r\n";
+
+		_preArticleHtml.append(L"<meta id=\"viewport\" name=\"viewport\" content=\"width=320; initial-scale=0.6667; maximum-scale=1.0; minimum-scale=0.6667 \"/>\r\n");
+
+		_preArticleHtml.append(L"<LINK href=\"/stylesheets/shared.css\" type=\"text/css\" rel=\"stylesheet\">\r\n");
+		_preArticleHtml.append(L"<LINK href=\"/stylesheets/main.css\" type=\"text/css\" rel=\"stylesheet\">\r\n");
+		_preArticleHtml.append(L"<LINK href=\"/stylesheets/mediawiki_common.css\" type=\"text/css\" rel=\"stylesheet\">\r\n");
+		_preArticleHtml.append(L"<LINK href=\"/stylesheets/mediawiki_monobook.css\" type=\"text/css\" rel=\"stylesheet\">\r\n");
+		_preArticleHtml.append(L"<LINK href=\"/stylesheets/wikisrv.css\" type=\"text/css\" rel=\"stylesheet\">\r\n");
+		_preArticleHtml.append(L"<title>");
+		_preArticleHtml.append(articleTitleW);
+		_preArticleHtml.append(L"</title>\r\n");
+	
+		_preArticleHtml.append(L"</head>\r\n<body class=\"wkBody\">\r\n");
+		_preArticleHtml.append(L"<div class=\"wkTitle\">");
+		_preArticleHtml.append(L"<a href=\"/\" class=\"wkTitleLink\"><img src=\"/icon_search.gif\"/>&nbsp;");
+		_preArticleHtml.append(articleTitleW);
+		_preArticleHtml.append(L"</a></div>\r\n");
 		if ( !redirected.empty() )
-			preArticleHtml.append(redirected);
-		preArticleHtml.append(L"<p />\r\n");
+			_preArticleHtml.append(redirected);
+		_preArticleHtml.append(L"<p />\r\n");
 	}
 
 	// prepare everything what should go after the article html
-	wstring postArticleHtml;
-	
 	filename = __settings->WebContentPath() + "PostArticle.html";
 	contents = LoadFile(filename.c_str());
 	if ( contents )
 	{
-		postArticleHtml = CPPStringUtils::from_utf8w(string((char*) contents));
+		_postArticleHtml = CPPStringUtils::from_utf8w(string((char*) contents));
 		free(contents);
 	}
 	else	
-		postArticleHtml = L"\r\n</body></html>";
+		_postArticleHtml = L"\r\n</body></html>";
 	
-	// Insert it to the start of the article
-	article.insert(0, preArticleHtml.c_str());
-	article.append(postArticleHtml);
-
-	return article;
+	return true;
 }
 
 wstring WikiArticle::FormatSearchResults(ArticleSearchResult* articleSearchResult)
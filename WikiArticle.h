@@ -23,6 +23,7 @@
 #ifndef WIKIARTICLE_H
 #define WIKIARTICLE_H
 
+#include <stdio.h>
 #include <string>
 #include "TitleIndex.h"
 
@@ -40,10 +41,39 @@ public:
 	
 	wstring FormatSearchResults(ArticleSearchResult* articleSearchResult);
 	wstring ProcessArticle(wstring article, string articleTitle);
+	
+	// parses the article but keeps the html in the parser, ArticleLength() and
+	// WriteArticle() then stream it utf-8 encoded without building a copy
+	bool PrepareArticle(string utf8ArticleName);
+	bool PrepareArticle(ArticleSearchResult* articleSearchResult);
+	size_t ArticleLength(bool withPreArticle=true);
+	bool WriteArticle(FILE* f, bool withPreArticle=true);
+	
+	// PrepareArticle() in two steps: loading the markup (and following a redirect) creates
+	// the html in front of the article, so it can be sent while the article is parsed; with
+	// a stream the article is written to it while it is parsed, the html after it is not
+	bool LoadArticle(ArticleSearchResult* articleSearchResult);
+	bool ParseArticle(FILE* stream=NULL);
+	size_t PreArticleLength();
+	bool WritePreArticle(FILE* f);
+	bool WritePostArticle(FILE* f);
+	
+	// the prepared article utf-8 encoded in a (malloc'ed) buffer
+	char* GetUtf8Article(size_t* length);
 
 private: 
 	string _articleName;
 	string _languageCode;
+	
+	void* _parser;
+	char* _text;
+	int _textLength;
+	wstring _preArticleHtml;
+	wstring _postArticleHtml;
+	
+	bool ProcessArticle(char* text, int length, string articleTitle);
+	bool LoadArticle(char* text, int length, string articleTitle);
+	wstring PreparedArticle();
 };
 
 #endif // WIKIARTICLE_H
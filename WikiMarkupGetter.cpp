@@ -22,9 +22,12 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <unistd.h>
 #include <memory.h>
 #include <wchar.h>
 #include <bzlib.h>
+#include <zlib.h>
+#include <pthread.h>
 
 #include "Settings.h"
 #include "CPPStringUtils.h"
@@ -34,6 +37,315 @@
 
 #define BUFFER_SIZE 32767
 
+/*
+ Decompresses a bzip2 block of the data file, the compressed data is read with pread() so
+ all threads can share the descriptor of the title index.
+ */
+typedef struct tagBLOCKREADER
+{
+	bz_stream stream;
+	int		file;
+	fpos_t	pos;
+	bool	end;
+	char	input[BUFFER_SIZE];
+} BLOCKREADER;
+
+static bool block_open(BLOCKREADER* reader, int file, fpos_t pos)
+{
+	memset(&reader->stream, 0, sizeof(bz_stream));
+	reader->file = file;
+	reader->pos = pos;
+	reader->end = false;
+	
+	return file>=0 && BZ2_bzDecompressInit(&reader->stream, 0, 0)==BZ_OK;
+}
+
+// works like BZ2_bzRead(), returns the number of bytes decompressed, 0 at the end of the block
+static int block_read(BLOCKREADER* reader, char* buffer, int size)
+{
+	bz_stream* stream = &reader->stream;
+	stream->next_out = buffer;
+	stream->avail_out = size;
+	
+	while ( stream->avail_out && !reader->end )
+	{
+		if ( !stream->avail_in )
+		{
+			ssize_t read = pread(reader->file, reader->input, BUFFER_SIZE, reader->pos);
+			if ( read<=0 )
+			{
+				reader->end = true;
+				break;
+			}
+			
+			reader->pos += read;
+			stream->next_in = reader->input;
+			stream->avail_in = read;
+		}
+		
+		// stops at the end of the block or on errors
+		if ( BZ2_bzDecompress(stream)!=BZ_OK )
+			reader->end = true;
+	}
+	
+	return size - stream->avail_out;
+}
+
+static void block_close(BLOCKREADER* reader)
+{
+	BZ2_bzDecompressEnd(&reader->stream);
+}
+
+/*
+ A bzip2 stream consists of blocks of at most 900 KB, each one starts with a magic number 
+ (not byte aligned) and can be decompressed on its own. Large articles are decompressed by 
+ several threads: the blocks are located and every block is turned into a stream of its own.
+ */
+#define BZ2_BLOCK_MAGIC			0x314159265359ULL
+#define BZ2_STREAM_END_MAGIC	0x177245385090ULL
+#define BZ2_MAGIC_MASK			0xffffffffffffULL
+#define BZ2_MAX_BLOCK_SIZE		900000
+#define BZ2_MAX_STREAM_SIZE		(64*1024*1024)
+#define BZ2_READ_SIZE			262144
+
+typedef struct tagBZ2BLOCK
+{
+	unsigned long long startBit;	// the block magic
+	unsigned long long endBit;		// the next block magic or the end of stream magic
+	
+	char*	data;
+	size_t	size;
+} BZ2BLOCK;
+
+typedef struct tagBZ2JOB
+{
+	const unsigned char* stream;
+	char	level;
+	
+	BZ2BLOCK* blocks;
+	int		numberOfBlocks;
+	int		nextBlock;
+	
+	pthread_mutex_t mutex;
+} BZ2JOB;
+
+static unsigned int get_bits(const unsigned char* data, unsigned long long bitPos, int count)
+{
+	unsigned int value = 0;
+	while ( count-- )
+	{
+		value = (value << 1) | ((data[bitPos>>3] >> (7 - (bitPos & 7))) & 1);
+		bitPos++;
+	}
+	
+	return value;
+}
+
+static void put_bits(unsigned char* data, unsigned long long* bitPos, unsigned long long value, int count)
+{
+	while ( count-- )
+	{
+		if ( (value >> count) & 1 )
+			data[*bitPos>>3] |= 0x80 >> (*bitPos & 7);
+		(*bitPos)++;
+	}
+}
+
+/*
+ Reads the compressed stream at pos and locates its blocks. Returns the (malloc'ed) stream, 
+ NULL if it is no bzip2 stream or its end wasn't found.
+ */
+static unsigned char* read_bz2_stream(int file, fpos_t pos, BZ2BLOCK** blocks, int* numberOfBlocks)
+{
+	*blocks = NULL;
+	*numberOfBlocks = 0;
+	
+	size_t capacity = BZ2_READ_SIZE;
+	unsigned char* stream = (unsigned char*) malloc(capacity + 1);
+	size_t size = 0;
+	
+	int capacityOfBlocks = 0;
+	unsigned long long bits = 0;
+	bool complete = false;
+	
+	// the header: "BZh" and the block size
+	size_t scanned = 4;
+	
+	while ( stream && !complete )
+	{
+		if ( scanned>=size )
+		{
+			if ( size==capacity )
+			{
+				capacity *= 2;
+				unsigned char* newStream = capacity<=BZ2_MAX_STREAM_SIZE ? (unsigned char*) realloc(stream, capacity + 1) : NULL;
+				if ( !newStream )
+					break;
+				stream = newStream;
+			}
+			
+			ssize_t read = pread(file, stream + size, capacity - size, pos + size);
+			if ( read<=0 )
+				break;
+			
+			size += read;
+			if ( size<4 || stream[0]!='B' || stream[1]!='Z' || stream[2]!='h' || stream[3]<'1' || stream[3]>'9' )
+				break;
+			
+			continue;
+		}
+		
+		unsigned char c = stream[scanned++];
+		for (int i=7; i>=0 && !complete; i--)
+		{
+			bits = (bits << 1) | ((c >> i) & 1);
+			
+			unsigned long long magic = bits & BZ2_MAGIC_MASK;
+			if ( magic!=BZ2_BLOCK_MAGIC && magic!=BZ2_STREAM_END_MAGIC )
+				continue;
+			
+			unsigned long long bitPos = (unsigned long long) scanned*8 - i - 48;
+			if ( *numberOfBlocks )
+				(*blocks)[*numberOfBlocks-1].endBit = bitPos;
+			
+			if ( magic==BZ2_STREAM_END_MAGIC )
+			{
+				complete = true;
+				break;
+			}
+			
+			if ( *numberOfBlocks==capacityOfBlocks )
+			{
+				capacityOfBlocks = capacityOfBlocks ? capacityOfBlocks*2 : 16;
+				*blocks = (BZ2BLOCK*) realloc(*blocks, capacityOfBlocks*sizeof(BZ2BLOCK));
+				if ( !*blocks )
+				{
+					*numberOfBlocks = 0;
+					break;
+				}
+			}
+			
+			BZ2BLOCK* block = &(*blocks)[(*numberOfBlocks)++];
+			block->startBit = bitPos;
+			block->endBit = bitPos;
+			block->data = NULL;
+			block->size = 0;
+		}
+	}
+	
+	if ( !complete || !*numberOfBlocks )
+	{
+		if ( stream )
+			free(stream);
+		if ( *blocks )
+			free(*blocks);
+		
+		*blocks = NULL;
+		*numberOfBlocks = 0;
+		
+		return NULL;
+	}
+	
+	// the bits of the last byte may be read behind the end
+	stream[size] = 0;
+	
+	return stream;
+}
+
+static void decompress_bz2_block(const unsigned char* stream, char level, BZ2BLOCK* block)
+{
+	// header, the block and the end of the stream with the crc of the only block
+	unsigned long long bitCount = block->endBit - block->startBit;
+	size_t length = 4 + (size_t) ((bitCount + 80 + 7) / 8);
+	
+	unsigned char* input = (unsigned char*) calloc(length + 1, 1);
+	if ( !input )
+		return;
+	
+	input[0] = 'B';
+	input[1] = 'Z';
+	input[2] = 'h';
+	input[3] = level;
+	
+	int shift = (int) (block->startBit & 7);
+	const unsigned char* p = stream + (block->startBit >> 3);
+	size_t bytes = (size_t) ((bitCount + 7) / 8);
+	
+	for (size_t i=0; i<bytes; i++)
+		input[4+i] = shift ? (unsigned char) ((p[i] << shift) | (p[i+1] >> (8 - shift))) : p[i];
+	
+	if ( bitCount & 7 )
+		input[4+bytes-1] &= (unsigned char) (0xff << (8 - (bitCount & 7)));
+	
+	unsigned long long bitPos = 32 + bitCount;
+	put_bits(input, &bitPos, BZ2_STREAM_END_MAGIC, 48);
+	put_bits(input, &bitPos, get_bits(stream, block->startBit + 48, 32), 32);
+	
+	bz_stream bzStream;
+	memset(&bzStream, 0, sizeof(bz_stream));
+	
+	size_t capacity = BZ2_MAX_BLOCK_SIZE;
+	char* data = (char*) malloc(capacity);
+	
+	if ( data && BZ2_bzDecompressInit(&bzStream, 0, 0)==BZ_OK )
+	{
+		bzStream.next_in = (char*) input;
+		bzStream.avail_in = length;
+		
+		int result = BZ_OK;
+		size_t size = 0;
+		while ( result==BZ_OK )
+		{
+			if ( size==capacity )
+			{
+				capacity *= 2;
+				char* newData = (char*) realloc(data, capacity);
+				if ( !newData )
+					break;
+				data = newData;
+			}
+			
+			bzStream.next_out = data + size;
+			bzStream.avail_out = capacity - size;
+			
+			result = BZ2_bzDecompress(&bzStream);
+			size = capacity - bzStream.avail_out;
+		}
+		
+		BZ2_bzDecompressEnd(&bzStream);
+		
+		if ( result==BZ_STREAM_END )
+		{
+			block->data = data;
+			block->size = size;
+			data = NULL;
+		}
+	}
+	
+	if ( data )
+		free(data);
+	free(input);
+}
+
+static void* decompress_bz2_blocks(void* param)
+{
+	BZ2JOB* job = (BZ2JOB*) param;
+	
+	while ( true )
+	{
+		pthread_mutex_lock(&job->mutex);
+		int i = job->nextBlock++;
+		pthread_mutex_unlock(&job->mutex);
+		
+		if ( i>=job->numberOfBlocks )
+			break;
+		
+		decompress_bz2_block(job->stream, job->level, &job->blocks[i]);
+	}
+	
+	return NULL;
+}
+
 WikiMarkupGetter::WikiMarkupGetter(string language_code) 
 {
 	_languageCode = string(language_code);
@@ -67,9 +379,43 @@ wstring WikiMarkupGetter::GetMarkupForArticle(const string utf8ArticleName)
 
 wstring WikiMarkupGetter::GetMarkupForArticle(ArticleSearchResult* articleSearchResult)
 {
-	if ( !articleSearchResult )
+	int length;
+	char* text = GetUtf8MarkupForArticle(articleSearchResult, &length);
+	if ( !text )
 		return wstring();
 	
+	wstring content = CPPStringUtils::from_utf8w(text, length);
+	free(text);
+	
+	return content;
+}
+
+char* WikiMarkupGetter::GetUtf8MarkupForArticle(const string utf8ArticleName, int* length)
+{
+	*length = 0;
+	
+	TitleIndex* titleIndex = __settings->GetTitleIndex(_languageCode);
+	if ( !titleIndex )
+		return NULL;
+	
+	ArticleSearchResult* articleSearchResult = titleIndex->FindArticle(utf8ArticleName);
+	
+	if ( !articleSearchResult )
+		return NULL;
+	
+	char* result = GetUtf8MarkupForArticle(articleSearchResult, length);
+	titleIndex->DeleteSearchResult(articleSearchResult);
+	
+	return result;
+}
+
+char* WikiMarkupGetter::GetUtf8MarkupForArticle(ArticleSearchResult* articleSearchResult, int* textLength)
+{
+	*textLength = 0;
+	
+	if ( !articleSearchResult )
+		return NULL;
+	
 	fpos_t blockPos = articleSearchResult->BlockPos(); 
 	int articlePos = articleSearchResult->ArticlePos();
 	int articleLength = articleSearchResult->ArticleLength();
@@ -78,21 +424,96 @@ wstring WikiMarkupGetter::GetMarkupForArticle(ArticleSearchResult* articleSearch
 
 	TitleIndex* titleIndex = __settings->GetTitleIndex(_languageCode);
 	string filename = titleIndex->DataFileName();	
-	FILE* f = fopen(filename.c_str(), "rb");
-	if ( !f )
-		return wstring();
-					
-	// seek to the block
-	fseeko(f, blockPos, SEEK_SET);
+	
+	char* text = (char*) malloc(articleLength+1);
+	int length = -1;
+	
+	// the block may have been decompressed already (templates are often located in the same blocks)
+	BlockCache* blockCache = __settings->GetBlockCache();
+	if ( titleIndex->Version()==ARTICLES_FRAMED_VERSION )
+		length = ReadFromFrames(titleIndex, blockPos, articleLength, text);
+	else if ( blockCache->MaxSize() )
+		length = blockCache->Read(filename, blockPos, articlePos, articleLength, text);
+	
+	if ( length<0 )
+	{
+		int file = titleIndex->DataFile();
+		if ( file<0 )
+		{
+			free(text);
+			return NULL;
+		}
 		
+		if ( blockCache->MaxSize() )
+		{
+			// decompress the whole block and keep it for the next requests
+			size_t size = 0;
+			char* block = DecompressBlock(file, blockPos, articlePos+articleLength, &size);
+			
+			length = 0;
+			if ( block )
+			{
+				if ( articlePos>=0 && (size_t) articlePos<size )
+				{
+					length = size - articlePos;
+					if ( length>articleLength )
+						length = articleLength;
+					
+					memcpy(text, block + articlePos, length);
+				}
+				
+				blockCache->Add(filename, blockPos, block, size);
+			}
+		}
+		else
+			length = ReadFromBlock(file, blockPos, articlePos, articleLength, text);
+	}
+	
+	text[length] = 0x0;
+	
+	// like before, the text ends at the first zero
+	*textLength = strlen(text);
+	
+	return text;
+}
+
+int WikiMarkupGetter::ReadFromBlock(int file, fpos_t blockPos, int articlePos, int articleLength, char* text)
+{
+	// large articles likely span several bzip2 blocks, these are decompressed side by side
+	if ( articlePos+articleLength>BZ2_MAX_BLOCK_SIZE && __settings->DecompressionThreads()>1 )
+	{
+		size_t size;
+		char* block = DecompressBlockParallel(file, blockPos, &size);
+		if ( block )
+		{
+			int length = 0;
+			if ( articlePos>=0 && (size_t) articlePos<size )
+			{
+				length = size - articlePos;
+				if ( length>articleLength )
+					length = articleLength;
+				
+				memcpy(text, block + articlePos, length);
+			}
+			
+			free(block);
+			return length;
+		}
+	}
+	
 	// open the block
-	int bzerror;
-	BZFILE *bzf = BZ2_bzReadOpen(&bzerror, f, 0, 0, NULL, 0);
+	BLOCKREADER* reader = (BLOCKREADER*) malloc(sizeof(BLOCKREADER));
+	if ( !reader || !block_open(reader, file, blockPos) )
+	{
+		if ( reader )
+			free(reader);
+		return 0;
+	}
 	
-	char* text = (char*) malloc(articleLength+1);
 	char buffer[BUFFER_SIZE];
+	char* pText = text;
 	int read;
-	while ( (read=BZ2_bzRead(&bzerror, bzf, buffer, BUFFER_SIZE)) )
+	while ( (read=block_read(reader, buffer, BUFFER_SIZE))>0 )
 	{
 		if ( articlePos-read<0 )
 		{
@@ -101,37 +522,272 @@ wstring WikiMarkupGetter::GetMarkupForArticle(ArticleSearchResult* articleSearch
 			if ( len>articleLength )
 				len = articleLength;
 			
-			char* pText = text;
-			strncpy(pText, start, len);
+			memcpy(pText, start, len);
 			articleLength -= len;
 			pText += len;
 			
-			while ( articleLength && (read=BZ2_bzRead(&bzerror, bzf, buffer, BUFFER_SIZE)) )
+			while ( articleLength && (read=block_read(reader, buffer, BUFFER_SIZE))>0 )
 			{
 				if ( articleLength>read )
 					len = read;
 				else
 					len = articleLength;
 				
-				strncpy(pText, buffer, len);
+				memcpy(pText, buffer, len);
 				articleLength -= len;
 				pText += len;
 			}
 			
-			*pText = 0x0;
 			break;
 		}
 		else
 			articlePos -= read;
 	}
 	
-	BZ2_bzReadClose(&bzerror, bzf);
-	fclose(f);
+	block_close(reader);
+	free(reader);
 	
-	wstring content = CPPStringUtils::from_utf8w(text);
-	free(text);
+	return pText - text;
+}
+
+char* WikiMarkupGetter::DecompressBlock(int file, fpos_t blockPos, int sizeHint, size_t* size)
+{
+	*size = 0;
 	
-	return content;
+	// large articles likely span several bzip2 blocks, these are decompressed side by side
+	if ( sizeHint>BZ2_MAX_BLOCK_SIZE && __settings->DecompressionThreads()>1 )
+	{
+		char* data = DecompressBlockParallel(file, blockPos, size);
+		if ( data )
+			return data;
+	}
+	
+	BLOCKREADER* reader = (BLOCKREADER*) malloc(sizeof(BLOCKREADER));
+	if ( !reader || !block_open(reader, file, blockPos) )
+	{
+		if ( reader )
+			free(reader);
+		return NULL;
+	}
+	
+	size_t capacity = BUFFER_SIZE;
+	while ( capacity<(size_t) sizeHint )
+		capacity *= 2;
+	
+	char* data = (char*) malloc(capacity);
+	size_t length = 0;
+	
+	while ( data )
+	{
+		if ( length==capacity )
+		{
+			capacity *= 2;
+			char* newData = (char*) realloc(data, capacity);
+			if ( !newData )
+			{
+				free(data);
+				data = NULL;
+				break;
+			}
+			data = newData;
+		}
+		
+		int read = block_read(reader, data + length, capacity - length);
+		if ( read<=0 )
+			break;
+		
+		length += read;
+	}
+	
+	block_close(reader);
+	free(reader);
+	
+	if ( data && !length )
+	{
+		free(data);
+		data = NULL;
+	}
+	
+	// shrink it, the cache holds it for a while
+	if ( data && length<capacity )
+	{
+		char* newData = (char*) realloc(data, length);
+		if ( newData )
+			data = newData;
+	}
+	
+	if ( data )
+		*size = length;
+	
+	return data;
+}
+
+/*
+ Decompresses the blocks of the bzip2 stream at blockPos on several threads, returns NULL if 
+ this doesn't work out (or there is only one block), the stream has to be read the usual way then.
+ */
+char* WikiMarkupGetter::DecompressBlockParallel(int file, fpos_t blockPos, size_t* size)
+{
+	*size = 0;
+	
+	BZ2JOB job;
+	job.stream = read_bz2_stream(file, blockPos, &job.blocks, &job.numberOfBlocks);
+	if ( !job.stream )
+		return NULL;
+	
+	if ( job.numberOfBlocks<2 )
+	{
+		free((void*) job.stream);
+		free(job.blocks);
+		return NULL;
+	}
+	
+	job.level = job.stream[3];
+	job.nextBlock = 0;
+	pthread_mutex_init(&job.mutex, NULL);
+	
+	// this thread works on the blocks too
+	int numberOfThreads = __settings->DecompressionThreads() - 1;
+	if ( numberOfThreads>job.numberOfBlocks-1 )
+		numberOfThreads = job.numberOfBlocks - 1;
+	
+	pthread_t* threads = new pthread_t[numberOfThreads];
+	int started = 0;
+	while ( started<numberOfThreads && pthread_create(&threads[started], NULL, decompress_bz2_blocks, &job)==0 )
+		started++;
+	
+	decompress_bz2_blocks(&job);
+	
+	for (int i=0; i<started; i++)
+		pthread_join(threads[i], NULL);
+	
+	delete[] threads;
+	pthread_mutex_destroy(&job.mutex);
+	free((void*) job.stream);
+	
+	// put them together in order
+	size_t length = 0;
+	bool complete = true;
+	for (int i=0; i<job.numberOfBlocks; i++)
+	{
+		length += job.blocks[i].size;
+		complete = complete && job.blocks[i].data;
+	}
+	
+	char* data = complete && length ? (char*) malloc(length) : NULL;
+	
+	length = 0;
+	for (int i=0; i<job.numberOfBlocks; i++)
+	{
+		if ( !job.blocks[i].data )
+			continue;
+		
+		if ( data )
+			memcpy(data + length, job.blocks[i].data, job.blocks[i].size);
+		length += job.blocks[i].size;
+		
+		free(job.blocks[i].data);
+	}
+	
+	free(job.blocks);
+	
+	if ( data )
+		*size = length;
+	
+	return data;
+}
+
+/*
+ Version 3 files: copies the article at streamPos out of the frames covering it, all other
+ frames stay compressed. The frames are kept in the block cache like the bzip2 blocks.
+ */
+int WikiMarkupGetter::ReadFromFrames(TitleIndex* titleIndex, fpos_t streamPos, int articleLength, char* text)
+{
+	unsigned int frameSize = titleIndex->FrameSize();
+	if ( !frameSize || streamPos<0 )
+		return 0;
+	
+	string filename = titleIndex->DataFileName();
+	BlockCache* blockCache = __settings->GetBlockCache();
+	
+	int length = 0;
+	while ( length<articleLength )
+	{
+		fpos_t pos = streamPos + length;
+		int frameNumber = (int) (pos / frameSize);
+		int offset = (int) (pos % frameSize);
+		
+		fpos_t framePos;
+		unsigned int compressedSize;
+		if ( !titleIndex->GetFrame(frameNumber, &framePos, &compressedSize) )
+			break;
+		
+		int read = -1;
+		if ( blockCache->MaxSize() )
+			read = blockCache->Read(filename, framePos, offset, articleLength - length, text + length);
+		
+		if ( read<0 )
+		{
+			size_t size = 0;
+			char* frame = DecompressFrame(titleIndex->DataFile(), framePos, compressedSize, frameSize, &size);
+			if ( !frame )
+				break;
+			
+			read = 0;
+			if ( (size_t) offset<size )
+			{
+				read = size - offset;
+				if ( read>articleLength - length )
+					read = articleLength - length;
+				
+				memcpy(text + length, frame + offset, read);
+			}
+			
+			if ( blockCache->MaxSize() )
+				blockCache->Add(filename, framePos, frame, size);
+			else
+				free(frame);
+		}
+		
+		if ( read<=0 )
+			break;
+		
+		length += read;
+	}
+	
+	return length;
+}
+
+char* WikiMarkupGetter::DecompressFrame(int file, fpos_t framePos, unsigned int compressedSize, unsigned int frameSize, size_t* size)
+{
+	*size = 0;
+	
+	if ( file<0 )
+		return NULL;
+	
+	char* compressed = (char*) malloc(compressedSize);
+	char* data = (char*) malloc(frameSize);
+	
+	size_t read = 0;
+	ssize_t result = 0;
+	while ( compressed && read<compressedSize && (result=pread(file, compressed + read, compressedSize - read, framePos + read))>0 )
+		read += result;
+	
+	uLongf length = frameSize;
+	if ( !data || read<compressedSize || uncompress((Bytef*) data, &length, (const Bytef*) compressed, compressedSize)!=Z_OK )
+	{
+		if ( data )
+			free(data);
+		data = NULL;
+	}
+	
+	if ( compressed )
+		free(compressed);
+	
+	if ( data )
+		*size = length;
+	
+	return data;
 }
 
 string WikiMarkupGetter::GetLastArticleTitle()
@@ -139,12 +795,12 @@ string WikiMarkupGetter::GetLastArticleTitle()
 	return _lastArticleTitle;
 }
 
-wstring WikiMarkupGetter::GetTemplate(const wstring templateName, string templatePrefix)
+wstring WikiMarkupGetter::GetTemplate(const wstring templateName, string templatePrefix, int** parameters, int* numberOfParameters)
 {
-	return GetTemplate(CPPStringUtils::to_utf8(templateName), templatePrefix);
+	return GetTemplate(CPPStringUtils::to_utf8(templateName), templatePrefix, parameters, numberOfParameters);
 }
 
-wstring WikiMarkupGetter::GetTemplate(const string utf8TemplateName, string templatePrefix)
+wstring WikiMarkupGetter::GetTemplate(const string utf8TemplateName, string templatePrefix, int** parameters, int* numberOfParameters)
 {	
 	// remove "_" and exchange them with spaces
 	string templateName = utf8TemplateName;
@@ -153,6 +809,25 @@ wstring WikiMarkupGetter::GetTemplate(const string utf8TemplateName, string temp
 	while ( (pos=templateName.find("_"))!=string::npos )
 		templateName.replace(pos, 1, " ", 1);
 	
+	TemplateCache* templateCache = __settings->GetTemplateCache();
+	
+	wstring text;
+	if ( templateCache->Get(_languageCode, templateName, text, parameters, numberOfParameters) )
+		return text;
+	
+	text = LoadTemplate(templateName, templatePrefix);
+	*numberOfParameters = TemplateCache::FindParameters(text, parameters);
+	
+	if ( templateCache->MaxSize() )
+		templateCache->Add(_languageCode, templateName, text, *parameters, *numberOfParameters);
+	
+	return text;
+}
+
+wstring WikiMarkupGetter::LoadTemplate(string templateName, string templatePrefix)
+{
+	size_t pos = 0;
+	
 	// check the "en:convert/" template
 	// remove trailing slashes (a common error)
 	/*
@@ -363,8 +1038,17 @@ wstring WikiMarkupGetter::GetTemplate(const string utf8TemplateName, string temp
 	*/
 	if ( !filename.empty() ) 
 	{
-		// try to store the text
-		FILE* f = fopen(filename.c_str(), "wb");
+		// try to store the text; write it to a temporary file first so concurrent requests
+		// never read a partially written template
+		string tempFilename = filename + ".XXXXXX";
+		char tempName[tempFilename.length()+1];
+		strcpy(tempName, tempFilename.c_str());
+		
+		int fd = mkstemp(tempName);
+		FILE* f = NULL;
+		if ( fd>=0 )
+			f = fdopen(fd, "wb");
+		
 		if ( f ) 
 		{
 			string data = CPPStringUtils::to_utf8(text);
@@ -373,8 +1057,16 @@ wstring WikiMarkupGetter::GetTemplate(const string utf8TemplateName, string temp
 			char c = 0;
 			fwrite(&c, 1, 1, f);
 		
-			fclose(f);
-		}	
+			if ( fclose(f)==0 )
+				rename(tempName, filename.c_str());
+			else
+				unlink(tempName);
+		}
+		else if ( fd>=0 )
+		{
+			close(fd);
+			unlink(tempName);
+		}
 	}
 	
 	return text;
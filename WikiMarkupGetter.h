@@ -35,14 +35,28 @@ public:
 	wstring GetMarkupForArticle(const wstring articleName);	
 	wstring GetMarkupForArticle(const string utf8ArticleName);
 	wstring GetMarkupForArticle(ArticleSearchResult* articleSearchResult);
+	
+	// the undecoded markup, the (malloc'ed) result has to be freed by the caller
+	char* GetUtf8MarkupForArticle(const string utf8ArticleName, int* length);
+	char* GetUtf8MarkupForArticle(ArticleSearchResult* articleSearchResult, int* length);
 
 	string GetLastArticleTitle();
 
-	wstring GetTemplate(const wstring templateName, string templatePrefix);
-	wstring GetTemplate(const string utf8TemplateName, string templatePrefix);
+	// the prepared text of a template and its parameters, see TemplateCache::FindParameters()
+	wstring GetTemplate(const wstring templateName, string templatePrefix, int** parameters, int* numberOfParameters);
+	wstring GetTemplate(const string utf8TemplateName, string templatePrefix, int** parameters, int* numberOfParameters);
 	
 private:
 	string _languageCode;	
 	string _lastArticleTitle;
+	
+	wstring LoadTemplate(string templateName, string templatePrefix);
+	
+	int ReadFromBlock(int file, fpos_t blockPos, int articlePos, int articleLength, char* text);
+	char* DecompressBlock(int file, fpos_t blockPos, int sizeHint, size_t* size);
+	char* DecompressBlockParallel(int file, fpos_t blockPos, size_t* size);
+	
+	int ReadFromFrames(TitleIndex* titleIndex, fpos_t streamPos, int articleLength, char* text);
+	char* DecompressFrame(int file, fpos_t framePos, unsigned int compressedSize, unsigned int frameSize, size_t* size);
 };
 
@@ -24,6 +24,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <memory.h>
+#include <pthread.h>
 
 #include "Settings.h"
 #include "WikiMarkupParser.h"
@@ -32,9 +33,13 @@
 #include "StopWatch.h"
 #include "StringUtils.h"
 #include "ConfigFile.h"
+#include "Expression.h"
 
 #define OUTPUT_GROWS	8192
 
+// a released output buffer up to this size (in characters) is kept for the next parser of the thread
+#define OUTPUT_KEEP		262144
+
 #define DEBUG false
 
 const wchar_t* wikiTags[] = {L"unused", L"nowiki", L"pre", L"source", L"imagemap", L"code", L"ref", L"references", 0x0};
@@ -61,11 +66,213 @@ typedef struct tagTOC
 
 typedef struct tagREF
 {
-	const	wchar_t* start;
+	wchar_t*	start;
 	int		length;
 	tagREF*	next;
 } REF;
 
+typedef struct tagLINK
+{
+	int		position;
+	string	title;
+	tagLINK* next;
+} LINK;
+
+// the template results of a render are kept in this many lists, by the hash of the template text
+#define EXPANSION_SLOTS	256
+
+typedef struct tagEXPANSION
+{
+	unsigned int	hash;
+	wchar_t*		text;
+	wchar_t*		result;
+	tagEXPANSION*	next;
+} EXPANSION;
+
+// the state of the text ParseInline() is called from, kept on the stack while the inline text is rendered
+typedef struct tagINLINEFRAME
+{
+	wchar_t*	input;
+	wchar_t*	currentInput;
+	int			inputLength;
+	
+	int			firstToken;
+	int			numberOfTokens;
+	int			currentToken;
+	
+	int			newLine;
+	int			orderedEnumeration;
+	int			unorderedEnumeration;
+	int			definitionList;
+	int			italic;
+	int			bold;
+	int			externalLinkNo;
+	bool		stop;
+	
+	tagType*	currentTag;
+	
+	int			tocPosition;
+	bool		noToc;
+	bool		forceToc;
+	
+	void*		toc;
+	void*		references;
+	wchar_t*	categories;
+} INLINEFRAME;
+
+// a run of text or a single markup char (markup is 0 for text), position is the offset in the input
+typedef struct tagTOKEN
+{
+	int		position;
+	int		length;
+	wchar_t	markup;
+} TOKEN;
+
+typedef struct tagOUTPUTBUFFER
+{
+	wchar_t*	data;
+	int			size;
+} OUTPUTBUFFER;
+
+// every (worker) thread keeps the last released output buffer, so the parsers
+// of the next request (and the nested ones) don't start from scratch
+static pthread_key_t outputBufferKey;
+static pthread_once_t outputBufferKeyOnce = PTHREAD_ONCE_INIT;
+
+static unsigned int hash_text(const wchar_t* text)
+{
+	unsigned int hash = 0;
+	while ( *text )
+		hash = hash*31 + (unsigned int) *text++;
+	
+	return hash;
+}
+
+// the chars Parse() branches on in the middle of a line (everything else is copied as it is), the
+// ones starting tags or templates and the start of the end of a comment
+static CHARSET markupChars;
+static CHARSET templateChars;
+static CHARSET tagChars;
+static CHARSET dashChars;
+static pthread_once_t charsetsOnce = PTHREAD_ONCE_INIT;
+
+static void create_charsets()
+{
+	init_charset(&markupChars, "\n'<[_|!:");
+	init_charset(&templateChars, "<{");
+	init_charset(&tagChars, "<");
+	init_charset(&dashChars, "-");
+}
+
+static inline bool is_markup(wchar_t c)
+{
+	return (unsigned int) c<0x80 && c && markupChars.member[c];
+}
+
+// copies the input, single carriage returns become line feeds; returns the length,
+// src and dest may be the same buffer
+static int copy_input(const wchar_t* src, wchar_t* dest)
+{
+	wchar_t* start = dest;
+	while ( *src )
+	{
+		if ( *src=='\r' && src[1]!='\n' )
+			*dest++ = '\n';
+		else
+			*dest++ = *src;
+		
+		src++;
+	}
+	*dest = 0x0;
+	
+	return dest - start;
+}
+
+// copies a template text with the parameters found in it (see TemplateCache::FindParameters())
+// replaced by their values or defaults to result; the parameters in these are replaced as well
+static void substitute_parameters(wstring& result, const wstring& text, const int* parameters, int numberOfParameters, TEMPLATEPARAM** params, int paramCount, int depth)
+{
+	size_t copied = 0;
+	for (int i=0; i<numberOfParameters; i++)
+	{
+		int start = parameters[2*i];
+		int length = parameters[2*i + 1];
+		
+		result.append(text, copied, start - copied);
+		copied = start + length;
+		
+		wstring paramName = CPPStringUtils::trim(text.substr(start + 3, length - 6));
+		
+		wstring paramValue = wstring();
+		wstring alternateValue = wstring();
+		
+		size_t spliterPos = 0;
+		if ( (spliterPos=paramName.find(L"|"))!=string::npos ) 
+		{
+			// try to find the optional string
+			alternateValue = paramName.substr(spliterPos+1);
+			paramName = CPPStringUtils::trim(paramName.substr(0, spliterPos));
+		}
+		
+		for (int j=0; j<paramCount; j++)
+		{
+			if ( params[j]->name==paramName || params[j]->position==paramName ) 
+			{
+				paramValue = params[j]->value;
+				break;
+			}
+		}
+		
+		if ( paramValue.empty() )
+			paramValue = alternateValue;
+		
+		// a value referring to itself would never end
+		int* valueParameters = NULL;
+		int numberOfValueParameters = 0;
+		if ( depth<TEMPLATE_MAX_DEPTH )
+			numberOfValueParameters = TemplateCache::FindParameters(paramValue, &valueParameters);
+		
+		if ( numberOfValueParameters )
+		{
+			substitute_parameters(result, paramValue, valueParameters, numberOfValueParameters, params, paramCount, depth + 1);
+			free(valueParameters);
+		}
+		else
+			result.append(paramValue);
+	}
+	
+	result.append(text, copied, string::npos);
+}
+
+static void free_output_buffer(void* p)
+{
+	OUTPUTBUFFER* outputBuffer = (OUTPUTBUFFER*) p;
+	if ( outputBuffer->data )
+		free(outputBuffer->data);
+	free(outputBuffer);
+}
+
+static void create_output_buffer_key()
+{
+	pthread_key_create(&outputBufferKey, free_output_buffer);
+}
+
+static OUTPUTBUFFER* thread_output_buffer()
+{
+	pthread_once(&outputBufferKeyOnce, create_output_buffer_key);
+	
+	OUTPUTBUFFER* outputBuffer = (OUTPUTBUFFER*) pthread_getspecific(outputBufferKey);
+	if ( !outputBuffer )
+	{
+		outputBuffer = (OUTPUTBUFFER*) malloc(sizeof(OUTPUTBUFFER));
+		outputBuffer->data = NULL;
+		outputBuffer->size = 0;
+		pthread_setspecific(outputBufferKey, outputBuffer);
+	}
+	
+	return outputBuffer;
+}
+
 WikiMarkupParser::WikiMarkupParser(const wchar_t* languageCode, const wchar_t* pageName, bool doExpandTemplates) 
 {
 	_languageCodeW = (wchar_t*) malloc((wcslen(languageCode)+1) * sizeof(wchar_t));
@@ -74,13 +281,30 @@ WikiMarkupParser::WikiMarkupParser(const wchar_t* languageCode, const wchar_t* p
 	_pInput = NULL;
 	_pCurrentInput = NULL;
 	
+	_tokens = NULL;
+	_numberOfTokens = 0;
+	_tokensSize = 0;
+	_currentToken = 0;
+	_firstToken = 0;
+	
 	_pOutput = NULL;
 	_pCurrentOutput = NULL;
 	_iOutputSize = 0;
 	_iOutputRemain = 0;
 	
+	_outputStream = NULL;
+	_flushedLength = 0;
+	_tocPlaceholder = false;
+	
 	_doExpandTemplates = doExpandTemplates;
 	
+	_templateDepth = 0;
+	_expandedSize = 0;
+	_templateFetches = 0;
+	_templateBudgetExceeded = false;
+	
+	_expansions = NULL;
+	
 	_newLine = 0;
 	
 	_orderedEnumeration = 0;
@@ -95,6 +319,8 @@ WikiMarkupParser::WikiMarkupParser(const wchar_t* languageCode, const wchar_t* p
 	_stop = false;
 
 	_pCurrentTag = NULL;
+	_unusedTags = NULL;
+	_inlineDepth = 0;
 	
 	_tocPosition = -1;
 	
@@ -102,6 +328,8 @@ WikiMarkupParser::WikiMarkupParser(const wchar_t* languageCode, const wchar_t* p
 	
 	_references = NULL;
 	
+	_links = NULL;
+	
 	_categories = NULL;
 	
 	_pageName = pageName;
@@ -130,21 +358,26 @@ WikiMarkupParser::~WikiMarkupParser()
 		free(_pInput);
 		_pInput = NULL;
 	}
-
-	if ( _pOutput!=NULL ) 
+	
+	if ( _tokens )
 	{
-		free(_pOutput);
-		_pOutput = NULL;
-	}	
+		free(_tokens);
+		_tokens = NULL;
+	}
+
+	ReleaseOutput();
 	
 	while ( _pCurrentTag )
 	{
 		tagType *oldTag = _pCurrentTag;
 		_pCurrentTag = oldTag->pPrevious;
-		if ( _pCurrentTag!=NULL ) 
-			_pCurrentTag->pNext = NULL;
+		delete(oldTag);
+	}
 	
-		free(oldTag->name);
+	while ( _unusedTags )
+	{
+		tagType *oldTag = _unusedTags;
+		_unusedTags = oldTag->pPrevious;
 		delete(oldTag);
 	}
 
@@ -167,6 +400,14 @@ WikiMarkupParser::~WikiMarkupParser()
 		delete(ref);
 	}	
 	
+	while ( _links )
+	{
+		LINK* link = (LINK*) _links;
+		_links = link->next;
+		
+		delete(link);
+	}	
+	
 	if ( _categories )
 	{
 		free(_categories);
@@ -184,6 +425,8 @@ WikiMarkupParser::~WikiMarkupParser()
 		free(_imageNamespace);
 		_imageNamespace = NULL;
 	}
+	
+	FreeExpansions();
 }
 
 void WikiMarkupParser::SetInput(const wchar_t* pInput) 
@@ -195,83 +438,129 @@ void WikiMarkupParser::SetInput(const wchar_t* pInput)
 		free(_pInput);
 		
 	_pInput = (wchar_t*) malloc( (wcslen(pInput)+1) * sizeof(wchar_t) );
+	_inputLength = copy_input(pInput, _pInput);
+		
+	// the buffer is reused
+	_pCurrentOutput = _pOutput;
+	_iOutputRemain = _iOutputSize;
+}
+
+void WikiMarkupParser::SetInput(const char* pUtf8Input, int length) 
+{
+	if ( pUtf8Input==NULL )
+		return;
+		
+	if ( _pInput!=NULL )
+		free(_pInput);
 	
-	const wchar_t* pSrc = pInput;
-	wchar_t* pDest = _pInput;	
-	while (*pSrc!=0x0) {
-		if ( *pSrc=='\r' ) {
-			if ( *(pSrc+1)=='\n' ) 
-				*pDest++ = *pSrc;
-			else
-				*pDest++ = '\n';
-		}
-		else
-			*pDest++ = *pSrc;
-			
-		pSrc++;
-	}
-	*pDest = 0x0;
+	// decode directly into the input buffer, the line ends are handled in place
+	_pInput = (wchar_t*) malloc( (length+1) * sizeof(wchar_t) );
+	CPPStringUtils::decode_utf8(pUtf8Input, length, _pInput);
 	
-	_inputLength = wcslen(_pInput);
-		
-	if ( _pOutput!=NULL )
-		free(_pOutput);
+	_inputLength = copy_input(_pInput, _pInput);
 		
+	// the buffer is reused
 	_pCurrentOutput = _pOutput;
 	_iOutputRemain = _iOutputSize;
 }
 
 const wchar_t* WikiMarkupParser::GetOutput() 
 {
-	if ( _pOutput==NULL ) 
+	if ( !_tocHtml.empty() )
 	{
-		_iOutputSize = OUTPUT_GROWS;
-		_pOutput = (wchar_t*) malloc((_iOutputSize+1) *sizeof(wchar_t));
-			
-		_pCurrentOutput = _pOutput;
-		_iOutputRemain = _iOutputSize;
-		*_pCurrentOutput = 0x0;
+		// make room for the toc, this happens only once
+		int length = _tocHtml.length();
+		ReserveOutput(length);
+		
+		wchar_t* pToc = _pOutput + _tocPosition;
+		memmove(pToc + length, pToc, (_pCurrentOutput - pToc)*sizeof(wchar_t));
+		memcpy(pToc, _tocHtml.c_str(), length*sizeof(wchar_t));
+		
+		_pCurrentOutput += length;
+		_iOutputRemain -= length;
+		
+		_tocHtml = wstring();
 	}
 	
+	if ( _pOutput==NULL ) 
+		ReserveOutput(0);
+	
+	// there is always room for the terminating zero
+	*_pCurrentOutput = 0x0;
+	
 	return _pOutput;
 }
 
-double WikiMarkupParser::EvaluateExpression(const wchar_t* expression)
+size_t WikiMarkupParser::GetOutputUtf8Length()
 {
-	if ( !expression || !*expression )
+	if ( _pOutput==NULL )
 		return 0;
 	
-	return 0;
+	return CPPStringUtils::utf8_length(_pOutput, _pCurrentOutput - _pOutput) + CPPStringUtils::utf8_length(_tocHtml.c_str(), _tocHtml.length());
+}
+
+bool WikiMarkupParser::WriteOutput(FILE* f)
+{
+	if ( _pOutput==NULL )
+		return true;
+	
+	if ( _tocHtml.empty() )
+		return CPPStringUtils::write_utf8(f, _pOutput, _pCurrentOutput - _pOutput);
+	
+	return CPPStringUtils::write_utf8(f, _pOutput, _tocPosition) &&
+		CPPStringUtils::write_utf8(f, _tocHtml.c_str(), _tocHtml.length()) &&
+		CPPStringUtils::write_utf8(f, _pOutput + _tocPosition, (_pCurrentOutput - _pOutput) - _tocPosition);
+}
+
+void WikiMarkupParser::SetOutputStream(FILE* stream)
+{
+	_outputStream = stream;
+}
+
+// writes the output rendered since the last call, the links in it are checked before; the toc is
+// only known at the end, until then a placeholder is written where it belongs
+void WikiMarkupParser::FlushOutput(bool last)
+{
+	if ( !_outputStream )
+		return;
 	
-	/*
-	char buffer[8 + wcslen(expression) + 1 + 1];
-	strcpy(buffer, "result=(");
-	char* help = buffer + 8;
-	while ( *expression )
-		*help++ = tolower((char) *expression++);
-	*help++ = ')';
-	*help = 0x0;
-	
-	char* pos;
-	while ( (pos=strstr(buffer, "mod")) )
+	CheckLinks();
+	
+	int length = _pCurrentOutput - _pOutput;
+	const wchar_t* start = _pOutput + _flushedLength;
+	bool ok = true;
+	
+	bool tocInRange = _tocPosition>=_flushedLength && (_tocPosition<length || last);
+	if ( tocInRange )
 	{
-		*pos++ = ' ';
-		*pos++ = '%';
-		*pos = ' ';
+		ok = CPPStringUtils::write_utf8(_outputStream, start, _tocPosition - _flushedLength);
+		if ( last )
+			ok = ok && CPPStringUtils::write_utf8(_outputStream, _tocHtml.c_str(), _tocHtml.length());
+		else
+		{
+			ok = ok && CPPStringUtils::write_utf8(_outputStream, L"<div class=\"wkTocPlaceholder\"></div>");
+			_tocPlaceholder = true;
+		}
+		
+		start = _pOutput + _tocPosition;
 	}
 	
-	int error = evaluateExpression(buffer);
-	if ( error )
-		return 0;
+	ok = ok && CPPStringUtils::write_utf8(_outputStream, start, _pOutput + length - start);
+	_flushedLength = length;
 	
-	for (int i = 0; i < nVariables; i++) 
+	if ( last && !tocInRange && _tocPlaceholder && !_tocHtml.empty() )
 	{
-		if ( !strcmp(variable[i].name, "result") )
-			return variable[i].value;
+		// __TOC__ may have moved the toc behind an earlier placeholder, so the last one is used
+		ok = ok && CPPStringUtils::write_utf8(_outputStream, L"<div id=\"wkToc\">") &&
+			CPPStringUtils::write_utf8(_outputStream, _tocHtml.c_str(), _tocHtml.length()) &&
+			CPPStringUtils::write_utf8(_outputStream, L"</div>\r\n<script type=\"text/javascript\">\r\n"
+				L"var p=document.getElementsByClassName('wkTocPlaceholder'); p=p[p.length-1];\r\n"
+				L"p.parentNode.replaceChild(document.getElementById('wkToc'), p);\r\n</script>\r\n");
 	}
 	
-	return 0;
-	 */
+	// a client which went away doesn't stop the page from being rendered (and cached)
+	if ( !ok || fflush(_outputStream) )
+		_outputStream = NULL;
 }
 
 void WikiMarkupParser::ReplaceInput(const wchar_t* text, int position, int length) 
@@ -286,20 +575,107 @@ void WikiMarkupParser::ReplaceInput(const wchar_t* text, int position, int lengt
 	if ( text )
 		text_length = wcslen(text);
 	
-	int new_length = _inputLength - length + text_length;
+	// parsing continues at position and nothing before the current char is read 
+	// again, so the text is put directly in front of the remaining input; if 
+	// there is room (always when removing) only the new text has to be copied
+	int end = position + length;
+	if ( text_length<=end )
+	{
+		if ( text_length )
+			memcpy(_pInput + end - text_length, text, text_length*sizeof(wchar_t));
+		
+		_pCurrentInput = _pInput + end - text_length;
+		
+		// the new text has to be split again
+		if ( text_length && _tokens )
+			Tokenize();
+		return;
+	}
+	
+	// the text of ParseInline() belongs to the caller, it can't be exchanged
+	if ( _inlineDepth )
+		return;
+	
+	int new_length = text_length + _inputLength - end;
 	
 	wchar_t* new_input = (wchar_t*) malloc((new_length+1) * sizeof(wchar_t));
-	wcsncpy(new_input, _pInput, position);
-	new_input[position] = 0x0;
-	if ( text )
-		wcscat(new_input, text);
-	wcscat(new_input, _pInput + position + length);
+	memcpy(new_input, text, text_length*sizeof(wchar_t));
+	memcpy(new_input + text_length, _pInput + end, (_inputLength - end + 1)*sizeof(wchar_t));
 
 	free(_pInput);
 	
 	_pInput = new_input;
-	_pCurrentInput = _pInput + position;
+	_pCurrentInput = _pInput;
 	_inputLength = new_length;
+	
+	if ( _tokens )
+		Tokenize();
+}
+
+// splits the input from the current position on into runs of text and the markup chars in one pass,
+// so Parse() doesn't have to look at every char of the text
+void WikiMarkupParser::Tokenize()
+{
+	pthread_once(&charsetsOnce, create_charsets);
+	
+	// the tokens before belong to the text ParseInline() was called from
+	_numberOfTokens = _firstToken;
+	_currentToken = _firstToken;
+	
+	const wchar_t* pos = _pCurrentInput;
+	while ( *pos )
+	{
+		if ( _numberOfTokens==_tokensSize )
+		{
+			_tokensSize = _tokensSize ? _tokensSize*2 : 1024;
+			_tokens = realloc(_tokens, _tokensSize*sizeof(TOKEN));
+		}
+		
+		TOKEN* token = (TOKEN*) _tokens + _numberOfTokens++;
+		token->position = pos - _pInput;
+		
+		if ( is_markup(*pos) )
+		{
+			token->markup = *pos++;
+			token->length = 1;
+		}
+		else
+		{
+			const wchar_t* start = pos;
+			pos = find_first_of(pos, &markupChars);
+			
+			token->markup = 0;
+			token->length = pos - start;
+		}
+	}
+}
+
+// returns the next char Parse() has to handle, text before it is appended right away; the handlers
+// read ahead on their own, so the tokens they've already consumed are skipped
+inline wchar_t WikiMarkupParser::NextToken()
+{
+	TOKEN* tokens = (TOKEN*) _tokens;
+	while ( _currentToken<_numberOfTokens )
+	{
+		TOKEN* token = tokens + _currentToken;
+		
+		wchar_t* end = _pInput + token->position + token->length;
+		if ( end<=_pCurrentInput )
+		{
+			_currentToken++;
+			continue;
+		}
+		
+		// the first char of a line is special, even in a text run
+		if ( token->markup || _newLine )
+			break;
+		
+		Append(_pCurrentInput, end - _pCurrentInput);
+		_pCurrentInput = end;
+		_currentToken++;
+	}
+	
+	return GetNextChar();
 }
 
 inline wchar_t WikiMarkupParser::GetNextChar() 
@@ -350,8 +726,29 @@ wchar_t* WikiMarkupParser::RemoveComments(const wchar_t* src)
 	
 	bool changed = false;
 	
+	pthread_once(&charsetsOnce, create_charsets);
+	
 	while ( (c=*srcCurrent++) )
 	{
+		if ( state==0 && c!='<' )
+		{
+			// copy the text up to the next tag at once
+			const wchar_t* next = find_first_of(srcCurrent, &tagChars);
+			
+			*dstCurrent++ = c;
+			memcpy(dstCurrent, srcCurrent, (next - srcCurrent)*sizeof(wchar_t));
+			dstCurrent += next - srcCurrent;
+			
+			srcCurrent = next;
+			continue;
+		}
+		else if ( state==1 && c!='-' )
+		{
+			// skip the comment up to the next dash
+			srcCurrent = find_first_of(srcCurrent, &dashChars);
+			continue;
+		}
+		
 		switch ( state )
 		{
 			case 0:
@@ -399,6 +796,8 @@ wchar_t* WikiMarkupParser::ExpandTemplates(const wchar_t* src)
 	if ( !src )
 		return NULL;
 	
+	_templateDepth++;
+	
 //	if ( DEBUG )
 //	wprintf(L"---\r\n%S\r\b---", src);	
 
@@ -434,8 +833,17 @@ wchar_t* WikiMarkupParser::ExpandTemplates(const wchar_t* src)
 	
 	bool handledOne = false;
 	
+	pthread_once(&charsetsOnce, create_charsets);
+	
 	while ( (c=*srcCurrent++) )
 	{
+		if ( state==0 && c!='<' && c!='{' )
+		{
+			// plain text, go on with the next char that may start a tag or a template
+			srcCurrent = find_first_of(srcCurrent, &templateChars);
+			continue;
+		}
+		
 		switch ( state )
 		{
 			case 0:
@@ -591,32 +999,46 @@ wchar_t* WikiMarkupParser::ExpandTemplates(const wchar_t* src)
 					if ( DEBUG )
 						wprintf(L"\r\nTemplate:\r\n%S\r\n", templateText);
 									
-					// do something with the template here
-					if ( templateLength )
+					// do something with the template here, unless the budget is used up
+					if ( templateLength && !TemplateBudgetExceeded() )
 					{
-						wchar_t* expandedTemplate = ExpandTemplate(templateText);
-						if ( expandedTemplate )
+						// the same invocation always gives the same result within a page
+						bool found;
+						wchar_t* expandedTemplate = FindExpansion(templateText, &found);
+						if ( !found )
 						{
-							if ( DEBUG )
-								wprintf(L"\r\nExpanded Template:\r\n%S\r\n", expandedTemplate);
-							
-							int size = wcslen(expandedTemplate); 
-							if ( size>4 )
+							expandedTemplate = ExpandTemplate(templateText);
+							if ( expandedTemplate )
 							{
-								wchar_t* help = ExpandTemplates(expandedTemplate);
-								while ( help!=expandedTemplate )
+								if ( DEBUG )
+									wprintf(L"\r\nExpanded Template:\r\n%S\r\n", expandedTemplate);
+								
+								if ( wcslen(expandedTemplate)>4 )
 								{
-									free(expandedTemplate);
-									expandedTemplate = help;
-									
-									if ( expandedTemplate )
-										help = ExpandTemplates(expandedTemplate);
+									wchar_t* help = ExpandTemplates(expandedTemplate);
+									while ( help!=expandedTemplate )
+									{
+										free(expandedTemplate);
+										expandedTemplate = help;
+										
+										if ( expandedTemplate )
+											help = ExpandTemplates(expandedTemplate);
+									}
 								}
-								
-								size = wcslen(expandedTemplate); 
 							}
-													
-							if ( size>0 )
+							
+							// a result cut by the budget isn't kept
+							if ( !_templateBudgetExceeded )
+								AddExpansion(templateText, expandedTemplate);
+						}
+						
+						if ( expandedTemplate )
+						{
+							int size = wcslen(expandedTemplate); 
+							
+							// a template beyond the size budget is dropped
+							_expandedSize += size;
+							if ( size>0 && _expandedSize<=TEMPLATE_MAX_EXPANDED_SIZE )
 							{									
 								if ( DEBUG )
 									wprintf(L"\r\nExpanded Template:\r\n%S\r\n", expandedTemplate);
@@ -685,6 +1107,8 @@ wchar_t* WikiMarkupParser::ExpandTemplates(const wchar_t* src)
 		
 	//	if ( DEBUG )
 	//	wprintf(L"---\r\n%S\r\b---", dst);	
+	
+	_templateDepth--;
 		
 	if ( !handledOne )
 	{
@@ -704,6 +1128,83 @@ wchar_t* WikiMarkupParser::ExpandTemplates(const wchar_t* src)
 	}
 }
 
+bool WikiMarkupParser::TemplateBudgetExceeded()
+{
+	if ( _templateDepth<=TEMPLATE_MAX_DEPTH && _expandedSize<=TEMPLATE_MAX_EXPANDED_SIZE && _templateFetches<=TEMPLATE_MAX_FETCHES )
+		return false;
+	
+	if ( !_templateBudgetExceeded )
+	{
+		_templateBudgetExceeded = true;
+		printf("Template budget exceeded (depth %d, size %d, templates %d), templates are dropped\r\n", _templateDepth, _expandedSize, _templateFetches);
+	}
+	
+	return true;
+}
+
+wchar_t* WikiMarkupParser::FindExpansion(const wchar_t* templateText, bool* found)
+{
+	*found = false;
+	if ( !_expansions )
+		return NULL;
+	
+	unsigned int hash = hash_text(templateText);
+	
+	EXPANSION* expansion = ((EXPANSION**) _expansions)[hash % EXPANSION_SLOTS];
+	while ( expansion )
+	{
+		if ( expansion->hash==hash && !wcscmp(expansion->text, templateText) )
+		{
+			*found = true;
+			return expansion->result ? wstrdup(expansion->result) : NULL;
+		}
+		
+		expansion = expansion->next;
+	}
+	
+	return NULL;
+}
+
+void WikiMarkupParser::AddExpansion(const wchar_t* templateText, const wchar_t* result)
+{
+	if ( !_expansions )
+		_expansions = calloc(EXPANSION_SLOTS, sizeof(EXPANSION*));
+	
+	EXPANSION** slots = (EXPANSION**) _expansions;
+	
+	EXPANSION* expansion = new EXPANSION();
+	expansion->hash = hash_text(templateText);
+	expansion->text = wstrdup(templateText);
+	expansion->result = result ? wstrdup(result) : NULL;
+	expansion->next = slots[expansion->hash % EXPANSION_SLOTS];
+	
+	slots[expansion->hash % EXPANSION_SLOTS] = expansion;
+}
+
+void WikiMarkupParser::FreeExpansions()
+{
+	if ( !_expansions )
+		return;
+	
+	EXPANSION** slots = (EXPANSION**) _expansions;
+	for (int i=0; i<EXPANSION_SLOTS; i++)
+	{
+		while ( slots[i] )
+		{
+			EXPANSION* expansion = slots[i];
+			slots[i] = expansion->next;
+			
+			free(expansion->text);
+			if ( expansion->result )
+				free(expansion->result);
+			delete(expansion);
+		}
+	}
+	
+	free(slots);
+	_expansions = NULL;
+}
+
 wchar_t* WikiMarkupParser::ExpandTemplate(const wchar_t* templateText)
 {
 	if ( !templateText || !*templateText )
@@ -944,11 +1445,19 @@ wchar_t* WikiMarkupParser::ExpandTemplate(const wchar_t* templateText)
 			}
 			
 			// evaluate the expression here
-			DBH Expression(expression);
+			DBH Expr(expression);
+			
+			bool error;
+			wstring value = Expression::Evaluate(expression, &error);
+			if ( error )
+			{
+				// like the ParserFunctions extension the error is shown instead of both values
+				free(expression);
+				return wstrdup(value.c_str());
+			}
 			
-			double result = EvaluateExpression(expression); 
-			if ( result )
-				result = true;
+			// true unless the expression is empty or zero
+			result = !value.empty() && value!=L"0";
 		}
 		free(expression);
 		
@@ -994,13 +1503,6 @@ wchar_t* WikiMarkupParser::ExpandTemplate(const wchar_t* templateText)
 	}
 	else if ( wcsstr(templateName, L"#expr:")==templateName ) 
 	{		
-		if ( !*pos  ) 
-		{
-			// that is an if but it has no true-condition, hence also no false, so quit
-			if ( !*pos )
-				return NULL;
-		}
-		
 		DBH Name(templateText);
 		
 		if ( templateName[6] )
@@ -1019,12 +1521,16 @@ wchar_t* WikiMarkupParser::ExpandTemplate(const wchar_t* templateText)
 			}
 			
 			// evaluate the expression here
-			DBH Expression(expression);
+			DBH Expr(expression);
 			
-			wchar_t result[256];
-			swprintf(result, 256, L"%g", EvaluateExpression(expression));
+			bool error;
+			wstring result = Expression::Evaluate(expression, &error);
 			free(expression);
-			return wstrdup(result);
+			
+			if ( result.empty() )
+				return NULL;
+			
+			return wstrdup(result.c_str());
 		}
 
 		return NULL;
@@ -1291,6 +1797,10 @@ wchar_t* WikiMarkupParser::ExpandTemplate(const wchar_t* templateText)
 	}
 	
 	// Let's try to get the template
+	_templateFetches++;
+	if ( TemplateBudgetExceeded() )
+		return NULL;
+	
 	WikiMarkupGetter wikiMarkupGetter(CPPStringUtils::to_string(_languageCodeW));
 	
 	string templatePrefix = _titleIndex->TemplateNamespace();
@@ -1298,15 +1808,23 @@ wchar_t* WikiMarkupParser::ExpandTemplate(const wchar_t* templateText)
 		templatePrefix = _languageConfig->GetSetting("templatePrefix", "Template:");
 	else
 		templatePrefix += ":";
-	wstring wikiTemplate = wikiMarkupGetter.GetTemplate(CPPStringUtils::to_utf8(templateName), templatePrefix);
+	int* parameters;
+	int numberOfParameters;
+	wstring wikiTemplate = wikiMarkupGetter.GetTemplate(CPPStringUtils::to_utf8(templateName), templatePrefix, &parameters, &numberOfParameters);
 	
 	// if ( DEBUG )
 	//	wprintf(L"\r\nGot template:\r\n%S\r\n", wikiTemplate.c_str());	
 	
-	if ( wikiTemplate==L"-" )
-		return NotHandledText(templateName);
-	else if ( wikiTemplate== L"{{" + wstring(templateName) + L"}}" )
+	if ( wikiTemplate==L"-" || wikiTemplate== L"{{" + wstring(templateName) + L"}}" )
+	{
+		if ( parameters )
+			free(parameters);
+		
+		if ( wikiTemplate==L"-" )
+			return NotHandledText(templateName);
+		
 		return NULL; // prevents recursion:
+	}
 
 	TEMPLATEPARAM* params = NULL;
 	
@@ -1447,85 +1965,14 @@ wchar_t* WikiMarkupParser::ExpandTemplate(const wchar_t* templateText)
 	}
 	free(templateParameters);
 		
-	// so we have the template, lets parse out all the params
-	size_t start = 0;
-	while ( (start=wikiTemplate.find(L"{{{", start))!=string::npos )
-	{
-		start += 3;
-		
-		// replace params from inside to outside
-		while (wikiTemplate[start]==L'{')
-			start++;
-		
-		int end = start;
-		int length = wikiTemplate.length();
-		int braketCount = 3;
-		
-		while ( braketCount && end<length )
-		{
-			wchar_t c = wikiTemplate[end];
-			
-			if ( c=='{' )
-				braketCount++;
-			else if ( c=='}' )
-				braketCount--;
-			
-			// we're on the way out but we don't see enought brakets
-			if ( (braketCount<3) && c!=L'}' )
-				break;
-			
-			end++;
-		}
-		
-		if ( braketCount ) 
-		{
-			// this is an error, skip that section
-			start = end;
-			continue;
-		}
-		
-		length = end - start - 3;
-		wstring paramName = CPPStringUtils::trim(wikiTemplate.substr(start, length));
-		
-		wstring paramValue = wstring();
-		wstring alternateValue = wstring();
-		
-		size_t spliterPos = 0;
-		if ( (spliterPos=paramName.find(L"|"))!=string::npos ) 
-		{
-			// try to find the optional string
-			alternateValue = paramName.substr(spliterPos+1);
-			paramName = CPPStringUtils::trim(paramName.substr(0, spliterPos));
-		}
-		
-		for (int i=0; i<paramCount; i++)
-		{
-			if ( listOfParams[i]->name==paramName ) 
-			{
-				paramValue = wstring(listOfParams[i]->value);
-				break;
-			}
-			else if ( listOfParams[i]->position==paramName ) 
-			{
-				paramValue = wstring(listOfParams[i]->value);
-				break;
-			}
-		}
-				
-		if ( paramValue.empty() )
-			paramValue = alternateValue;
-		
-		if ( paramValue.empty() ) 
-		{
-			wikiTemplate.erase(start-3, length+6);
-			start = start - 3;
-		}
-		else
-		{
-			wikiTemplate.replace(start-3, length+6, paramValue, 0, paramValue.length());
-			start = start - 3;
-		}
-	}
+	// so we have the template, lets fill in the params
+	wstring result = wstring();
+	substitute_parameters(result, wikiTemplate, parameters, numberOfParameters, listOfParams, paramCount, 0);
+	wikiTemplate.swap(result);
+	
+	if ( parameters )
+		free(parameters);
+	
 	// wprintf(L"Result:\n%S\n", wikiTemplate.c_str());
 	
 	// cleanup
@@ -1758,7 +2205,7 @@ wchar_t* WikiMarkupParser::HandleKnownTemplatesAndVariables(const wchar_t* text)
 	
 	else if ( !wcscmp(text, L"CURRENTDAY") || !wcscmp(text, L"LOCALDAY") ) 
 	{
-		time_t t; time(&t); struct tm* lt; lt = localtime(&t);
+		time_t t; time(&t); struct tm tm; struct tm* lt = localtime_r(&t, &tm);
 		
 		wchar_t buffer[16];
 		swprintf(buffer, 16, L"%i", lt->tm_mday);
@@ -1766,7 +2213,7 @@ wchar_t* WikiMarkupParser::HandleKnownTemplatesAndVariables(const wchar_t* text)
 	}
 	else if ( !wcscmp(text, L"CURRENTDAY2") || !wcscmp(text, L"LOCALDAY2") ) 
 	{
-		time_t t; time(&t); struct tm* lt; lt = localtime(&t);
+		time_t t; time(&t); struct tm tm; struct tm* lt = localtime_r(&t, &tm);
 		
 		wchar_t buffer[16];
 		swprintf(buffer, 16, L"%02i", lt->tm_mday);
@@ -1774,13 +2221,13 @@ wchar_t* WikiMarkupParser::HandleKnownTemplatesAndVariables(const wchar_t* text)
 	}
 	else if ( !wcscmp(text, L"CURRENTDAYNAME") || !wcscmp(text, L"LOCALDAYNAME") ) 
 	{
-		time_t t; time(&t); struct tm* lt; lt = localtime(&t);
+		time_t t; time(&t); struct tm tm; struct tm* lt = localtime_r(&t, &tm);
 		
 		return wstrdup(DayName(lt->tm_wday).c_str());
 	}
 	else if ( !wcscmp(text, L"CURRENTDOW") || !wcscmp(text, L"LOCALDOW") ) 
 	{
-		time_t t; time(&t); struct tm* lt; lt = localtime(&t);
+		time_t t; time(&t); struct tm tm; struct tm* lt = localtime_r(&t, &tm);
 		
 		wchar_t buffer[16];
 		swprintf(buffer, 16, L"%i", lt->tm_wday);
@@ -1788,7 +2235,7 @@ wchar_t* WikiMarkupParser::HandleKnownTemplatesAndVariables(const wchar_t* text)
 	}
 	else if ( !wcscmp(text, L"CURRENTMONTH") ||  !wcscmp(text, L"LOCALMONTH") ) 
 	{
-		time_t t; time(&t); struct tm* lt; lt = localtime(&t);
+		time_t t; time(&t); struct tm tm; struct tm* lt = localtime_r(&t, &tm);
 		
 		wchar_t buffer[16];
 		swprintf(buffer, 16, L"%02i", lt->tm_mon + 1);
@@ -1796,19 +2243,19 @@ wchar_t* WikiMarkupParser::HandleKnownTemplatesAndVariables(const wchar_t* text)
 	}
 	else if ( !wcscmp(text, L"CURRENTMONTHABBREV") || !wcscmp(text, L"LOCALMONTHABBREV") ) 
 	{
-		time_t t; time(&t); struct tm* lt; lt = localtime(&t);
+		time_t t; time(&t); struct tm tm; struct tm* lt = localtime_r(&t, &tm);
 		
 		return wstrdup(AbbrMonthName(lt->tm_mon).c_str());
 	}
 	else if ( !wcscmp(text, L"CURRENTMONTHNAME") || !wcscmp(text, L"CURRENTMONTHNAMEGEN") || !wcscmp(text, L"LOCALMONTHNAME") || !wcscmp(text, L"LOCALMONTHNAMEGEN") ) 
 	{
-		time_t t; time(&t); struct tm* lt; lt = localtime(&t);
+		time_t t; time(&t); struct tm tm; struct tm* lt = localtime_r(&t, &tm);
 		
 		return wstrdup(MonthName(lt->tm_mon).c_str());
 	}
 	else if ( !wcscmp(text, L"CURRENTTIME") || !wcscmp(text, L"LOCALTIME") ) 
 	{
-		time_t t; time(&t); struct tm* lt; lt = localtime(&t);
+		time_t t; time(&t); struct tm tm; struct tm* lt = localtime_r(&t, &tm);
 		
 		wchar_t buffer[16];
 		swprintf(buffer, 16, L"%02i:%02i", lt->tm_hour, lt->tm_min);
@@ -1816,7 +2263,7 @@ wchar_t* WikiMarkupParser::HandleKnownTemplatesAndVariables(const wchar_t* text)
 	}
 	else if ( !wcscmp(text, L"CURRENTHOUR") || !wcscmp(text, L"LOCALHOUR") ) 
 	{
-		time_t t; time(&t); struct tm* lt; lt = localtime(&t);
+		time_t t; time(&t); struct tm tm; struct tm* lt = localtime_r(&t, &tm);
 		
 		wchar_t buffer[16];
 		swprintf(buffer, 16, L"%02i", lt->tm_hour);
@@ -1824,7 +2271,7 @@ wchar_t* WikiMarkupParser::HandleKnownTemplatesAndVariables(const wchar_t* text)
 	}
 	else if ( !wcscmp(text, L"CURRENTMINUTE") || !wcscmp(text, L"LOCALMINUTE") ) 
 	{
-		time_t t; time(&t); struct tm* lt; lt = localtime(&t);
+		time_t t; time(&t); struct tm tm; struct tm* lt = localtime_r(&t, &tm);
 		
 		wchar_t buffer[16];
 		swprintf(buffer, 16, L"%02i", lt->tm_min);
@@ -1832,7 +2279,7 @@ wchar_t* WikiMarkupParser::HandleKnownTemplatesAndVariables(const wchar_t* text)
 	}
 	else if ( !wcscmp(text, L"CURRENTWEEK") || !wcscmp(text, L"LOCALWEEK") ) 
 	{
-		time_t t; time(&t); struct tm* lt; lt = localtime(&t);
+		time_t t; time(&t); struct tm tm; struct tm* lt = localtime_r(&t, &tm);
 
 		wchar_t buffer[16];
 		swprintf(buffer, 16, L"%i", lt->tm_yday/7 + 1);
@@ -1840,7 +2287,7 @@ wchar_t* WikiMarkupParser::HandleKnownTemplatesAndVariables(const wchar_t* text)
 	}
 	else if ( !wcscmp(text, L"CURRENTYEAR") || !wcscmp(text, L"LOCALYEAR") ) 
 	{
-		time_t t; time(&t); struct tm* lt; lt = localtime(&t);
+		time_t t; time(&t); struct tm tm; struct tm* lt = localtime_r(&t, &tm);
 		
 		wchar_t buffer[16];
 		swprintf(buffer, 16, L"%04i", lt->tm_year + 1900);
@@ -1848,7 +2295,7 @@ wchar_t* WikiMarkupParser::HandleKnownTemplatesAndVariables(const wchar_t* text)
 	}
 	else if ( !wcscmp(text, L"CURRENTTIMESTAMP") || !wcscmp(text, L"LOCALTIMESTAMP") ) 
 	{
-		time_t t; time(&t); struct tm* lt; lt = localtime(&t);
+		time_t t; time(&t); struct tm tm; struct tm* lt = localtime_r(&t, &tm);
 		
 		wchar_t buffer[16];
 		swprintf(buffer, 16, L"%04i%02i%02i%02i%02i%02i", lt->tm_year + 1900, lt->tm_mon, lt->tm_mday, lt->tm_hour, lt->tm_min, lt->tm_sec);
@@ -2047,26 +2494,25 @@ wchar_t* WikiMarkupParser::GetTextInDoubleBrakets(wchar_t startBraket, wchar_t e
 	GetNextChar();
 	
 	int braketCount = 2;
-	int count = 0;
-	while ( c=Peek(count) )
+	const wchar_t* pos = _pCurrentInput;
+	while ( (c=*pos) )
 	{
 		if ( c==startBraket )
 			braketCount++;
 		else if ( c==endBraket ) {
 			braketCount--;
-			if ( braketCount==1 && Peek(count+1)==endBraket )
+			if ( braketCount==1 && pos[1]==endBraket )
 				break;
 		}
 		
-		count++;
+		pos++;
 	}
 	
+	int count = pos - _pCurrentInput;
 	text = (wchar_t*) malloc((count+1) * sizeof(wchar_t));
-	wchar_t* pText = text;
-		
-	while (count--)
-		*pText++ = GetNextChar();
-	*pText = 0x0;
+	memcpy(text, _pCurrentInput, count*sizeof(wchar_t));
+	text[count] = 0x0;
+	_pCurrentInput += count;
 
 	// skip the last two closing brakets
 	GetNextChar();
@@ -2082,8 +2528,8 @@ wchar_t* WikiMarkupParser::GetTextInSingleBrakets(wchar_t startBraket, wchar_t e
 	
 	wchar_t c;
 	int braketCount = 1;
-	int count = 0;
-	while ( c=Peek(count) )
+	const wchar_t* pos = _pCurrentInput;
+	while ( (c=*pos) )
 	{
 		if ( c==startBraket )
 			braketCount++;
@@ -2093,15 +2539,14 @@ wchar_t* WikiMarkupParser::GetTextInSingleBrakets(wchar_t startBraket, wchar_t e
 				break;
 		}
 		
-		count++;
+		pos++;
 	}
 	
+	int count = pos - _pCurrentInput;
 	wchar_t* text = (wchar_t*) malloc((count+1) * sizeof(wchar_t));
-	wchar_t* pText = text;
-	
-	while (count--)
-		*pText++ = GetNextChar();
-	*pText = 0x0;
+	memcpy(text, _pCurrentInput, count*sizeof(wchar_t));
+	text[count] = 0x0;
+	_pCurrentInput += count;
 	
 	// skip the last closing brakets
 	GetNextChar();
@@ -2111,22 +2556,15 @@ wchar_t* WikiMarkupParser::GetTextInSingleBrakets(wchar_t startBraket, wchar_t e
 
 wchar_t* WikiMarkupParser::GetNextLine()
 {
-	int count = 0;
-	wchar_t c;
-	while ( c=Peek(count) )
-	{
-		if ( c=='\n' )
-			break;
-		
-		count++;
-	}
+	const wchar_t* pos = _pCurrentInput;
+	while ( *pos && *pos!='\n' )
+		pos++;
 	
+	int count = pos - _pCurrentInput;
 	wchar_t* line = (wchar_t*) malloc((count+1)*sizeof(wchar_t));
-	wchar_t* pLine = line;
-	
-	while ( count-- )
-		*pLine++ = GetNextChar();
-	*pLine = 0x0;
+	memcpy(line, _pCurrentInput, count*sizeof(wchar_t));
+	line[count] = 0x0;
+	_pCurrentInput += count;
 	
 	// This is the line feed
 	Eat(1);
@@ -2222,35 +2660,95 @@ bool WikiMarkupParser::GetPixelUnit(wchar_t* src, int* width, int* height)
 	return true;
 }
 
-inline void WikiMarkupParser::Append(wchar_t c) 
+void WikiMarkupParser::ReserveOutput(int length)
 {
-	if ( _iOutputRemain==0 ) {
-		if ( _iOutputSize==0 ) {
-			_iOutputSize = OUTPUT_GROWS;
-			_pOutput = (wchar_t*) malloc( (_iOutputSize+1)*sizeof(wchar_t) );
+	if ( _pOutput!=NULL && _iOutputRemain>=length )
+		return;
+	
+	int used = _pCurrentOutput - _pOutput;
+	
+	if ( _pOutput==NULL )
+	{
+		// take over the buffer released last in this thread
+		OUTPUTBUFFER* outputBuffer = thread_output_buffer();
+		if ( outputBuffer->data && outputBuffer->size>=length )
+		{
+			_pOutput = outputBuffer->data;
+			_iOutputSize = outputBuffer->size;
 			
-			_pCurrentOutput = _pOutput;
-			_iOutputRemain = _iOutputSize;
+			outputBuffer->data = NULL;
+			outputBuffer->size = 0;
 		}
-		else {
-			_pOutput = (wchar_t*) realloc(_pOutput, (_iOutputSize+OUTPUT_GROWS+1)*sizeof(wchar_t) );
-			_pCurrentOutput = (_pOutput+_iOutputSize);
-			_iOutputSize += OUTPUT_GROWS;
-			_iOutputRemain = OUTPUT_GROWS;
+		else
+		{
+			_iOutputSize = length>OUTPUT_GROWS ? length : OUTPUT_GROWS;
+			_pOutput = (wchar_t*) malloc( (_iOutputSize+1)*sizeof(wchar_t) );
 		}
+		
+		used = 0;
 	}
+	else
+	{
+		// grow geometrically, the buffer is copied only log(n) times
+		int size = _iOutputSize*2;
+		if ( size<used+length )
+			size = used+length;
+		
+		_pOutput = (wchar_t*) realloc(_pOutput, (size+1)*sizeof(wchar_t) );
+		_iOutputSize = size;
+	}
+	
+	_pCurrentOutput = _pOutput + used;
+	_iOutputRemain = _iOutputSize - used;
+}
+
+void WikiMarkupParser::ReleaseOutput()
+{
+	if ( _pOutput==NULL )
+		return;
+	
+	OUTPUTBUFFER* outputBuffer = thread_output_buffer();
+	if ( _iOutputSize<=OUTPUT_KEEP && _iOutputSize>outputBuffer->size )
+	{
+		if ( outputBuffer->data )
+			free(outputBuffer->data);
+		
+		outputBuffer->data = _pOutput;
+		outputBuffer->size = _iOutputSize;
+	}
+	else
+		free(_pOutput);
+	
+	_pOutput = NULL;
+	_pCurrentOutput = NULL;
+	_iOutputSize = 0;
+	_iOutputRemain = 0;
+}
+
+inline void WikiMarkupParser::Append(wchar_t c) 
+{
+	if ( _iOutputRemain==0 )
+		ReserveOutput(1);
 	
 	*_pCurrentOutput++ = c;
-	*_pCurrentOutput = 0x0;
 	_iOutputRemain--;
 }
 
+void WikiMarkupParser::Append(const wchar_t* msg, int length) 
+{
+	if ( _iOutputRemain<length )
+		ReserveOutput(length);
+	
+	memcpy(_pCurrentOutput, msg, length*sizeof(wchar_t));
+	_pCurrentOutput += length;
+	_iOutputRemain -= length;
+}
+
 void WikiMarkupParser::Append(const wchar_t* msg) {
 	if ( msg==NULL )
 		return;
 		
-	while(*msg!=0x0)
-		Append(*msg++);
+	Append(msg, wcslen(msg));
 }
 
 void WikiMarkupParser::AppendHtml(const wchar_t* html) 
@@ -2258,15 +2756,19 @@ void WikiMarkupParser::AppendHtml(const wchar_t* html)
 	if ( html==NULL )
 		return;
 	
-	while(*html!=0x0)
-		Append(*html++);
+	Append(html, wcslen(html));
 }
 
-void WikiMarkupParser::PushTag(wchar_t* name, bool output)
+// the name isn't copied, the tags are constants
+void WikiMarkupParser::PushTag(const wchar_t* name, bool output)
 {
-	tagType* newTag = new tagType;
-	newTag->name = (wchar_t*) malloc( (wcslen(name)+1)*sizeof(wchar_t) );
-	wcscpy(newTag->name, name);
+	tagType* newTag = _unusedTags;
+	if ( newTag )
+		_unusedTags = newTag->pPrevious;
+	else
+		newTag = new tagType;
+	
+	newTag->name = name;
 	newTag->position = _pCurrentOutput - _pOutput;
 	 
 	newTag->pPrevious = _pCurrentTag;
@@ -2284,7 +2786,7 @@ void WikiMarkupParser::PushTag(wchar_t* name, bool output)
 	}
 }
 
-void WikiMarkupParser::PopTag(wchar_t* name, bool output) 
+void WikiMarkupParser::PopTag(const wchar_t* name, bool output) 
 {
 	if ( _pCurrentTag==NULL ) {
 		return;
@@ -2301,8 +2803,8 @@ void WikiMarkupParser::PopTag(wchar_t* name, bool output)
 	if ( _pCurrentTag!=NULL ) 
 		_pCurrentTag->pNext = NULL;
 	
-	free(oldTag->name);
-	delete(oldTag);
+	oldTag->pPrevious = _unusedTags;
+	_unusedTags = oldTag;
 	
 	if ( output )
 	{ 
@@ -2340,7 +2842,7 @@ void WikiMarkupParser::HandleParagraph()
 
 void WikiMarkupParser::HandleInternalLink(const wchar_t* linkText)
 {
-	bool valid = true;
+	bool check = false;
 	
 	if ( linkText==NULL )
 		return;
@@ -2613,13 +3115,7 @@ void WikiMarkupParser::HandleInternalLink(const wchar_t* linkText)
 				Append(buffer);
 				
 				if ( *imageDescription ) 
-				{
-					WikiMarkupParser wikiMarkupParser(_languageCodeW, _pageName, false);
-					wikiMarkupParser.SetInput(imageDescription);
-					wikiMarkupParser.Parse();
-					
-					AppendHtml(wikiMarkupParser.GetOutput());
-				}
+					ParseInline(imageDescription);
 				
 				Append(L"</div>\r\n</div>\r\n</div>\r\n");
 
@@ -2687,30 +3183,12 @@ void WikiMarkupParser::HandleInternalLink(const wchar_t* linkText)
 	}
 	else
 	{
-		/*
-		TitleIndex* titleIndex = __settings->GetTitleIndex(CPPStringUtils::to_string(_languageCodeW));
-		ArticleSearchResult* articleSearchResult = titleIndex->FindArticle(CPPStringUtils::to_utf8(wstring(link)), false);
-																		   
-		if ( articleSearchResult )
-			titleIndex->DeleteSearchResult(articleSearchResult);
-		else
-			valid = false; 
-		*/
-		
-		/*
-		 that takes to long, a binary search should be a lot faster
-		WikiMarkupGetter wikiMarkupGetter;
-		string name = wikiMarkupGetter.FindArticle(CPPStringUtils::to_utf8(wstring(link)));
-		valid = !name.empty();
-		 */
+		// all links of the page are checked at once when the parsing is done
+		check = true;
 	}
 	
 	if ( link!=linkDescription ) 
 	{		
-		WikiMarkupParser wikiMarkupParser(_languageCodeW, _pageName, false);
-		wikiMarkupParser.SetInput(linkDescription);
-		wikiMarkupParser.Parse();
-
 		Append(L"<a href=\"");
 
 		if ( hasPrefix )
@@ -2725,11 +3203,11 @@ void WikiMarkupParser::HandleInternalLink(const wchar_t* linkText)
 		 */
 		Append(pLink);
 		
-		if ( valid )
-			Append(L"\" class=\"wkInternalLink\">");
-		else
-			Append(L"\" class=\"wkInternalLinkNotExisting\">");			
-		AppendHtml(wikiMarkupParser.GetOutput());
+		Append(L"\" class=\"wkInternalLink");
+		if ( check )
+			AddLinkToCheck(link);
+		Append(L"\">");
+		ParseInline(linkDescription);
 
 		// ok, ok, if bold/italic is set this fails
 		while ( isintalpha(Peek()) ) 
@@ -2752,10 +3230,10 @@ void WikiMarkupParser::HandleInternalLink(const wchar_t* linkText)
 		}
 		 */
 		Append(pLink);
-		if ( valid )
-			Append(L"\" class=\"wkInternalLink\">");
-		else
-			Append(L"\" class=\"wkInternalLinkNotExisting\">");			
+		Append(L"\" class=\"wkInternalLink");
+		if ( check )
+			AddLinkToCheck(link);
+		Append(L"\">");
 		Append(link);
 
 		DBH Test (link);
@@ -2778,10 +3256,6 @@ void WikiMarkupParser::HandleExternalLink(const wchar_t* linkText)
 	{
 		*linkDescription++ = 0x0;
 
-		WikiMarkupParser wikiMarkupParser(_languageCodeW, _pageName, false);
-		wikiMarkupParser.SetInput(linkDescription);
-		wikiMarkupParser.Parse();
-
 		Append(L"<a href=\"");
 		Append(link);
 		Append(L"\" class=\"wkExternalLink external\" target=\"_blank\">");
@@ -2804,17 +3278,13 @@ void WikiMarkupParser::HandleExternalLink(const wchar_t* linkText)
 	free(link);
 }
 
-void WikiMarkupParser::HandleHeadline(const wchar_t* headlineText, int level)
+void WikiMarkupParser::HandleHeadline(wchar_t* headlineText, int level)
 {
 	CloseOpenWikiTags();
 
 	if ( _tocPosition<0 )
 		_tocPosition = (_pCurrentOutput - _pOutput);
 	
-	WikiMarkupParser wikiMarkupParser(_languageCodeW, _pageName, false);
-	wikiMarkupParser.SetInput(headlineText);
-	wikiMarkupParser.Parse();
-	
 	// create a TOC entry
 	TOC* toc = new TOC();
 	toc->name = wstrdup(headlineText);
@@ -2851,7 +3321,7 @@ void WikiMarkupParser::HandleHeadline(const wchar_t* headlineText, int level)
 	Append(L" class=\"wkHeadline wkHeadline");
 	Append(buffer);
 	Append(L"\">");
-	AppendHtml(wikiMarkupParser.GetOutput());
+	ParseInline(headlineText);
 	Append(L"</H");
 	Append(buffer);
 	Append(L">");
@@ -2914,6 +3384,14 @@ void WikiMarkupParser::Parse()
 	// StopWatch("Parsing");
 	if ( _doExpandTemplates )
 	{		
+		_templateDepth = 0;
+		_expandedSize = 0;
+		_templateFetches = 0;
+		_templateBudgetExceeded = false;
+		
+		// the results of an earlier Parse() are not reused
+		FreeExpansions();
+		
 		// wprintf(L"%S\r\n", _pInput);
 
 		wchar_t* newInput = ExpandTemplates(_pInput);
@@ -2931,13 +3409,153 @@ void WikiMarkupParser::Parse()
 	}
 	
 	_pCurrentInput = _pInput;
+	Tokenize();
 	
 	_pCurrentOutput = _pOutput;
 	_iOutputRemain = _iOutputSize;
+	
+	_flushedLength = 0;
+	_tocPlaceholder = false;
+	
+	Render();
+	CheckLinks();
+	
+	// the stream is only used by this Parse()
+	FlushOutput(true);
+	_outputStream = NULL;
+	
+	FreePageLists();
+}
+
+void WikiMarkupParser::ParseInline(wchar_t* text, int length)
+{
+	if ( !text )
+		return;
+	
+	if ( length<0 )
+		length = wcslen(text);
+	
+	// the text gets a fresh state (as if it was a page of its own), the one of the
+	// current text is restored afterwards; only the links are checked with the page
+	INLINEFRAME frame;
+	
+	frame.input = _pInput;
+	frame.currentInput = _pCurrentInput;
+	frame.inputLength = _inputLength;
+	
+	frame.firstToken = _firstToken;
+	frame.numberOfTokens = _numberOfTokens;
+	frame.currentToken = _currentToken;
+	
+	frame.newLine = _newLine;
+	frame.orderedEnumeration = _orderedEnumeration;
+	frame.unorderedEnumeration = _unorderedEnumeration;
+	frame.definitionList = _definitionList;
+	frame.italic = _italic;
+	frame.bold = _bold;
+	frame.externalLinkNo = _externalLinkNo;
+	frame.stop = _stop;
+	
+	frame.currentTag = _pCurrentTag;
+	
+	frame.tocPosition = _tocPosition;
+	frame.noToc = _noToc;
+	frame.forceToc = _forceToc;
+	
+	frame.toc = _toc;
+	frame.references = _references;
+	frame.categories = _categories;
+	
+	// the text may be a part of the input of the page (a reference), it's cut off there
+	wchar_t end = text[length];
+	text[length] = 0x0;
+	
+	_pInput = text;
+	_pCurrentInput = text;
+	_inputLength = copy_input(text, text);
+	
+	_firstToken = _numberOfTokens;
+	Tokenize();
+	
+	_pCurrentTag = NULL;
+	_toc = NULL;
+	_references = NULL;
+	_categories = NULL;
+	
+	_inlineDepth++;
+	Render();
+	_inlineDepth--;
+	
+	// the toc of the current text is created at its end, so _tocHtml is only used by the inline text
+	if ( !_tocHtml.empty() )
+	{
+		// a separate output would have got the toc when it is requested
+		int tocLength = _tocHtml.length();
+		ReserveOutput(tocLength);
+		
+		wchar_t* at = _pOutput + _tocPosition;
+		memmove(at + tocLength, at, (_pCurrentOutput - at)*sizeof(wchar_t));
+		memcpy(at, _tocHtml.c_str(), tocLength*sizeof(wchar_t));
+		
+		_pCurrentOutput += tocLength;
+		_iOutputRemain -= tocLength;
+		
+		for (LINK* link=(LINK*) _links; link; link=link->next)
+		{
+			if ( link->position>=_tocPosition )
+				link->position += tocLength;
+		}
+		
+		_tocHtml.clear();
+	}
+	
+	FreePageLists();
+	
+	while ( _pCurrentTag )
+	{
+		tagType* tag = _pCurrentTag;
+		_pCurrentTag = tag->pPrevious;
+		
+		tag->pPrevious = _unusedTags;
+		_unusedTags = tag;
+	}
+	
+	text[length] = end;
+	
+	_pInput = frame.input;
+	_pCurrentInput = frame.currentInput;
+	_inputLength = frame.inputLength;
+	
+	_firstToken = frame.firstToken;
+	_numberOfTokens = frame.numberOfTokens;
+	_currentToken = frame.currentToken;
+	
+	_newLine = frame.newLine;
+	_orderedEnumeration = frame.orderedEnumeration;
+	_unorderedEnumeration = frame.unorderedEnumeration;
+	_definitionList = frame.definitionList;
+	_italic = frame.italic;
+	_bold = frame.bold;
+	_externalLinkNo = frame.externalLinkNo;
+	_stop = frame.stop;
+	
+	_pCurrentTag = frame.currentTag;
+	
+	_tocPosition = frame.tocPosition;
+	_noToc = frame.noToc;
+	_forceToc = frame.forceToc;
+	
+	_toc = frame.toc;
+	_references = frame.references;
+	_categories = frame.categories;
+}
 
+void WikiMarkupParser::Render()
+{
 	_newLine = 1;
 	
 	_tocPosition = -1;
+	_tocHtml.clear();
 	_noToc = false;
 	_forceToc = false;
 	
@@ -2953,9 +3571,13 @@ void WikiMarkupParser::Parse()
 	_stop = false;
 		
 	wchar_t c;
-	while ( (c=GetNextChar())!=0x0 ) 
+	while ( (c=NextToken())!=0x0 ) 
 	{
 		bool handled = false;
+		
+		// the page is sent while it is rendered, an inline text is sent as a part of it
+		if ( _outputStream && !_inlineDepth && (_pCurrentOutput - _pOutput) - _flushedLength>=OUTPUT_FLUSH_SIZE )
+			FlushOutput();
 	
 		if ( _newLine ) 
 		{
@@ -3790,7 +4412,10 @@ void WikiMarkupParser::Parse()
 	Append(L"\r\n");
 	
 	InsertToc();
-	
+}
+
+void WikiMarkupParser::FreePageLists()
+{
 	// clean the toc
 	while ( _toc )
 	{
@@ -4043,20 +4668,101 @@ void WikiMarkupParser::InsertToc()
 	if ( count<=3 && !_forceToc )
 		return;
 	
-	int length = wcslen(_pOutput) + toc.length();
-	wchar_t* dst = (wchar_t*) malloc((length+1)*sizeof(wchar_t));
+	// inserted when the output is requested, so the output isn't copied now
+	_tocHtml = toc;
+}
+
+void WikiMarkupParser::AddLinkToCheck(const wchar_t* link)
+{
+	if ( !_titleIndex || !__settings->CheckLinks() )
+		return;
+	
+	// the title without the anchor, like the browser requests it
+	wstring title = wstring(link);
+	
+	size_t pos = title.find(L"#");
+	if ( pos!=string::npos )
+		title = title.substr(0, pos);
+	
+	while ( (pos=title.find(L"_"))!=string::npos )
+		title.replace(pos, 1, L" ", 1);
+	
+	title = CPPStringUtils::trim(title);
+	if ( title.empty() )
+		return;
+	
+	// this is where "NotExisting" is inserted into the class name
+	LINK* newLink = new LINK();
+	newLink->position = _pCurrentOutput - _pOutput;
+	newLink->title = CPPStringUtils::to_utf8(title);
+	newLink->next = (LINK*) _links;
 	
-	wcsncpy(dst, _pOutput, _tocPosition);
-	*(dst+_tocPosition) = 0x0;
-	wcscat(dst, toc.c_str());
-	wcscat(dst, (_pOutput+_tocPosition));
+	_links = newLink;
+}
 
-	free(_pOutput);
-	_pOutput = dst;
-	_iOutputSize = wcslen(_pOutput);
-	_iOutputRemain = 0;
+void WikiMarkupParser::CheckLinks()
+{
+	if ( !_links )
+		return;
+	
+	int count = 0;
+	for (LINK* link=(LINK*) _links; link; link=link->next)
+		count++;
+	
+	string* titles = new string[count];
+	bool* exists = new bool[count];
+	int* positions = new int[count];
+	
+	// the list has the last link first
+	int i = 0;
+	while ( _links )
+	{
+		LINK* link = (LINK*) _links;
+		_links = link->next;
+		
+		titles[i] = link->title;
+		positions[i] = link->position;
+		i++;
+		
+		delete(link);
+	}
 	
-	_pCurrentOutput = _pOutput + _iOutputSize;
+	int missing = count - _titleIndex->ArticlesExist(titles, count, exists);
+	if ( missing )
+	{
+		const wchar_t* suffix = L"NotExisting";
+		int suffixLength = wcslen(suffix);
+		
+		ReserveOutput(missing*suffixLength);
+		
+		// move the output behind every missing link once, starting at the end
+		wchar_t* end = _pCurrentOutput;
+		int shift = missing*suffixLength;
+		
+		for (i=0; i<count; i++)
+		{
+			if ( exists[i] )
+				continue;
+			
+			wchar_t* at = _pOutput + positions[i];
+			memmove(at + shift, at, (end - at)*sizeof(wchar_t));
+			
+			shift -= suffixLength;
+			memcpy(at + shift, suffix, suffixLength*sizeof(wchar_t));
+			
+			end = at;
+			
+			if ( positions[i]<_tocPosition )
+				_tocPosition += suffixLength;
+		}
+		
+		_pCurrentOutput += missing*suffixLength;
+		_iOutputRemain -= missing*suffixLength;
+	}
+	
+	delete[] titles;
+	delete[] exists;
+	delete[] positions;
 }
 
 void WikiMarkupParser::InsertReferences()
@@ -4078,15 +4784,7 @@ void WikiMarkupParser::InsertReferences()
 		Append(number);
 		Append(L"\">&uarr;</a>&nbsp;");
 		
-		WikiMarkupParser wikiMarkupParser(_languageCodeW, _pageName, false);
-		
-		wchar_t reftext[ref->length+1];
-		wcsncpy(reftext, ref->start, ref->length);
-		reftext[ref->length] = 0x0;
-
-		wikiMarkupParser.SetInput(reftext);
-		wikiMarkupParser.Parse();
-		AppendHtml(wikiMarkupParser.GetOutput());
+		ParseInline(ref->start, ref->length);
 		
 		Append(L"</li>");
 		
@@ -25,8 +25,17 @@
 
 #include "ConfigFile.h"
 
+// the budget of a single render, templates beyond it are dropped: the nesting of template
+// expansions, the number of characters inserted by templates and the number of templates fetched
+#define TEMPLATE_MAX_DEPTH			40
+#define TEMPLATE_MAX_EXPANDED_SIZE	(2*1024*1024)
+#define TEMPLATE_MAX_FETCHES		500
+
+// with an output stream the rendered chars are written whenever this many are waiting
+#define OUTPUT_FLUSH_SIZE			16384
+
 struct tagType {
-	wchar_t* name;
+	const wchar_t* name;
 	int position;
 	tagType *pPrevious;
 	tagType *pNext;
@@ -39,8 +48,23 @@ public:
 	~WikiMarkupParser();
 	
 	void SetInput(const wchar_t* pInput);
+	void SetInput(const char* pUtf8Input, int length);
 	const wchar_t* GetOutput();
 	void Parse();
+	
+	// renders length chars of text like a separate parser (without expanding templates)
+	// would, right into the output of this one; the text is used in place, the char
+	// behind it is set to zero meanwhile
+	void ParseInline(wchar_t* text, int length=-1);
+	
+	// the utf-8 encoded size of the output and writing it, unlike GetOutput()
+	// this doesn't need to move the output to make room for the toc
+	size_t GetOutputUtf8Length();
+	bool WriteOutput(FILE* f);
+	
+	// the next Parse() writes the output utf-8 encoded to stream while it is rendered (and
+	// keeps it as well); a toc behind written output is sent at the end and moved by a script
+	void SetOutputStream(FILE* stream);
 		
 private:
 	const wchar_t* _languageCodeW;
@@ -50,15 +74,37 @@ private:
 	wchar_t*		_pCurrentInput;
 	int				_inputLength;
 
-	/* output buffer handling */
+	/* the input split into text runs and markup chars, see Tokenize() */
+	void*			_tokens;
+	int				_numberOfTokens;
+	int				_tokensSize;
+	int				_currentToken;
+	int				_firstToken;
+
+	/* output buffer handling, the output is terminated by GetOutput() only */
 	wchar_t*		_pOutput;
 	wchar_t*		_pCurrentOutput;
 	int				_iOutputSize;
 	int				_iOutputRemain;
 	
+	/* the stream the output is written to while rendering, the number of chars written
+	   already and whether a placeholder was written for the toc */
+	FILE*			_outputStream;
+	int				_flushedLength;
+	bool			_tocPlaceholder;
+	
 	/* should templates be expanded, usually this is only necessary for the first start	*/
 	bool _doExpandTemplates;
 	
+	/* the template budget used so far */
+	int _templateDepth;
+	int _expandedSize;
+	int _templateFetches;
+	bool _templateBudgetExceeded;
+	
+	/* the results of the templates expanded so far, by their text */
+	void* _expansions;
+	
 	/* do we deal with images ? */
 	bool _imagesInstalled;
 
@@ -75,6 +121,12 @@ private:
 		
  	/* this is a stack for tags, mainly usied for tables */
 	tagType* _pCurrentTag;
+	
+	/* the popped tags, they are used again */
+	tagType* _unusedTags;
+	
+	/* the number of ParseInline() calls the text is rendered by */
+	int _inlineDepth;
 
 	/* our current page name, can be null */
 	const wchar_t *_pageName;
@@ -85,6 +137,9 @@ private:
 	/* table of contents position */
 	int _tocPosition;
 	
+	/* the html of the toc, it is inserted at _tocPosition when the output is requested */
+	wstring _tocHtml;
+	
 	/* do we have a toc */
 	bool _noToc;
 	
@@ -97,6 +152,9 @@ private:
 	/* references list */
 	void* _references;
 	
+	/* internal links to check, in reverse order */
+	void* _links;
+	
 	/* simply a list of categories */
 	wchar_t* _categories;
 	
@@ -106,10 +164,14 @@ private:
 	ConfigFile* _languageConfig;
 	TitleIndex* _titleIndex;
 	
-	double EvaluateExpression(const wchar_t* expression);
-	
 	void ReplaceInput(const wchar_t* text, int position, int length);
 	
+	void Render();
+	void FreePageLists();
+	
+	void Tokenize();
+	wchar_t NextToken();
+	
 	wchar_t GetNextChar();
 	wchar_t Peek();
 	wchar_t Peek(int count);
@@ -120,6 +182,10 @@ private:
 	wchar_t* RemoveComments(const wchar_t* src);
 	wchar_t* ExpandTemplates(const wchar_t* src);
 	wchar_t* ExpandTemplate(const wchar_t* templateText);
+	bool TemplateBudgetExceeded();
+	wchar_t* FindExpansion(const wchar_t* templateText, bool* found);
+	void AddExpansion(const wchar_t* templateText, const wchar_t* result);
+	void FreeExpansions();
 	wchar_t* HandleKnownTemplatesAndVariables(const wchar_t* text);
 	wchar_t* NotHandledText(const wchar_t* text);
 		
@@ -130,24 +196,31 @@ private:
 	
 	bool GetPixelUnit(wchar_t* src, int* width, int* height);
 	
-	void PushTag(wchar_t* name, bool output=true);
-	void PopTag(wchar_t* name, bool output=true);
+	void PushTag(const wchar_t* name, bool output=true);
+	void PopTag(const wchar_t* name, bool output=true);
 	bool TopTagIs(wchar_t* name);
 	
+	void ReserveOutput(int length);
+	void ReleaseOutput();
+	
 	void Append(wchar_t c);
 	void Append(const wchar_t* msg);
+	void Append(const wchar_t* msg, int length);
 	void AppendHtml(const wchar_t* html);
+	void FlushOutput(bool last=false);
 
 	void HandleInternalLink(const wchar_t* linkText);
 	void HandleExternalLink(const wchar_t* linkText);
 	void HandleChar(wchar_t c);
-	void HandleHeadline(const wchar_t* headlineText, int level);
+	void HandleHeadline(wchar_t* headlineText, int level);
 	void HandleParagraph();
 	wchar_t* GetParams(bool stopAtExclamtionAlso);
 
 	void ParseNoWikiArea(int tagType);
 	void CloseOpenWikiTags();
 	void InsertToc();
+	void AddLinkToCheck(const wchar_t* link);
+	void CheckLinks();
 	void InsertReferences();
 	void InsertCategories();
 	
@@ -33,12 +33,7 @@
 #include "CPPStringUtils.h"
 #include "WikiMarkupGetter.h"
 #include "WikiMarkupParser.h"
-
-#define SERVER "wikiserver/1.0"
-#define PROTOCOL "HTTP/1.1"
-#define RFC1123FMT "%a, %d %b %Y %H:%M:%S GMT"
-
-#define DIRECTORY_LISTING_ALLOWED false
+#include "HttpServer.h"
 #import <Foundation/Foundation.h>
 @interface WikiServer:NSObject{
         Settings *_settings;
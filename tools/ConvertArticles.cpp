@@ -0,0 +1,494 @@
+/*
+ *  ConvertArticles.cpp
+ *  Wiki2Touch/wikisrvd
+ *
+ *  Copyright (c) 2008 by Tom Haukap.
+ *
+ *  This file is part of Wiki2Touch.
+ *
+ *  Wiki2Touch is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Wiki2Touch is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Wiki2Touch. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ Converts an articles.bin file (version 0 or 1) into a version 2 file which stores the
+ sort keys of the indexes behind every title. The compressed articles are copied as they
+ are. With -3 a version 3 file is written instead (a version 2 file is accepted as source
+ then): the bzip2 blocks are unpacked and the articles are stored in small frames which 
+ can be decompressed on their own. This runs on the desktop, build it with "make tools".
+
+ usage: ConvertArticles [-3] <source articles.bin> <destination articles.bin>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <bzlib.h>
+#include <zlib.h>
+#include <map>
+#include <vector>
+#include <algorithm>
+
+#include "TitleIndex.h"
+
+#define SIZEOF_POSITION_INFORMATION 16
+#define COPY_BUFFER_SIZE 65536
+#define FRAME_SIZE 32768
+
+typedef struct tagTITLERECORD
+{
+	fpos_t	blockPos;
+	int		articlePos;
+	int		articleLength;
+	string	title;
+} TITLERECORD;
+
+static bool read_record(FILE* f, fpos_t pos, TITLERECORD* record)
+{
+	if ( fseeko(f, pos, SEEK_SET) )
+		return false;
+
+	if ( fread(&record->blockPos, sizeof(record->blockPos), 1, f)!=1 ||
+		 fread(&record->articlePos, sizeof(record->articlePos), 1, f)!=1 ||
+		 fread(&record->articleLength, sizeof(record->articleLength), 1, f)!=1 )
+		return false;
+
+	record->title = string();
+
+	int c;
+	while ( (c=fgetc(f))!=EOF && c )
+		record->title += (char) c;
+
+	return c!=EOF;
+}
+
+static bool read_index(FILE* f, fpos_t pos, int numberOfArticles, int* index)
+{
+	if ( fseeko(f, pos, SEEK_SET) )
+		return false;
+
+	return fread(index, sizeof(int), numberOfArticles, f)==(size_t) numberOfArticles;
+}
+
+static bool write_string(FILE* f, const string& s)
+{
+	return fwrite(s.c_str(), 1, s.length()+1, f)==s.length()+1;
+}
+
+// the decompressed bzip2 block at pos (malloc'ed)
+static char* read_block(FILE* f, fpos_t pos, size_t* size)
+{
+	*size = 0;
+	
+	if ( fseeko(f, pos, SEEK_SET) )
+		return NULL;
+	
+	int bzerror;
+	BZFILE* bzf = BZ2_bzReadOpen(&bzerror, f, 0, 0, NULL, 0);
+	if ( !bzf )
+		return NULL;
+	
+	size_t capacity = COPY_BUFFER_SIZE;
+	char* data = (char*) malloc(capacity);
+	
+	while ( data )
+	{
+		if ( *size==capacity )
+		{
+			capacity *= 2;
+			data = (char*) realloc(data, capacity);
+			if ( !data )
+				break;
+		}
+		
+		int read = BZ2_bzRead(&bzerror, bzf, data + *size, capacity - *size);
+		if ( read>0 )
+			*size += read;
+		
+		if ( bzerror!=BZ_OK )
+			break;
+	}
+	
+	bool complete = bzerror==BZ_STREAM_END;
+	BZ2_bzReadClose(&bzerror, bzf);
+	
+	if ( !complete && data )
+	{
+		free(data);
+		data = NULL;
+	}
+	
+	return data;
+}
+
+/* collects the article stream of a version 3 file and writes it frame by frame */
+typedef struct tagFRAMEWRITER
+{
+	FILE*	f;
+	char*	data;
+	unsigned int size;
+	fpos_t	streamPos;
+	vector<fpos_t> framePositions;
+} FRAMEWRITER;
+
+static bool write_frame(FRAMEWRITER* writer)
+{
+	if ( !writer->size )
+		return true;
+	
+	uLongf length = compressBound(writer->size);
+	Bytef* compressed = (Bytef*) malloc(length);
+	
+	bool error = !compressed || compress2(compressed, &length, (const Bytef*) writer->data, writer->size, Z_BEST_COMPRESSION)!=Z_OK;
+	
+	writer->framePositions.push_back(ftello(writer->f));
+	error = error || fwrite(compressed, 1, length, writer->f)!=length;
+	
+	if ( compressed )
+		free(compressed);
+	
+	writer->size = 0;
+	return !error;
+}
+
+static bool append_frames(FRAMEWRITER* writer, const char* data, size_t size)
+{
+	while ( size>0 )
+	{
+		size_t length = FRAME_SIZE - writer->size;
+		if ( length>size )
+			length = size;
+		
+		memcpy(writer->data + writer->size, data, length);
+		writer->size += length;
+		writer->streamPos += length;
+		data += length;
+		size -= length;
+		
+		if ( writer->size==FRAME_SIZE && !write_frame(writer) )
+			return false;
+	}
+	
+	return true;
+}
+
+// orders the records by their location in the source file
+struct RecordOrder
+{
+	const TITLERECORD* records;
+	
+	RecordOrder(const TITLERECORD* records) : records(records) {}
+	bool operator()(int a, int b) const
+	{
+		if ( records[a].blockPos!=records[b].blockPos )
+			return records[a].blockPos<records[b].blockPos;
+		if ( records[a].articlePos!=records[b].articlePos )
+			return records[a].articlePos<records[b].articlePos;
+		return records[a].articleLength<records[b].articleLength;
+	}
+};
+
+/*
+ Writes the articles of all records as frames behind the header and updates the records 
+ with their position in the stream. Articles referred to by several titles are stored once.
+ */
+static bool write_frames(FILE* src, FILE* dst, TITLERECORD* records, int numberOfArticles, FILEHEADER* fileheader)
+{
+	int* order = new int[numberOfArticles];
+	for (int i=0; i<numberOfArticles; i++)
+		order[i] = i;
+	
+	sort(order, order + numberOfArticles, RecordOrder(records));
+	
+	FRAMEWRITER writer;
+	writer.f = dst;
+	writer.data = (char*) malloc(FRAME_SIZE);
+	writer.size = 0;
+	writer.streamPos = 0;
+	
+	char* block = NULL;
+	size_t blockSize = 0;
+	fpos_t blockPos = -1;
+	
+	// the source location of the article written last and the record holding its new one
+	TITLERECORD* previous = NULL;
+	fpos_t previousBlockPos = 0;
+	int previousArticlePos = 0;
+	int previousArticleLength = 0;
+	
+	bool error = !writer.data;
+	
+	for (int i=0; !error && i<numberOfArticles; i++)
+	{
+		TITLERECORD* record = &records[order[i]];
+		
+		// the same article as before
+		if ( previous && record->blockPos==previousBlockPos && record->articlePos==previousArticlePos && record->articleLength==previousArticleLength )
+		{
+			record->blockPos = previous->blockPos;
+			record->articlePos = 0;
+			record->articleLength = previous->articleLength;
+			continue;
+		}
+		
+		TITLERECORD source = *record;
+		
+		previous = record;
+		previousBlockPos = source.blockPos;
+		previousArticlePos = source.articlePos;
+		previousArticleLength = source.articleLength;
+		
+		if ( source.blockPos!=blockPos )
+		{
+			if ( block )
+				free(block);
+			
+			blockPos = source.blockPos;
+			block = read_block(src, blockPos, &blockSize);
+			if ( !block )
+			{
+				printf("unable to decompress the block at %lld\r\n", (long long) blockPos);
+				error = true;
+				break;
+			}
+		}
+		
+		// like the reader does, the article ends with the block
+		size_t length = 0;
+		if ( source.articlePos>=0 && (size_t) source.articlePos<blockSize )
+		{
+			length = blockSize - source.articlePos;
+			if ( length>(size_t) source.articleLength )
+				length = source.articleLength;
+		}
+		
+		record->blockPos = writer.streamPos;
+		record->articlePos = 0;
+		record->articleLength = length;
+		
+		error = !append_frames(&writer, block + source.articlePos, length);
+	}
+	
+	error = error || !write_frame(&writer);
+	
+	if ( block )
+		free(block);
+	if ( writer.data )
+		free(writer.data);
+	delete[] order;
+	
+	// the end of the last frame closes the table
+	fileheader->framesPos = ftello(dst);
+	fileheader->frameSize = FRAME_SIZE;
+	fileheader->numberOfFrames = writer.framePositions.size();
+	writer.framePositions.push_back(fileheader->framesPos);
+	
+	error = error || fwrite(&writer.framePositions[0], sizeof(fpos_t), writer.framePositions.size(), dst)!=writer.framePositions.size();
+	
+	return !error;
+}
+
+int main(int argc, char* argv[])
+{
+	bool framed = argc>1 && !strcmp(argv[1], "-3");
+	if ( framed )
+	{
+		argc--;
+		argv++;
+	}
+	
+	if ( argc!=3 || !strcmp(argv[1], argv[2]) )
+	{
+		printf("usage: %s [-3] <source articles.bin> <destination articles.bin>\r\n", argv[0]);
+		return 1;
+	}
+
+	FILE* src = fopen(argv[1], "rb");
+	if ( !src )
+	{
+		printf("unable to open %s\r\n", argv[1]);
+		return 1;
+	}
+
+	// version 0 files have a shorter header, this reads into the data but these fields aren't used then
+	FILEHEADER fileheader;
+	if ( fread(&fileheader, sizeof(FILEHEADER), 1, src)!=1 )
+	{
+		printf("%s is not an articles file\r\n", argv[1]);
+		return 1;
+	}
+
+	if ( fileheader.version>(framed ? 2 : 1) )
+	{
+		printf("%s has version %i, only version 0 and 1 (or 2 with -3) files can be converted\r\n", argv[1], fileheader.version);
+		return 1;
+	}
+
+	int numberOfArticles = fileheader.numberOfArticles;
+	fpos_t indexPos_1 = fileheader.version>=1 ? fileheader.indexPos_1 : 0;
+	bool chinese = (tolower(fileheader.languageCode[0])=='z') && (tolower(fileheader.languageCode[1])=='h');
+
+	int* index_0 = (int*) malloc(sizeof(int)*numberOfArticles);
+	int* index_1 = indexPos_1 ? (int*) malloc(sizeof(int)*numberOfArticles) : NULL;
+
+	if ( !read_index(src, fileheader.indexPos_0, numberOfArticles, index_0) || (index_1 && !read_index(src, indexPos_1, numberOfArticles, index_1)) )
+	{
+		printf("unable to read the indexes\r\n");
+		return 1;
+	}
+
+	// the titles in the order of index 0, the second index refers to the same records
+	TITLERECORD* records = new TITLERECORD[numberOfArticles];
+	fpos_t dataPos = fileheader.titlesPos;
+
+	for (int i=0; i<numberOfArticles; i++)
+	{
+		if ( !read_record(src, fileheader.titlesPos + index_0[i], &records[i]) )
+		{
+			printf("unable to read title %i\r\n", i);
+			return 1;
+		}
+
+		if ( records[i].blockPos<dataPos )
+			dataPos = records[i].blockPos;
+	}
+
+	if ( dataPos<(fpos_t) sizeof(FILEHEADER) && fileheader.version>=1 )
+	{
+		printf("compressed data overlaps the header\r\n");
+		return 1;
+	}
+
+	FILE* dst = fopen(argv[2], "wb");
+	if ( !dst )
+	{
+		printf("unable to create %s\r\n", argv[2]);
+		return 1;
+	}
+
+	// the compressed articles, version 0 headers are shorter, so they may move
+	fpos_t delta = (fpos_t) sizeof(FILEHEADER) - dataPos;
+
+	FILEHEADER newFileheader = fileheader;
+	if ( fileheader.version==0 )
+	{
+		newFileheader.indexPos_1 = 0;
+		memset(newFileheader.reserved1, 0, sizeof(newFileheader.reserved1));
+		memset(newFileheader.imageNamespace, 0, sizeof(newFileheader.imageNamespace));
+		memset(newFileheader.templateNamespace, 0, sizeof(newFileheader.templateNamespace));
+	}
+	newFileheader.version = framed ? ARTICLES_FRAMED_VERSION : 2;
+	newFileheader.titleKeys = TITLEKEY_LOWERCASE | (indexPos_1 ? TITLEKEY_SEARCH : 0);
+	newFileheader.framesPos = 0;
+	newFileheader.frameSize = 0;
+	newFileheader.numberOfFrames = 0;
+	memset(newFileheader.reserved2, 0, sizeof(newFileheader.reserved2));
+
+	// written again at the end with the final positions
+	bool error = fwrite(&newFileheader, sizeof(FILEHEADER), 1, dst)!=1;
+
+	if ( framed )
+	{
+		// the records refer to the stream afterwards
+		error = error || !write_frames(src, dst, records, numberOfArticles, &newFileheader);
+		delta = 0;
+		
+		newFileheader.titlesPos = ftello(dst);
+	}
+	else
+	{
+		char* buffer = (char*) malloc(COPY_BUFFER_SIZE);
+		fpos_t remaining = fileheader.titlesPos - dataPos;
+
+		error = error || fseeko(src, dataPos, SEEK_SET);
+		while ( !error && remaining>0 )
+		{
+			size_t size = remaining>COPY_BUFFER_SIZE ? COPY_BUFFER_SIZE : (size_t) remaining;
+
+			error = fread(buffer, 1, size, src)!=size || fwrite(buffer, 1, size, dst)!=size;
+			remaining -= size;
+		}
+
+		free(buffer);
+		
+		newFileheader.titlesPos = sizeof(FILEHEADER) + (fileheader.titlesPos - dataPos);
+	}
+
+	// the titles followed by their keys
+
+	std::map<int, int> newTitlePos;
+	int titlePos = 0;
+
+	for (int i=0; !error && i<numberOfArticles; i++)
+	{
+		TITLERECORD* record = &records[i];
+		fpos_t blockPos = record->blockPos + delta;
+
+		newTitlePos[index_0[i]] = titlePos;
+		index_0[i] = titlePos;
+
+		error = fwrite(&blockPos, sizeof(blockPos), 1, dst)!=1 ||
+				fwrite(&record->articlePos, sizeof(record->articlePos), 1, dst)!=1 ||
+				fwrite(&record->articleLength, sizeof(record->articleLength), 1, dst)!=1 ||
+				!write_string(dst, record->title) ||
+				!write_string(dst, TitleIndex::LowercaseKey(record->title)) ||
+				(indexPos_1 && !write_string(dst, TitleIndex::SearchKey(record->title, chinese)));
+
+		titlePos += SIZEOF_POSITION_INFORMATION + record->title.length() + 1;
+		titlePos += TitleIndex::LowercaseKey(record->title).length() + 1;
+		if ( indexPos_1 )
+			titlePos += TitleIndex::SearchKey(record->title, chinese).length() + 1;
+	}
+
+	delete[] records;
+
+	for (int i=0; !error && index_1 && i<numberOfArticles; i++)
+	{
+		std::map<int, int>::iterator it = newTitlePos.find(index_1[i]);
+		if ( it==newTitlePos.end() )
+		{
+			printf("index 1 refers to a title missing in index 0\r\n");
+			error = true;
+		}
+		else
+			index_1[i] = it->second;
+	}
+
+	newFileheader.indexPos_0 = newFileheader.titlesPos + titlePos;
+	error = error || fwrite(index_0, sizeof(int), numberOfArticles, dst)!=(size_t) numberOfArticles;
+
+	if ( index_1 )
+	{
+		newFileheader.indexPos_1 = newFileheader.indexPos_0 + (fpos_t) numberOfArticles*sizeof(int);
+		error = error || fwrite(index_1, sizeof(int), numberOfArticles, dst)!=(size_t) numberOfArticles;
+	}
+
+	error = error || fseeko(dst, 0, SEEK_SET) || fwrite(&newFileheader, sizeof(FILEHEADER), 1, dst)!=1;
+	error = fclose(dst) || error;
+	fclose(src);
+
+	free(index_0);
+	if ( index_1 )
+		free(index_1);
+
+	if ( error )
+	{
+		printf("unable to write %s\r\n", argv[2]);
+		remove(argv[2]);
+		return 1;
+	}
+
+	printf("%s: %i articles converted\r\n", argv[2], numberOfArticles);
+	return 0;
+}
@@ -0,0 +1,114 @@
+/*
+ *  TestExpressions.cpp
+ *  Wiki2Touch/wikisrvd
+ *
+ *  Copyright (c) 2008 by Tom Haukap.
+ *
+ *  This file is part of Wiki2Touch.
+ *
+ *  Wiki2Touch is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Wiki2Touch is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Wiki2Touch. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ Checks Expression::Evaluate() against a corpus: every line holds an expression and the
+ result #expr shows for it, separated by a tab; empty lines and lines starting with "#" are
+ skipped. Every expression is evaluated twice, the second result comes from the cache. This
+ runs on the desktop, build and run it with "make check".
+
+ usage: TestExpressions <corpus>
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "Expression.h"
+#include "CPPStringUtils.h"
+
+#define MAX_LINE_LENGTH 4096
+
+static const char* errorStart = "<strong class=\"error\">";
+
+static bool check(int lineNo, const string& text, const string& expected)
+{
+	wstring expression = CPPStringUtils::from_utf8w(text);
+
+	for (int i=0; i<2; i++)
+	{
+		bool error;
+		string result = CPPStringUtils::to_utf8(Expression::Evaluate(expression.c_str(), &error));
+		bool expectedError = !strncmp(expected.c_str(), errorStart, strlen(errorStart));
+
+		if ( result!=expected || error!=expectedError )
+		{
+			printf("line %d%s: %s\r\n", lineNo, i ? " (cached)" : "", text.c_str());
+			printf("  expected: %s\r\n", expected.c_str());
+			printf("  result:   %s%s\r\n", result.c_str(), error ? " (error)" : "");
+			return false;
+		}
+	}
+
+	return true;
+}
+
+int main(int argc, char** argv)
+{
+	if ( argc!=2 )
+	{
+		printf("usage: TestExpressions <corpus>\r\n");
+		return 2;
+	}
+
+	FILE* f = fopen(argv[1], "r");
+	if ( !f )
+	{
+		printf("Cannot open %s\r\n", argv[1]);
+		return 2;
+	}
+
+	char line[MAX_LINE_LENGTH];
+	int lineNo = 0;
+	int count = 0;
+	int failed = 0;
+
+	while ( fgets(line, sizeof(line), f) )
+	{
+		lineNo++;
+
+		size_t length = strlen(line);
+		while ( length && (line[length-1]=='\n' || line[length-1]=='\r') )
+			line[--length] = 0x0;
+
+		if ( !length || line[0]=='#' )
+			continue;
+
+		char* tab = strchr(line, '\t');
+		if ( !tab )
+		{
+			printf("line %d: no tab between the expression and the result\r\n", lineNo);
+			failed++;
+			continue;
+		}
+		*tab = 0x0;
+
+		count++;
+		if ( !check(lineNo, line, tab + 1) )
+			failed++;
+	}
+
+	fclose(f);
+
+	printf("%d expressions, %d failed\r\n", count, failed);
+
+	return failed ? 1 : 0;
+}